@@ -0,0 +1,546 @@
+//s25bench.c
+/* Load generator for S1. N connections each run a random mix of uploads,
+ * downloads, listings, removes and archive downloads for a fixed time (or
+ * number of operations) and time every one; the totals are printed as JSON
+ * on stdout (or -o FILE) and as a short table on stderr.
+ *
+ * Uploads are synthetic files: a size drawn from -s (SIZE or LOW-HIGH, each
+ * with a :WEIGHT), an extension drawn from -e, and contents cut from a
+ * random block. Each connection works in a directory of its own under -D
+ * and keeps up to BENCH_KEEP files, uploading over them once it has that
+ * many, for the downloads and removes to pick from; with none left, an
+ * upload is done instead.
+ *
+ *     ./s25bench -c 16 -t 30 -m upload:30,download:60,list:10 -s 4k:90,4m:10 > run.json
+ *
+ * Everything is v2 with checksums and, for files over one chunk, in
+ * large-object mode, as s25client does. Redirects are not offered, so all
+ * the bytes go through S1.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+
+#define SERVER_IP "127.0.0.1"
+#define SERVER_PORT 7348
+#define BUF 4096
+#define BENCH_CONNS 8
+#define BENCH_SECS 10
+#define BENCH_BLOCK (1 << 20)   // random bytes uploads are cut from
+#define BENCH_KEEP 256          // uploaded files a connection keeps track of
+#define BENCH_NAME 64
+#define BENCH_EXT 17            // longest extension, with its NUL
+#define DIST_MAX 16             // sizes or extensions to pick from
+
+#include "s25proto.h"
+
+enum bench_op { B_UPLOAD, B_DOWNLOAD, B_LIST, B_REMOVE, B_TAR, B_OPS };
+
+static const char *const bench_names[B_OPS] = { "upload", "download", "list", "remove", "tar" };
+
+/* A weighted choice: sizes (lo..hi) or extensions */
+struct dist {
+    int n;
+    unsigned total;
+    unsigned weight[DIST_MAX];
+    uint64_t lo[DIST_MAX], hi[DIST_MAX];
+    char ext[DIST_MAX][BENCH_EXT];
+};
+
+/* One connection and what it measured */
+struct bench_conn {
+    struct s25_peer srv;
+    uint32_t reqid;
+    uint64_t rng;
+    char dir[BUF];
+    char names[BENCH_KEEP][BENCH_NAME];     // files it uploaded and still has
+    int nfiles;
+    uint64_t seq;
+    int lost;                               // the connection could not be restored
+    uint64_t ops[B_OPS], errors[B_OPS], bytes[B_OPS];
+    struct hist lat[B_OPS];
+};
+
+// Settings (see usage())
+static const char *host = SERVER_IP;
+static int port = SERVER_PORT;
+static int nconns = BENCH_CONNS;
+static int secs = BENCH_SECS;
+static uint64_t max_ops;                    // per connection; 0 = run for secs
+static unsigned mix[B_OPS];
+static unsigned mix_total;
+static struct dist sizes, exts;
+static const char *size_spec = "4k:60,64k:30,1m:9,16m:1";
+static const char *ext_spec = ".pdf,.txt,.zip,.c";
+static const char *mix_spec = "upload:40,download:40,list:10,remove:8,tar:2";
+static const char *base_dir = "~/S1/bench";
+static uint64_t seed = 1;
+
+static char block[BENCH_BLOCK];
+static uint64_t deadline;                   // metrics_now_us() at which to stop
+static pthread_barrier_t ready;
+
+static void usage(const char *prog){
+    fprintf(stderr, "usage: %s [-H host] [-p port] [-c connections] [-t seconds] [-n ops-per-connection]\n"
+                    "          [-m op:weight,...] [-s size[-size]:weight,...] [-e ext[:weight],...]\n"
+                    "          [-D dir] [-S seed] [-o file]\n"
+                    "ops: upload download list remove tar; sizes take k, m and g\n", prog);
+}
+
+/* xorshift64*: cheap, and each connection has its own */
+static uint64_t bench_rand(struct bench_conn *c){
+    c->rng ^= c->rng >> 12;
+    c->rng ^= c->rng << 25;
+    c->rng ^= c->rng >> 27;
+    return c->rng * 2685821657736338717ULL;
+}
+
+/* A byte count with an optional k, m or g suffix; 0 if it is not one */
+static uint64_t parse_size(const char *s, char **end){
+    uint64_t v = strtoull(s, end, 10);
+    switch(**end) {
+        case 'k': case 'K': v <<= 10; (*end)++; break;
+        case 'm': case 'M': v <<= 20; (*end)++; break;
+        case 'g': case 'G': v <<= 30; (*end)++; break;
+    }
+    return *end == s ? 0 : v;
+}
+
+/* Parse "item[:weight],..." into d; sized entries are SIZE or LOW-HIGH.
+ * Returns 0 on a malformed list. */
+static int parse_dist(const char *spec, struct dist *d, int sized){
+    char copy[BUF];
+    snprintf(copy, sizeof(copy), "%s", spec);
+    memset(d, 0, sizeof(*d));
+    for(char *save, *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)){
+        if(d->n == DIST_MAX) return 0;
+        char *colon = strchr(item, ':');
+        unsigned w = colon ? (unsigned)strtoul(colon + 1, NULL, 10) : 1;
+        if(colon) *colon = '\0';
+        if(sized) {
+            char *end;
+            d->lo[d->n] = d->hi[d->n] = parse_size(item, &end);
+            if(*end == '-') d->hi[d->n] = parse_size(end + 1, &end);
+            if(*end || d->lo[d->n] == 0 || d->hi[d->n] < d->lo[d->n]) return 0;
+        } else {
+            if(item[0] != '.' || strlen(item) >= BENCH_EXT) return 0;
+            snprintf(d->ext[d->n], BENCH_EXT, "%s", item);
+        }
+        d->weight[d->n++] = w;
+        d->total += w;
+    }
+    return d->total > 0;
+}
+
+/* Parse "op:weight,..."; ops not named get weight 0 */
+static int parse_mix(const char *spec){
+    char copy[BUF];
+    snprintf(copy, sizeof(copy), "%s", spec);
+    memset(mix, 0, sizeof(mix));
+    for(char *save, *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)){
+        char *colon = strchr(item, ':');
+        unsigned w = colon ? (unsigned)strtoul(colon + 1, NULL, 10) : 1;
+        if(colon) *colon = '\0';
+        int op = 0;
+        while(op < B_OPS && strcmp(item, bench_names[op]) != 0) op++;
+        if(op == B_OPS) return 0;
+        mix[op] = w;
+    }
+    mix_total = 0;
+    for(int op = 0; op < B_OPS; op++) mix_total += mix[op];
+    return mix_total > 0;
+}
+
+/* Index of a weighted pick among n weights adding up to total */
+static int pick(struct bench_conn *c, const unsigned *weight, int n, unsigned total){
+    unsigned r = bench_rand(c) % total;
+    int i = 0;
+    while(i < n - 1 && r >= weight[i]) r -= weight[i++];
+    return i;
+}
+
+static int connect_s1(void){
+    struct addrinfo hints = { 0 }, *ai;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    int err = getaddrinfo(host, service, &hints, &ai);
+    if(err != 0) {
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+        return -1;
+    }
+    int s = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(s >= 0 && connect(s, ai->ai_addr, ai->ai_addrlen) < 0) {
+        perror("connect");
+        close(s);
+        s = -1;
+    }
+    freeaddrinfo(ai);
+    if(s < 0) return -1;
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return s;
+}
+
+/* ---------- file contents ---------- */
+
+/* Upload payload: the random block over and over, checksummed as it goes */
+static int block_payload(void *ctx, int sock, uint64_t off, uint64_t len){
+    uint32_t *crc = ctx;
+    while(len > 0){
+        uint64_t at = off % BENCH_BLOCK;
+        size_t n = len < BENCH_BLOCK - at ? len : BENCH_BLOCK - at;
+        if(!send_all(sock, block + at, n)) return 0;
+        *crc = crc32c(*crc, block + at, n);
+        off += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/* Download sink: read and checksum the bytes, keep nothing */
+static int discard_sink(void *ctx, int sock, uint64_t off, uint64_t len){
+    uint32_t *crc = ctx;
+    char buf[S25_IO_BUF];
+    (void)off;
+    while(len > 0){
+        ssize_t n = recv(sock, buf, len > S25_IO_BUF ? S25_IO_BUF : len, 0);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        *crc = crc32c(*crc, buf, n);
+        len -= n;
+    }
+    return 1;
+}
+
+/* Receive an announced object of len bytes and check its CRC if it has
+ * one: 1 intact, 0 refused or damaged, -1 connection lost */
+static int recv_discard(struct s25_peer *p, uint64_t len, uint32_t flags){
+    uint32_t crc = 0, sent;
+    int st = (flags & S25_F_CHUNKED) ? s25_recv_chunked(p, len, discard_sink, &crc)
+                                     : discard_sink(&crc, p->fd, 0, len);
+    if(st < 0 || !(flags & S25_F_CRC)) return st;
+    if(!s25_recv_crc(p->fd, &sent)) return -1;
+    return st && sent == crc;
+}
+
+/* ---------- operations ----------
+ * Each returns 1 when it succeeded, 0 when the server refused it and -1
+ * when the connection was lost; *bytes is the file data moved. */
+
+static int op_upload(struct bench_conn *c, uint64_t *bytes){
+    // A new name while there is room, else a file it has is overwritten
+    int slot = c->nfiles < BENCH_KEEP ? c->nfiles : (int)(bench_rand(c) % BENCH_KEEP);
+    char name[BUF];
+    if(slot < c->nfiles) {
+        snprintf(name, BENCH_NAME, "%s", c->names[slot]);
+    } else {
+        const char *ext = exts.ext[pick(c, exts.weight, exts.n, exts.total)];
+        snprintf(name, BENCH_NAME, "f%llu%s", (unsigned long long)c->seq++, ext);
+    }
+    int d = pick(c, sizes.weight, sizes.n, sizes.total);
+    uint64_t size = sizes.lo[d] + (sizes.hi[d] > sizes.lo[d] ? bench_rand(c) % (sizes.hi[d] - sizes.lo[d] + 1) : 0);
+    int chunked = size > S25_CHUNK;
+
+    struct s25_buf req;
+    s25_start(&req, 2, OP_UPLOADF, ++c->reqid);
+    s25_put_u32(&req, 1);
+    s25_put_str(&req, c->dir);
+    s25_put_str(&req, name);
+    s25_put_u64(&req, size);
+    s25_set_flags(&req, (chunked ? S25_F_CHUNKED : 0) | S25_F_CRC);
+    s25_finish(&req, (chunked ? s25_chunked_len(size) : size) + S25_CRC_LEN);
+    if(!s25_send_buf(c->srv.fd, &req)) return -1;
+
+    uint32_t crc = 0;
+    int sent = chunked ? s25_send_chunked(&c->srv, size, block_payload, &crc) >= 0
+                       : block_payload(&crc, c->srv.fd, 0, size);
+    if(!sent || !s25_send_crc(c->srv.fd, crc)) return -1;
+    int st = s25_recv_status(&c->srv);
+    if(st == 1) {
+        snprintf(c->names[slot], BENCH_NAME, "%s", name);
+        if(slot == c->nfiles) c->nfiles++;
+        *bytes = size;
+    }
+    return st;
+}
+
+/* A file the connection has, or -1 */
+static int pick_file(struct bench_conn *c){
+    return c->nfiles ? (int)(bench_rand(c) % c->nfiles) : -1;
+}
+
+static int op_download(struct bench_conn *c, int i, uint64_t *bytes){
+    char path[BUF + BENCH_NAME];
+    snprintf(path, sizeof(path), "%s/%s", c->dir, c->names[i]);
+    struct s25_buf req;
+    s25_start(&req, 2, OP_DOWNLF, ++c->reqid);
+    s25_put_u32(&req, 1);
+    s25_put_str(&req, path);
+    s25_set_flags(&req, S25_F_CHUNKED | S25_F_CRC);
+    s25_finish(&req, 0);
+    uint64_t len;
+    uint32_t flags;
+    if(!s25_send_buf(c->srv.fd, &req) || !s25_recv_data(&c->srv, &len, &flags)) return -1;
+    if(flags & S25_F_ERROR) return s25_drain(c->srv.fd, len) ? 0 : -1;
+    int st = recv_discard(&c->srv, len, flags);
+    if(st == 1) *bytes = len;
+    return st;
+}
+
+static int op_list(struct bench_conn *c, uint64_t *bytes){
+    struct s25_buf req;
+    s25_start(&req, 2, OP_DISPFNAMES, ++c->reqid);
+    s25_put_str(&req, c->dir);
+    s25_finish(&req, 0);
+    if(!s25_send_buf(c->srv.fd, &req)) return -1;
+    uint64_t len;
+    uint32_t flags;
+    do {
+        if(!s25_recv_data(&c->srv, &len, &flags) || !s25_drain(c->srv.fd, len)) return -1;
+        *bytes += len;
+    } while(flags & S25_F_MORE);
+    return !(flags & S25_F_ERROR);
+}
+
+static int op_remove(struct bench_conn *c, int i){
+    char path[BUF + BENCH_NAME];
+    snprintf(path, sizeof(path), "%s/%s", c->dir, c->names[i]);
+    struct s25_buf req;
+    s25_start(&req, 2, OP_REMOVEF, ++c->reqid);
+    s25_put_u32(&req, 1);
+    s25_put_str(&req, path);
+    s25_finish(&req, 0);
+    if(!s25_send_buf(c->srv.fd, &req)) return -1;
+    int st = s25_recv_status(&c->srv);
+    if(st >= 0) {
+        // Gone either way: the last name takes its place
+        memcpy(c->names[i], c->names[--c->nfiles], BENCH_NAME);
+    }
+    return st;
+}
+
+static int op_tar(struct bench_conn *c, uint64_t *bytes){
+    char type[BUF];
+    snprintf(type, sizeof(type), "%s", exts.ext[pick(c, exts.weight, exts.n, exts.total)]);
+    struct s25_buf req;
+    s25_start(&req, 2, OP_DOWNLTAR, ++c->reqid);
+    s25_put_str(&req, type);
+    s25_set_flags(&req, S25_F_CHUNKED);
+    s25_finish(&req, 0);
+    uint64_t len;
+    uint32_t flags;
+    if(!s25_send_buf(c->srv.fd, &req) || !s25_recv_data(&c->srv, &len, &flags)) return -1;
+    if(flags & S25_F_ERROR) return s25_drain(c->srv.fd, len) ? 0 : -1;
+    int st = recv_discard(&c->srv, len, flags);
+    if(st == 1) *bytes = len;
+    return st;
+}
+
+/* ---------- running ---------- */
+
+/* Run one operation of the mix and record it. Returns 0 once the
+ * connection is lost for good. */
+static int bench_step(struct bench_conn *c){
+    int op = pick(c, mix, B_OPS, mix_total);
+    int i = -1;
+    if(op == B_DOWNLOAD || op == B_REMOVE) {
+        i = pick_file(c);
+        if(i < 0) op = B_UPLOAD;
+    }
+    uint64_t bytes = 0, start = metrics_now_us();
+    int st;
+    switch(op) {
+        case B_UPLOAD: st = op_upload(c, &bytes); break;
+        case B_DOWNLOAD: st = op_download(c, i, &bytes); break;
+        case B_LIST: st = op_list(c, &bytes); break;
+        case B_REMOVE: st = op_remove(c, i); break;
+        default: st = op_tar(c, &bytes); break;
+    }
+    hist_add(&c->lat[op], metrics_now_us() - start);
+    c->ops[op]++;
+    c->bytes[op] += bytes;
+    if(st == 1) return 1;
+    c->errors[op]++;
+    if(st == 0) return 1;
+
+    // Out of sync: carry on over a new connection
+    close(c->srv.fd);
+    c->srv.fd = connect_s1();
+    return c->srv.fd >= 0;
+}
+
+static void *bench_worker(void *arg){
+    struct bench_conn *c = arg;
+    c->srv.fd = connect_s1();
+    pthread_barrier_wait(&ready);
+    if(c->srv.fd < 0) {
+        c->lost = 1;
+        return NULL;
+    }
+    for(uint64_t n = 0; max_ops ? n < max_ops : metrics_now_us() < deadline; n++){
+        if(!bench_step(c)) {
+            c->lost = 1;
+            break;
+        }
+    }
+    if(c->srv.fd >= 0) close(c->srv.fd);
+    return NULL;
+}
+
+/* ---------- results ---------- */
+
+/* Write the results to f as JSON and as a table to stderr. Returns the
+ * number of connections that were lost for good. */
+static int report(FILE *f, struct bench_conn *conns, double elapsed){
+    struct hist *all = calloc(B_OPS, sizeof(*all));
+    uint64_t ops[B_OPS] = { 0 }, errors[B_OPS] = { 0 }, bytes[B_OPS] = { 0 };
+    uint64_t total_ops = 0, total_errors = 0, total_bytes = 0;
+    int lost = 0;
+    for(int k = 0; k < nconns; k++){
+        lost += conns[k].lost;
+        for(int op = 0; op < B_OPS; op++){
+            if(all) hist_merge(&all[op], &conns[k].lat[op]);
+            ops[op] += conns[k].ops[op];
+            errors[op] += conns[k].errors[op];
+            bytes[op] += conns[k].bytes[op];
+        }
+    }
+    for(int op = 0; op < B_OPS; op++){
+        total_ops += ops[op];
+        total_errors += errors[op];
+        total_bytes += bytes[op];
+    }
+
+    fprintf(f, "{\"config\":{\"host\":\"%s\",\"port\":%d,\"connections\":%d,", host, port, nconns);
+    if(max_ops) fprintf(f, "\"ops_per_connection\":%llu,", (unsigned long long)max_ops);
+    else fprintf(f, "\"seconds\":%d,", secs);
+    fprintf(f, "\"mix\":\"%s\",\"sizes\":\"%s\",\"exts\":\"%s\",\"dir\":\"%s\",\"seed\":%llu},",
+            mix_spec, size_spec, ext_spec, base_dir, (unsigned long long)seed);
+    fprintf(f, "\"elapsed_s\":%.3f,\"connections_lost\":%d,", elapsed, lost);
+    fprintf(f, "\"total\":{\"ops\":%llu,\"errors\":%llu,\"bytes\":%llu,\"ops_per_s\":%.1f,\"mb_per_s\":%.2f},",
+            (unsigned long long)total_ops, (unsigned long long)total_errors,
+            (unsigned long long)total_bytes, total_ops / elapsed, total_bytes / elapsed / 1e6);
+    fprintf(f, "\"commands\":{");
+    for(int op = 0, first = 1; op < B_OPS; op++){
+        if(!mix[op] && !ops[op]) continue;
+        fprintf(f, "%s\"%s\":{\"ops\":%llu,\"errors\":%llu,\"bytes\":%llu,\"ops_per_s\":%.1f,"
+                   "\"mb_per_s\":%.2f,\"latency\":", first ? "" : ",", bench_names[op],
+                (unsigned long long)ops[op], (unsigned long long)errors[op],
+                (unsigned long long)bytes[op], ops[op] / elapsed, bytes[op] / elapsed / 1e6);
+        if(all) metrics_hist_json(f, &all[op]);
+        else fprintf(f, "null");
+        fprintf(f, "}");
+        first = 0;
+    }
+    fprintf(f, "}}\n");
+
+    // and a table for the terminal
+    fprintf(stderr, "%-10s %9s %7s %10s %9s %9s %9s %9s\n", "command", "ops", "errors",
+            "ops/s", "MB/s", "p50_us", "p99_us", "p999_us");
+    for(int op = 0; op < B_OPS && all; op++){
+        if(!ops[op]) continue;
+        fprintf(stderr, "%-10s %9llu %7llu %10.1f %9.2f %9llu %9llu %9llu\n", bench_names[op],
+                (unsigned long long)ops[op], (unsigned long long)errors[op], ops[op] / elapsed,
+                bytes[op] / elapsed / 1e6, (unsigned long long)hist_quantile(&all[op], 0.5),
+                (unsigned long long)hist_quantile(&all[op], 0.99),
+                (unsigned long long)hist_quantile(&all[op], 0.999));
+    }
+    fprintf(stderr, "%-10s %9llu %7llu %10.1f %9.2f  in %.1f s over %d connections\n", "total",
+            (unsigned long long)total_ops, (unsigned long long)total_errors, total_ops / elapsed,
+            total_bytes / elapsed / 1e6, elapsed, nconns);
+    free(all);
+    return lost;
+}
+
+int main(int argc, char *argv[]){
+    const char *out_file = NULL;
+    int opt_c;
+    while((opt_c = getopt(argc, argv, "H:p:c:t:n:m:s:e:D:S:o:")) != -1) {
+        switch(opt_c) {
+            case 'H': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'c': nconns = atoi(optarg); break;
+            case 't': secs = atoi(optarg); break;
+            case 'n': max_ops = strtoull(optarg, NULL, 10); break;
+            case 'm': mix_spec = optarg; break;
+            case 's': size_spec = optarg; break;
+            case 'e': ext_spec = optarg; break;
+            case 'D': base_dir = optarg; break;
+            case 'S': seed = strtoull(optarg, NULL, 10); break;
+            case 'o': out_file = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(nconns < 1 || (secs < 1 && !max_ops)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if(!parse_mix(mix_spec)) {
+        fprintf(stderr, "bad mix: %s\n", mix_spec);
+        return 1;
+    }
+    if(!parse_dist(size_spec, &sizes, 1)) {
+        fprintf(stderr, "bad sizes: %s\n", size_spec);
+        return 1;
+    }
+    if(!parse_dist(ext_spec, &exts, 0)) {
+        fprintf(stderr, "bad extensions: %s\n", ext_spec);
+        return 1;
+    }
+    FILE *out = out_file ? fopen(out_file, "w") : stdout;
+    if(!out) {
+        perror(out_file);
+        return 1;
+    }
+    crc_init();
+    signal(SIGPIPE, SIG_IGN);
+
+    struct bench_conn *conns = calloc(nconns, sizeof(*conns));
+    pthread_t *threads = calloc(nconns, sizeof(*threads));
+    if(!conns || !threads) {
+        perror("calloc");
+        return 1;
+    }
+    struct bench_conn seeder = { .rng = seed * 0x9e3779b97f4a7c15ULL + 1 };
+    for(size_t i = 0; i < sizeof(block); i += 8){
+        uint64_t r = bench_rand(&seeder);
+        memcpy(block + i, &r, 8);
+    }
+
+    pthread_barrier_init(&ready, NULL, nconns + 1);
+    int started = 0;
+    for(int k = 0; k < nconns; k++){
+        struct bench_conn *c = &conns[k];
+        c->srv = (struct s25_peer){ .fd = -1, .ver = 2 };
+        c->rng = (seed + k + 1) * 0x9e3779b97f4a7c15ULL;
+        snprintf(c->dir, sizeof(c->dir), "%s/c%d", base_dir, k);
+        if(pthread_create(&threads[k], NULL, bench_worker, c) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+        started++;
+    }
+    // Everyone is connected: start the clock
+    uint64_t start = metrics_now_us();
+    deadline = start + (uint64_t)secs * 1000000;
+    pthread_barrier_wait(&ready);
+    for(int k = 0; k < started; k++) pthread_join(threads[k], NULL);
+    double elapsed = (metrics_now_us() - start) / 1e6;
+
+    int lost = report(out, conns, elapsed > 0 ? elapsed : 1e-6);
+    if(out != stdout) fclose(out);
+    free(threads);
+    free(conns);
+    return lost ? 1 : 0;
+}
@@ -7,107 +7,682 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 
 #define SERVER_IP "127.0.0.1"
 #define SERVER_PORT 7348
 #define BUF 4096
+#define MAX_UPLOAD 3
+#define STREAMS_DEFAULT 4
+#define STREAMS_MAX 64
+#define PIECE_MIN (1 << 20)     // smallest range handed to one stream
+#define PIECES_PER_STREAM 4     // spare pieces let fast streams help slow ones
+#define BATCH_MAX 256           // entries per batched request (uploads hold an fd each)
+#define PIPELINE_MAX 64         // batched requests in flight before the sender waits
 
-/* Reliable recv for fixed-size data */
-ssize_t recv_all(int sock, void *buf, size_t len) {
-    size_t recvd = 0;
-    while (recvd < len) {
-        ssize_t r = recv(sock, (char*)buf + recvd, len - recvd, 0);
-        if (r <= 0) return r;
-        recvd += r;
+#include "s25proto.h"
+
+// Protocol version spoken to S1 (-1 selects the legacy v1 protocol)
+static int proto_ver = 2;
+static uint32_t reqid;
+// Connections used by pdownlf (-n)
+static int streams = STREAMS_DEFAULT;
+// Let S1 send large files' bytes straight to or from a storage server
+// (-P keeps everything on the S1 connection)
+static int direct = 1;
+
+/* A parallel download: streams take pieces of the file in turn */
+struct pget {
+    const char *path;
+    int f;
+    uint64_t size;
+    uint64_t piece;
+    uint64_t next;          // next offset to hand out
+    uint64_t done;          // bytes stored so far
+    int failed;
+};
+
+/* One request of a batch, kept until all of its replies have arrived */
+struct batch_req {
+    uint32_t reqid;
+    int op;
+    uint32_t count;
+    char **names;           // file names (uploads) or remote paths
+};
+
+/* Requests sent on a connection whose replies are still outstanding. The
+ * sender appends, the receiver thread consumes replies in order. */
+struct pipeline {
+    struct s25_peer *srv;
+    struct batch_req *q[PIPELINE_MAX];
+    int head, n;
+    int done;               // sender has nothing more to send
+    int lost;               // connection failed or replies out of sync
+    unsigned long ok, failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* Open a connection to host:port (S1, or a storage server S1 sent us to) */
+int connect_host(const char *host, int port) {
+    struct addrinfo hints = { 0 }, *ai;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    int err = getaddrinfo(host, service, &hints, &ai);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+        return -1;
+    }
+    int s = socket(ai->ai_family, SOCK_STREAM, 0);
+    if (s < 0) {
+        perror("socket");
+    } else if (connect(s, ai->ai_addr, ai->ai_addrlen) < 0) {
+        perror("connect");
+        close(s);
+        s = -1;
     }
-    return recvd;
+    freeaddrinfo(ai);
+    if (s < 0) return -1;
+    // Pipelined requests are many small writes; don't hold them back
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return s;
+}
+
+/* Open a connection to S1 */
+int connect_server(void) {
+    return connect_host(SERVER_IP, SERVER_PORT);
 }
 
-/* Check if file has valid extension */
+/* Check if file has an extension; S1 routes files by it and refuses the
+ * types it has no route for */
 int is_valid_extension(const char *filename) {
     char *ext = strrchr(filename, '.');
-    return ext && (strcmp(ext, ".c") == 0 || strcmp(ext, ".pdf") == 0 || 
-                   strcmp(ext, ".txt") == 0 || strcmp(ext, ".zip") == 0);
+    return ext && ext[1] && !strchr(ext, '/');
 }
 
-int main(){
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    if (s < 0) { perror("socket"); return 1; }
+/* Send len bytes of a local file to the server, adding them to *crc */
+int send_from_file(int s, int f, uint64_t len, uint32_t *crc) {
+    char b[S25_IO_BUF];
+    while (len > 0) {
+        ssize_t rd = read(f, b, len > S25_IO_BUF ? S25_IO_BUF : len);
+        if (rd < 0 && errno == EINTR) continue;
+        if (rd <= 0 || !send_all(s, b, rd)) return 0;
+        *crc = crc32c(*crc, b, rd);
+        len -= rd;
+    }
+    return 1;
+}
 
-    struct sockaddr_in a;
-    a.sin_family = AF_INET;
-    a.sin_port = htons(SERVER_PORT);
-    a.sin_addr.s_addr = inet_addr(SERVER_IP);
-    if (connect(s, (struct sockaddr*)&a, sizeof(a)) < 0) {
-        perror("connect");
+/* Chunk payload for large-object uploads; chunks are produced in order, so
+ * the file offset is already where the chunk starts */
+static int upload_payload(void *ctx, int sock, uint64_t off, uint64_t len) {
+    struct s25_file *file = ctx;
+    (void)off;
+    return send_from_file(sock, file->fd, len, &file->crc);
+}
+
+/* Send a local file of len bytes, then its CRC (v2 only). A file that cannot
+ * be read to the end leaves the connection unusable. */
+int upload_file(struct s25_peer *srv, int f, uint64_t len, int chunked) {
+    struct s25_file file = { .fd = f };
+    int sent = chunked ? s25_send_chunked(srv, len, upload_payload, &file) >= 0
+                       : send_from_file(srv->fd, f, len, &file.crc);
+    return sent && (srv->ver == 1 || s25_send_crc(srv->fd, file.crc));
+}
+
+/* Receive len bytes of an announced object into file and check them
+ * against the CRC that follows them, if any. Returns 1 when they were
+ * stored intact, 0 when they were not but the connection is still in sync
+ * and -1 when the connection was lost. */
+static int recv_checked(struct s25_peer *srv, struct s25_file *file, uint64_t len, uint32_t flags) {
+    int st = (flags & S25_F_CHUNKED) ? s25_recv_chunked(srv, len, s25_file_sink, file)
+                                     : s25_file_sink(file, srv->fd, 0, len);
+    uint32_t crc;
+    if (st < 0 || !(flags & S25_F_CRC)) return st;
+    if (!s25_recv_crc(srv->fd, &crc)) return -1;
+    if (st && crc != file->crc) {
+        printf("Checksum mismatch: the data arrived damaged\n");
+        return 0;
+    }
+    return st;
+}
+
+/* Receive one announced object into f (f < 0 discards it). Returns 1 when
+ * it was stored, 0 when it failed but the connection is still in sync and
+ * -1 when the connection was lost. */
+int recv_object(struct s25_peer *srv, int f, uint64_t len, uint32_t flags) {
+    struct s25_file file = { .fd = f };
+    return recv_checked(srv, &file, len, flags);
+}
+
+/* Fetch len bytes (0 = to the end) of a remote file starting at off and
+ * store them at the same offset of the local file f. *got receives the
+ * number of bytes the server sent and *size the remote file's size.
+ * Returns 1 when stored, 0 when the server refused (not found...), -1 when
+ * the connection was lost. */
+int fetch_range(struct s25_peer *srv, const char *path, int f, uint64_t off, uint64_t len,
+                uint64_t *got, uint64_t *size) {
+    struct s25_buf req;
+    s25_start(&req, srv->ver, OP_DOWNLF, __atomic_add_fetch(&reqid, 1, __ATOMIC_RELAXED));
+    s25_put_u32(&req, 1);
+    s25_put_str(&req, path);
+    s25_put_u64(&req, off);
+    s25_put_u64(&req, len);
+    s25_set_flags(&req, S25_F_CHUNKED | S25_F_RANGE | S25_F_CRC);
+    s25_finish(&req, 0);
+    if (!s25_send_buf(srv->fd, &req)) return -1;
+
+    uint32_t flags;
+    if (!s25_recv_object(srv, got, &flags, size)) return -1;
+    if (flags & S25_F_ERROR) return 0;
+    if (*got == 0) return 1;
+
+    // The server clamps the range to the file the same way
+    s25_clamp_range(*size, &off, &len);
+    struct s25_file file = { .fd = f, .base = off };
+    return recv_checked(srv, &file, *got, flags);
+}
+
+/* Read S1's answer to an upload's name and size when redirects were
+ * offered: 2 when it placed the file on a storage server (r), 1 when the
+ * contents go to S1 as usual, 0 when it refused the file, -1 when the
+ * connection was lost. */
+static int recv_placement(struct s25_peer *srv, struct s25_redirect *r) {
+    struct s25_hdr h;
+    if (!s25_recv_hdr(srv->fd, &h)) return -1;
+    srv->reqid = h.reqid;
+    if (h.opcode == OP_DATA && (h.flags & S25_F_REDIRECT))
+        return s25_recv_redirect(srv, r) ? 2 : -1;
+    if (!s25_drain(srv->fd, h.len)) return -1;
+    if (h.opcode != OP_STATUS || (h.flags & S25_F_ERROR)) return 0;
+    return (h.flags & S25_F_MORE) ? 1 : 0;
+}
+
+/* Upload the size bytes of f to the storage server S1 placed them on.
+ * Returns 1 when the server stored them. */
+int upload_direct(const struct s25_redirect *r, int f, uint64_t size) {
+    int s = connect_host(r->host, r->port);
+    if (s < 0) return 0;
+    struct s25_peer be = { .fd = s, .ver = 2 };
+    int chunked = size > S25_CHUNK;
+    struct s25_buf req;
+    s25_start(&req, 2, OP_TPUT, __atomic_add_fetch(&reqid, 1, __ATOMIC_RELAXED));
+    s25_put_str(&req, r->path);
+    s25_put_u64(&req, size);
+    s25_put_token(&req, &r->token);
+    s25_set_flags(&req, (chunked ? S25_F_CHUNKED : 0) | S25_F_CRC);
+    s25_finish(&req, (chunked ? s25_chunked_len(size) : size) + S25_CRC_LEN);
+    int ok = s25_send_buf(s, &req) && upload_file(&be, f, size, chunked) && s25_recv_status(&be) == 1;
+    close(s);
+    return ok;
+}
+
+/* Download a file S1 placed on a storage server (r) into f. Returns 1 when
+ * it was stored intact. */
+int fetch_direct(const struct s25_redirect *r, int f) {
+    int s = connect_host(r->host, r->port);
+    if (s < 0) return 0;
+    struct s25_peer be = { .fd = s, .ver = 2 };
+    struct s25_buf req;
+    s25_start(&req, 2, OP_TGET, __atomic_add_fetch(&reqid, 1, __ATOMIC_RELAXED));
+    s25_put_str(&req, r->path);
+    s25_put_token(&req, &r->token);
+    s25_set_flags(&req, S25_F_CHUNKED | S25_F_CRC);
+    s25_finish(&req, 0);
+    uint64_t len;
+    uint32_t flags;
+    int ok = s25_send_buf(s, &req) && s25_recv_data(&be, &len, &flags) &&
+             !(flags & S25_F_ERROR) && recv_object(&be, f, len, flags) == 1;
+    close(s);
+    return ok;
+}
+
+/* pdownlf stream: keep taking the next piece of the file over a private
+ * connection until none are left */
+static void *pget_worker(void *arg) {
+    struct pget *pg = arg;
+    int s = connect_server();
+    if (s < 0) {
+        // The other streams pick up the pieces this one would have taken
+        return NULL;
+    }
+    struct s25_peer srv = { .fd = s, .ver = 2 };
+    while (!__atomic_load_n(&pg->failed, __ATOMIC_RELAXED)) {
+        uint64_t off = __atomic_fetch_add(&pg->next, pg->piece, __ATOMIC_RELAXED);
+        if (off >= pg->size) break;
+        uint64_t len = pg->size - off < pg->piece ? pg->size - off : pg->piece, got, size;
+        if (fetch_range(&srv, pg->path, pg->f, off, len, &got, &size) != 1 || got != len) {
+            __atomic_store_n(&pg->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        __atomic_add_fetch(&pg->done, got, __ATOMIC_RELAXED);
+    }
+    close(s);
+    return NULL;
+}
+
+/* Download path into f over up to n connections; *used tells how many were
+ * needed. size is the file size. Returns 1 when every piece was stored. */
+int parallel_get(const char *path, int f, uint64_t size, int n, int *used) {
+    struct pget pg = { path, f, size, 0, 0, 0, 0 };
+    pg.piece = (size + (uint64_t)n * PIECES_PER_STREAM - 1) / ((uint64_t)n * PIECES_PER_STREAM);
+    if (pg.piece < PIECE_MIN) pg.piece = PIECE_MIN;
+
+    pthread_t t[STREAMS_MAX];
+    int started = 0;
+    for (int i = 0; i < n && (uint64_t)i * pg.piece < size; i++) {
+        if (pthread_create(&t[started], NULL, pget_worker, &pg) != 0) break;
+        started++;
+    }
+    for (int i = 0; i < started; i++) pthread_join(t[i], NULL);
+    *used = started;
+    return (started > 0 || size == 0) && !pg.failed && pg.done == size;
+}
+
+static void free_batch_req(struct batch_req *r) {
+    for (uint32_t i = 0; i < r->count; i++) free(r->names[i]);
+    free(r->names);
+    free(r);
+}
+
+/* Receive the replies of one batched request, printing each as it lands */
+static int batch_replies(struct pipeline *pl, struct batch_req *r) {
+    struct s25_peer *srv = pl->srv;
+    for (uint32_t i = 0; i < r->count; i++) {
+        int ok;
+        if (r->op == OP_DOWNLF) {
+            uint64_t len;
+            uint32_t flags;
+            if (!s25_recv_data(srv, &len, &flags) || srv->reqid != r->reqid) return 0;
+            const char *bn = strrchr(r->names[i], '/') ? strrchr(r->names[i], '/') + 1 : r->names[i];
+            int f = (flags & S25_F_ERROR) ? -1 : open(bn, O_CREAT|O_WRONLY|O_TRUNC, 0666);
+            int st = recv_object(srv, f, len, flags);
+            if (f >= 0) close(f);
+            if (st < 0) return 0;
+            ok = st == 1;
+            printf("[%u] %s: %s\n", r->reqid,
+                   ok ? "Downloaded" : (flags & S25_F_ERROR) ? "Not found" : "Download failed", r->names[i]);
+        } else {
+            ok = s25_recv_status(srv);
+            if (ok < 0 || srv->reqid != r->reqid) return 0;
+            printf("[%u] %s: %s\n", r->reqid,
+                   r->op == OP_UPLOADF ? (ok ? "Uploaded" : "Upload failed")
+                                       : (ok ? "Removed" : "Could not remove"),
+                   r->names[i]);
+        }
+        pthread_mutex_lock(&pl->lock);
+        if (ok) pl->ok++; else pl->failed++;
+        pthread_mutex_unlock(&pl->lock);
+    }
+    return 1;
+}
+
+/* Receiver thread: S1 answers requests in order, so replies are matched
+ * against the oldest outstanding request and checked by request id */
+static void *batch_receiver(void *arg) {
+    struct pipeline *pl = arg;
+    while (1) {
+        pthread_mutex_lock(&pl->lock);
+        while (pl->n == 0 && !pl->done) pthread_cond_wait(&pl->cond, &pl->lock);
+        if (pl->n == 0) {
+            pthread_mutex_unlock(&pl->lock);
+            return NULL;
+        }
+        struct batch_req *r = pl->q[pl->head];
+        pthread_mutex_unlock(&pl->lock);
+
+        int ok = batch_replies(pl, r);
+
+        pthread_mutex_lock(&pl->lock);
+        pl->head = (pl->head + 1) % PIPELINE_MAX;
+        pl->n--;
+        if (!ok) pl->lost = 1;
+        pthread_cond_broadcast(&pl->cond);
+        pthread_mutex_unlock(&pl->lock);
+        free_batch_req(r);
+        if (!ok) return NULL;
+    }
+}
+
+/* Queue a request for the receiver, waiting while the pipeline is full.
+ * Returns 0 if the connection has been lost. */
+static int pipeline_push(struct pipeline *pl, struct batch_req *r) {
+    pthread_mutex_lock(&pl->lock);
+    while (pl->n == PIPELINE_MAX && !pl->lost) pthread_cond_wait(&pl->cond, &pl->lock);
+    int ok = !pl->lost;
+    if (ok) {
+        pl->q[(pl->head + pl->n) % PIPELINE_MAX] = r;
+        pl->n++;
+        pthread_cond_broadcast(&pl->cond);
+    }
+    pthread_mutex_unlock(&pl->lock);
+    return ok;
+}
+
+/* Entries of the batch being assembled: one opcode, and for uploads one
+ * destination directory */
+struct batch_group {
+    int op;
+    char dir[PATH_MAX];
+    uint32_t count;
+    char *names[BATCH_MAX];
+    int fds[BATCH_MAX];
+    uint64_t sizes[BATCH_MAX];
+};
+
+/* Send the assembled group as one request and hand it to the receiver */
+static int batch_flush(struct pipeline *pl, struct batch_group *g) {
+    if (g->count == 0) return 1;
+    struct s25_peer *srv = pl->srv;
+    struct batch_req *r = malloc(sizeof(*r));
+    char **names = malloc(g->count * sizeof(char *));
+    if (!r || !names) {
+        free(r);
+        free(names);
+        return 0;
+    }
+    r->reqid = __atomic_add_fetch(&reqid, 1, __ATOMIC_RELAXED);
+    r->op = g->op;
+    r->count = g->count;
+    r->names = names;
+    memcpy(names, g->names, g->count * sizeof(char *));
+
+    struct s25_buf req;
+    uint64_t extra = 0;
+    s25_start(&req, 2, g->op, r->reqid);
+    s25_put_u32(&req, g->count);
+    if (g->op != OP_REMOVEF) s25_set_flags(&req, S25_F_CRC);
+    if (g->op == OP_UPLOADF) {
+        s25_put_str(&req, g->dir);
+        for (uint32_t i = 0; i < g->count; i++)
+            extra += s25_str_len(2, g->names[i]) + 8 + g->sizes[i] + S25_CRC_LEN;
+    } else {
+        for (uint32_t i = 0; i < g->count; i++) extra += s25_str_len(2, g->names[i]);
+    }
+    s25_finish(&req, extra);
+
+    // The receiver must know about the request before its replies can arrive
+    uint32_t n = g->count;
+    g->count = 0;
+    if (!pipeline_push(pl, r)) {
+        free_batch_req(r);
+        for (uint32_t i = 0; g->op == OP_UPLOADF && i < n; i++) close(g->fds[i]);
+        return 0;
+    }
+    int ok = s25_send_buf(srv->fd, &req);
+    if (g->op == OP_UPLOADF) {
+        for (uint32_t i = 0; i < n; i++) {
+            if (ok) {
+                struct s25_buf fb;
+                s25_fields(&fb, 2);
+                s25_put_str(&fb, names[i]);
+                s25_put_u64(&fb, g->sizes[i]);
+                ok = s25_send_buf(srv->fd, &fb) && upload_file(srv, g->fds[i], g->sizes[i], 0);
+            }
+            close(g->fds[i]);
+        }
+    } else {
+        // The request head only has room for a few paths; the rest follow
+        // as fields of their own
+        for (uint32_t i = 0; ok && i < n; i++) {
+            struct s25_buf fb;
+            s25_fields(&fb, 2);
+            s25_put_str(&fb, names[i]);
+            ok = s25_send_buf(srv->fd, &fb);
+        }
+    }
+    return ok;
+}
+
+/* Add one line of a batch file to the group, flushing it first when the
+ * line needs a different request. Lines are
+ *     upload <local file> <dest dir>
+ *     get <remote path>
+ *     rm <remote path>
+ * Returns 0 if the connection was lost. */
+static int batch_line(struct pipeline *pl, struct batch_group *g, char *line) {
+    char *verb = strtok(line, " \t\n"), *arg = strtok(NULL, " \t\n"), *dir = strtok(NULL, " \t\n");
+    if (!verb || verb[0] == '#') return 1;
+    int op = strcmp(verb, "upload") == 0 ? OP_UPLOADF :
+             strcmp(verb, "get") == 0 ? OP_DOWNLF :
+             strcmp(verb, "rm") == 0 ? OP_REMOVEF : 0;
+    if (!op || !arg || (op == OP_UPLOADF && !dir)) {
+        printf("Skipping bad batch line: %s\n", verb);
         return 1;
     }
 
+    int fd = -1;
+    struct stat st;
+    if (op == OP_UPLOADF) {
+        if (!is_valid_extension(arg)) {
+            printf("Skipping %s: files are routed by their extension\n", arg);
+            return 1;
+        }
+        if ((fd = open(arg, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+            perror(arg);
+            if (fd >= 0) close(fd);
+            return 1;
+        }
+    }
+
+    if (g->op != op || g->count == BATCH_MAX || (op == OP_UPLOADF && strcmp(g->dir, dir) != 0)) {
+        if (!batch_flush(pl, g)) {
+            if (fd >= 0) close(fd);
+            return 0;
+        }
+        g->op = op;
+        if (op == OP_UPLOADF) snprintf(g->dir, sizeof(g->dir), "%s", dir);
+    }
+    // Uploads are named by their basename on the server
+    char *bn = op == OP_UPLOADF && strrchr(arg, '/') ? strrchr(arg, '/') + 1 : arg;
+    g->names[g->count] = strdup(bn);
+    g->fds[g->count] = fd;
+    g->sizes[g->count] = op == OP_UPLOADF ? (uint64_t)st.st_size : 0;
+    g->count++;
+    return 1;
+}
+
+/* Run a batch file over the connection, pipelining its requests.
+ * Returns 0 if the connection was lost. */
+int run_batch(struct s25_peer *srv, FILE *in) {
+    struct pipeline pl = { .srv = srv };
+    pthread_mutex_init(&pl.lock, NULL);
+    pthread_cond_init(&pl.cond, NULL);
+    struct batch_group *g = calloc(1, sizeof(*g));
+    pthread_t rt;
+    if (!g || pthread_create(&rt, NULL, batch_receiver, &pl) != 0) {
+        free(g);
+        printf("Cannot start batch\n");
+        return 1;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    char line[2 * PATH_MAX];
+    int ok = 1;
+    while (ok && fgets(line, sizeof(line), in)) ok = batch_line(&pl, g, line);
+    if (ok) ok = batch_flush(&pl, g);
+    for (uint32_t i = 0; i < g->count; i++) {
+        // left over after a failure
+        if (g->fds[i] >= 0) close(g->fds[i]);
+        free(g->names[i]);
+    }
+    free(g);
+
+    pthread_mutex_lock(&pl.lock);
+    pl.done = 1;
+    pthread_cond_broadcast(&pl.cond);
+    pthread_mutex_unlock(&pl.lock);
+    pthread_join(rt, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    // Requests the receiver never got to
+    while (pl.n > 0) {
+        free_batch_req(pl.q[pl.head]);
+        pl.head = (pl.head + 1) % PIPELINE_MAX;
+        pl.n--;
+    }
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("Batch: %lu ok, %lu failed in %.3f s\n", pl.ok, pl.failed, secs);
+    return ok && !pl.lost;
+}
+
+/* Read a line from stdin into buf without the trailing newline */
+int read_line(char *buf, int len) {
+    if (!fgets(buf, len, stdin)) return 0;
+    buf[strcspn(buf, "\n")] = 0;
+    return 1;
+}
+
+int main(int argc, char *argv[]){
+    int opt_c;
+    while ((opt_c = getopt(argc, argv, "1n:P")) != -1) {
+        if (opt_c == '1') proto_ver = 1;
+        else if (opt_c == 'n') streams = atoi(optarg);
+        else if (opt_c == 'P') direct = 0;
+        else {
+            fprintf(stderr, "usage: %s [-1] [-n streams] [-P]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (streams < 1) streams = 1;
+    if (streams > STREAMS_MAX) streams = STREAMS_MAX;
+    crc_init();
+
+    int s = connect_server();
+    if (s < 0) return 1;
+    // A server that drops the connection mid-send must not kill the client
+    signal(SIGPIPE, SIG_IGN);
+
+    struct s25_peer srv = { .fd = s, .ver = proto_ver };
+    struct s25_buf req;
     char line[BUF], file[PATH_MAX], dir[PATH_MAX];
-    
+
     while (1) {
         printf("cmd> "); fflush(stdout);
-        if (!fgets(line, BUF, stdin)) break;
-        line[strcspn(line, "\n")] = 0;
+        if (!read_line(line, BUF)) break;
 
         /* ===== UPLOADF ===== */
         if (strncmp(line, "uploadf", 7) == 0) {
-            send(s, "uploadf", strlen("uploadf") + 1, 0);
-
             int n;
             printf("How many files? (1-3): ");
             if (scanf("%d", &n) != 1) break;
             getchar();
-            if (n < 1 || n > 3) {
+            if (n < 1 || n > MAX_UPLOAD) {
                 printf("Invalid count for uploadf.\n");
                 continue;
             }
-            send(s, &n, sizeof(int), 0);
 
             printf("Dest dir (example: ~/S1/folder1): ");
-            fgets(dir, BUF, stdin);
-            dir[strcspn(dir, "\n")] = 0;
-            send(s, dir, BUF, 0);
+            read_line(dir, BUF);
 
+            // Open everything first: a v2 header carries the total length
+            int fds[MAX_UPLOAD], nf = 0, chunked = 0;
+            uint64_t sizes[MAX_UPLOAD], extra = 0;
+            char names[MAX_UPLOAD][PATH_MAX];
             for (int i = 0; i < n; i++) {
                 printf("File %d: ", i+1);
                 fflush(stdout);
-                fgets(file, PATH_MAX, stdin);
-                file[strcspn(file, "\n")] = 0;
+                read_line(file, PATH_MAX);
 
                 if (!is_valid_extension(file)) {
-                    printf("Invalid file extension. Only .c, .pdf, .txt, .zip allowed.\n");
-                    int zero = 0;
-                    char empty[BUF] = "";
-                    send(s, empty, BUF, 0);
-                    send(s, &zero, sizeof(int), 0);
+                    printf("Invalid file name: files are routed by their extension.\n");
                     continue;
                 }
-
-                /* Send only basename, not full path */
-                char *bn = strrchr(file, '/') ? strrchr(file, '/') + 1 : file;
-                send(s, bn, BUF, 0);
-
                 int f = open(file, O_RDONLY);
                 if (f < 0) {
                     perror("open");
-                    int zero = 0;
-                    send(s, &zero, sizeof(int), 0);
                     continue;
                 }
-                int sz = lseek(f, 0, SEEK_END);
+                off_t sz = lseek(f, 0, SEEK_END);
                 lseek(f, 0, SEEK_SET);
-                send(s, &sz, sizeof(int), 0);
+                if (proto_ver == 1 && sz > INT_MAX) {
+                    printf("%s is too large for the v1 protocol.\n", file);
+                    close(f);
+                    continue;
+                }
+
+                /* Send only basename, not full path */
+                char *bn = strrchr(file, '/') ? strrchr(file, '/') + 1 : file;
+                snprintf(names[nf], PATH_MAX, "%s", bn);
+                fds[nf] = f;
+                sizes[nf] = sz;
+                if (proto_ver == 2 && (uint64_t)sz > S25_CHUNK) chunked = 1;
+                nf++;
+            }
+            if (nf == 0) {
+                printf("Nothing to upload.\n");
+                continue;
+            }
+            // Large files switch the whole request to large-object mode.
+            // When S1 may redirect them, contents only follow its go-ahead
+            // and are not counted.
+            int redirect = proto_ver == 2 && direct;
+            for (int i = 0; i < nf; i++)
+                extra += s25_str_len(proto_ver, names[i]) + (proto_ver == 1 ? sizeof(int) : 8) +
+                         (redirect ? 0 : (proto_ver == 1 ? 0 : S25_CRC_LEN) +
+                                         (chunked ? s25_chunked_len(sizes[i]) : sizes[i]));
+
+            // v2 uploads are checked end to end against their CRC
+            s25_start(&req, proto_ver, OP_UPLOADF, ++reqid);
+            s25_put_u32(&req, nf);
+            s25_put_str(&req, dir);
+            s25_set_flags(&req, (chunked ? S25_F_CHUNKED : 0) | S25_F_CRC | (redirect ? S25_F_REDIRECT : 0));
+            s25_finish(&req, extra);
+            s25_send_buf(s, &req);
+
+            for (int i = 0; i < nf; i++) {
+                struct s25_buf fb;
+                s25_fields(&fb, proto_ver);
+                s25_put_str(&fb, names[i]);
+                s25_put_u64(&fb, sizes[i]);
+                s25_send_buf(s, &fb);
+
+                // S1 says where the contents go: a storage server, here, or
+                // nowhere
+                if (redirect) {
+                    struct s25_redirect r;
+                    int where = recv_placement(&srv, &r);
+                    if (where < 0) {
+                        printf("No response or error\n");
+                        break;
+                    }
+                    if (where != 1) {
+                        int ok = where == 2 && upload_direct(&r, fds[i], sizes[i]);
+                        close(fds[i]);
+                        if (ok) printf("Uploaded: %s (directly to %s:%u)\n", names[i], r.host, r.port);
+                        else printf("Upload failed: %s\n", names[i]);
+                        continue;
+                    }
+                }
+                int sent = upload_file(&srv, fds[i], sizes[i], chunked);
+                close(fds[i]);
+                if (!sent) {
+                    printf("Connection lost while uploading %s\n", names[i]);
+                    break;
+                }
 
-                char b[BUF]; int rd;
-                while ((rd = read(f, b, BUF)) > 0) send(s, b, rd, 0);
-                close(f);
+                // v2 acknowledges every file; v1 gives no feedback
+                if (proto_ver == 2) {
+                    int st = s25_recv_status(&srv);
+                    if (st < 0) {
+                        printf("No response or error\n");
+                        break;
+                    }
+                    printf("%s: %s\n", st ? "Uploaded" : "Upload failed", names[i]);
+                }
             }
 
         /* ===== DOWNLF ===== */
         } else if (strncmp(line, "downlf", 6) == 0) {
-            send(s, "downlf", strlen("downlf") + 1, 0);
-
             int n;
             printf("How many? (1-2): ");
             if (scanf("%d", &n) != 1) break;
@@ -116,47 +691,176 @@ int main(){
                 printf("Invalid count for downlf.\n");
                 continue;
             }
-            send(s, &n, sizeof(int), 0);
 
+            char paths[2][PATH_MAX];
             for (int i = 0; i < n; i++) {
                 printf("Remote file path: ");
-                fgets(file, BUF, stdin);
-                file[strcspn(file, "\n")] = 0;
-                send(s, file, BUF, 0);
+                read_line(paths[i], PATH_MAX);
+            }
+            s25_start(&req, proto_ver, OP_DOWNLF, ++reqid);
+            s25_put_u32(&req, n);
+            for (int i = 0; i < n; i++) s25_put_str(&req, paths[i]);
+            // large files may come chunked, or from their storage server;
+            // whole files come with their CRC
+            s25_set_flags(&req, S25_F_CHUNKED | S25_F_CRC | (direct ? S25_F_REDIRECT : 0));
+            s25_finish(&req, 0);
+            s25_send_buf(s, &req);
 
-                int sz;
-                if (recv_all(s, &sz, sizeof(int)) <= 0) {
+            for (int i = 0; i < n; i++) {
+                uint64_t sz;
+                uint32_t flags;
+                if (!s25_recv_data(&srv, &sz, &flags)) {
                     printf("No response or error\n");
-                    continue;
+                    break;
                 }
-                if (sz <= 0) {
-                    printf("File not found: %s\n", file);
+                if (flags & S25_F_ERROR) {
+                    printf("File not found: %s\n", paths[i]);
                     continue;
                 }
 
-                char *bn = strrchr(file, '/') ? strrchr(file, '/') + 1 : file;
-                int f = open(bn, O_CREAT|O_WRONLY, 0666);
-                if (f < 0) {
-                    perror("open write");
-                    char tmp[BUF]; int left = sz;
-                    while (left > 0) { int rd = recv(s, tmp, left>BUF?BUF:left, 0); if (rd<=0) break; left -= rd; }
+                char *bn = strrchr(paths[i], '/') ? strrchr(paths[i], '/') + 1 : paths[i];
+                if (flags & S25_F_REDIRECT) {
+                    struct s25_redirect r;
+                    if (!s25_recv_redirect(&srv, &r)) {
+                        printf("No response or error\n");
+                        break;
+                    }
+                    int f = open(bn, O_CREAT|O_WRONLY|O_TRUNC, 0666);
+                    if (f < 0) perror("open write");
+                    int ok = f >= 0 && fetch_direct(&r, f);
+                    if (f >= 0) close(f);
+                    if (ok) printf("Downloaded: %s (%llu bytes, directly from %s:%u)\n", bn,
+                                   (unsigned long long)r.size, r.host, r.port);
+                    else if (f >= 0) printf("Download failed: %s\n", bn);
                     continue;
                 }
-
-                int left = sz; char b[BUF];
-                while (left > 0) {
-                    int rd = recv(s, b, left>BUF?BUF:left, 0);
-                    if (rd <= 0) break;
-                    write(f, b, rd);
-                    left -= rd;
+                int f = open(bn, O_CREAT|O_WRONLY|O_TRUNC, 0666);
+                if (f < 0) perror("open write");
+                int ok = recv_object(&srv, f, sz, flags);
+                if (f >= 0) close(f);
+                if (ok < 0) {
+                    printf("Connection lost while downloading %s\n", bn);
+                    break;
                 }
-                close(f);
-                printf("Downloaded: %s (%d bytes)\n", bn, sz);
+                if (ok) printf("Downloaded: %s (%llu bytes)\n", bn, (unsigned long long)sz);
+                else if (f >= 0) printf("Download failed: %s\n", bn);
+            }
+
+        /* ===== RANGEF / RESUMEF ===== */
+        } else if (strncmp(line, "rangef", 6) == 0 || strncmp(line, "resumef", 7) == 0) {
+            int resume = line[1] == 'e';
+            if (proto_ver == 1) {
+                printf("%s needs the v2 protocol.\n", resume ? "resumef" : "rangef");
+                continue;
+            }
+            char path[PATH_MAX];
+            uint64_t off = 0, len = 0;
+            printf("Remote file path: ");
+            fflush(stdout);
+            read_line(path, PATH_MAX);
+            if (!resume) {
+                printf("Offset: ");
+                fflush(stdout);
+                read_line(file, PATH_MAX);
+                off = strtoull(file, NULL, 10);
+                printf("Length (0 = to end): ");
+                fflush(stdout);
+                read_line(file, PATH_MAX);
+                len = strtoull(file, NULL, 10);
+            }
+
+            // Bytes land at their own offset in the local copy, so pieces
+            // can be fetched in any order; resume continues after what is there
+            char *bn = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+            int f = open(bn, O_CREAT|O_WRONLY, 0666);
+            if (f < 0) {
+                perror("open write");
+                continue;
+            }
+            if (resume) off = lseek(f, 0, SEEK_END);
+
+            uint64_t got = 0, size = 0;
+            int st = fetch_range(&srv, path, f, off, len, &got, &size);
+            close(f);
+            if (st < 0) {
+                printf("Connection lost while downloading %s\n", bn);
+                break;
+            }
+            if (st == 0) printf("File not found: %s\n", path);
+            else if (resume && got == 0) printf("%s is already complete (%llu bytes)\n", bn, (unsigned long long)size);
+            else printf("%s: %llu bytes at offset %llu of %llu\n", bn, (unsigned long long)got,
+                        (unsigned long long)off, (unsigned long long)size);
+
+        /* ===== BATCH ===== */
+        } else if (strncmp(line, "batch", 5) == 0) {
+            if (proto_ver == 1) {
+                printf("batch needs the v2 protocol.\n");
+                continue;
+            }
+            printf("Batch file: ");
+            fflush(stdout);
+            read_line(file, PATH_MAX);
+            FILE *in = fopen(file, "r");
+            if (!in) {
+                perror("fopen");
+                continue;
+            }
+            int ok = run_batch(&srv, in);
+            fclose(in);
+            if (!ok) {
+                printf("Connection lost during batch\n");
+                break;
+            }
+
+        /* ===== PDOWNLF ===== */
+        } else if (strncmp(line, "pdownlf", 7) == 0) {
+            if (proto_ver == 1) {
+                printf("pdownlf needs the v2 protocol.\n");
+                continue;
             }
+            char path[PATH_MAX];
+            printf("Remote file path: ");
+            fflush(stdout);
+            read_line(path, PATH_MAX);
+
+            // An empty range past the end tells the file size
+            uint64_t got, size;
+            int st = fetch_range(&srv, path, -1, UINT64_MAX, 0, &got, &size);
+            if (st < 0) {
+                printf("No response or error\n");
+                break;
+            }
+            if (st == 0) {
+                printf("File not found: %s\n", path);
+                continue;
+            }
+
+            char *bn = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+            int f = open(bn, O_CREAT|O_WRONLY|O_TRUNC, 0666);
+            if (f < 0 || ftruncate(f, size) < 0) {
+                perror("open write");
+                if (f >= 0) close(f);
+                continue;
+            }
+
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            int used = 0;
+            int ok = parallel_get(path, f, size, streams, &used);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            close(f);
+
+            double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+            if (!ok) {
+                printf("Parallel download of %s failed; the local copy is incomplete\n", bn);
+                continue;
+            }
+            printf("Downloaded: %s (%llu bytes) in %.3f s over %d streams, %.1f MB/s\n", bn,
+                   (unsigned long long)size, secs, used,
+                   secs > 0 ? size / secs / (1024.0 * 1024.0) : 0.0);
 
         /* ===== REMOVEF ===== */
         } else if (strncmp(line, "removef", 7) == 0) {
-            send(s, "removef", strlen("removef") + 1, 0);
             int n;
             printf("How many? (1-2): ");
             if (scanf("%d", &n) != 1) break;
@@ -165,28 +869,43 @@ int main(){
                 printf("Invalid count for removef.\n");
                 continue;
             }
-            send(s, &n, sizeof(int), 0);
+            char paths[2][PATH_MAX];
             for (int i = 0; i < n; i++) {
                 printf("Path: ");
-                fgets(file, BUF, stdin);
-                file[strcspn(file, "\n")] = 0;
-                send(s, file, BUF, 0);
+                read_line(paths[i], PATH_MAX);
+            }
+            s25_start(&req, proto_ver, OP_REMOVEF, ++reqid);
+            s25_put_u32(&req, n);
+            for (int i = 0; i < n; i++) s25_put_str(&req, paths[i]);
+            s25_finish(&req, 0);
+            s25_send_buf(s, &req);
+
+            for (int i = 0; proto_ver == 2 && i < n; i++) {
+                int st = s25_recv_status(&srv);
+                if (st < 0) {
+                    printf("No response or error\n");
+                    break;
+                }
+                printf("%s: %s\n", st ? "Removed" : "Could not remove", paths[i]);
             }
 
         /* ===== DOWNLTAR ===== */
         } else if (strncmp(line, "downltar", 8) == 0) {
-            send(s, "downltar", strlen("downltar") + 1, 0);
-            printf("Type (.c/.pdf/.txt): ");
-            fgets(file, BUF, stdin);
-            file[strcspn(file, "\n")] = 0;
-            send(s, file, BUF, 0);
-
-            int sz;
-            if (recv_all(s, &sz, sizeof(int)) <= 0) {
+            printf("Type (.c/.pdf/.txt/.zip): ");
+            read_line(file, PATH_MAX);
+            s25_start(&req, proto_ver, OP_DOWNLTAR, ++reqid);
+            s25_put_str(&req, file);
+            s25_set_flags(&req, S25_F_CHUNKED);
+            s25_finish(&req, 0);
+            s25_send_buf(s, &req);
+
+            uint64_t sz;
+            uint32_t flags;
+            if (!s25_recv_data(&srv, &sz, &flags)) {
                 printf("No response\n");
                 continue;
             }
-            if (sz <= 0) {
+            if ((flags & S25_F_ERROR) || sz == 0) {
                 printf("No files of that type found\n");
                 continue;
             }
@@ -200,44 +919,143 @@ int main(){
             } else if (strcmp(file, ".txt") == 0) {
                 strcpy(tar_filename, "text.tar");
             } else {
-                strcpy(tar_filename, "out.tar"); // fallback
+                snprintf(tar_filename, sizeof(tar_filename), "%s.tar", file + (file[0] == '.'));
             }
 
             int f = open(tar_filename, O_CREAT|O_WRONLY|O_TRUNC, 0666);
-            if (f < 0) {
-                perror("open tar file");
-                char tmp[BUF]; int left = sz;
-                while (left > 0) { int rd = recv(s,tmp,left>BUF?BUF:left,0); if(rd<=0) break; left -= rd; }
-                continue;
-            }
-            int left = sz; char b[BUF];
-            while (left > 0) {
-                int rd = recv(s, b, left>BUF?BUF:left, 0);
-                if (rd <= 0) break;
-                write(f, b, rd);
-                left -= rd;
-            }
-            close(f);
-            printf("Received %s (%d bytes)\n", tar_filename, sz);
+            if (f < 0) perror("open tar file");
+            int ok = recv_object(&srv, f, sz, flags);
+            if (f >= 0) close(f);
+            if (ok < 0) printf("Connection lost while receiving %s\n", tar_filename);
+            else if (ok) printf("Received %s (%llu bytes)\n", tar_filename, (unsigned long long)sz);
+            else if (f >= 0) printf("Archive transfer failed: %s\n", tar_filename);
 
         /* ===== DISP FNAMES ===== */
         } else if (strncmp(line, "dispfnames", 10) == 0) {
-            send(s, "dispfnames", strlen("dispfnames") + 1, 0);
             printf("Dir (example: ~/S1/folder1): ");
-            fgets(dir, BUF, stdin);
-            dir[strcspn(dir, "\n")] = 0;
-            send(s, dir, BUF, 0);
+            read_line(dir, BUF);
+            s25_start(&req, proto_ver, OP_DISPFNAMES, ++reqid);
+            s25_put_str(&req, dir);
+            s25_finish(&req, 0);
+            s25_send_buf(s, &req);
 
             char out[BUF+1];
-            int r;
-            while ((r = recv(s, out, BUF, 0)) > 0) {
-                out[r] = '\0';
-                printf("%s", out);
-                if (r < BUF) break;
+            if (proto_ver == 1) {
+                // v1 listings are unframed: read until a short chunk
+                int r;
+                while ((r = recv(s, out, BUF, 0)) > 0) {
+                    out[r] = '\0';
+                    printf("%s", out);
+                    if (r < BUF) break;
+                }
+                continue;
             }
-        
+
+            uint64_t len;
+            uint32_t flags;
+            do {
+                if (!s25_recv_data(&srv, &len, &flags)) {
+                    printf("No response\n");
+                    break;
+                }
+                while (len > 0) {
+                    ssize_t r = recv(s, out, len > BUF ? BUF : len, 0);
+                    if (r <= 0) break;
+                    out[r] = '\0';
+                    printf("%s", out);
+                    len -= r;
+                }
+            } while (flags & S25_F_MORE);
+
+        /* ===== LISTF ===== */
+        } else if (strncmp(line, "listf", 5) == 0) {
+            if (proto_ver != 2) {
+                printf("listf needs the v2 protocol.\n");
+                continue;
+            }
+            char prefix[BUF], cursor[BUF] = "", answer[16];
+            printf("Dir (example: ~/S1/folder1): ");
+            read_line(dir, BUF);
+            printf("Name prefix (empty for all): ");
+            read_line(prefix, BUF);
+            printf("Page size: ");
+            read_line(answer, sizeof(answer));
+            uint32_t limit = (uint32_t)strtoul(answer, NULL, 10);
+            printf("Include subdirectories? (y/n): ");
+            read_line(answer, sizeof(answer));
+            uint32_t options = answer[0] == 'y' ? S25_LIST_RECURSIVE : 0;
+
+            // One request per page; the last entry shown is the next cursor
+            while (1) {
+                s25_start(&req, proto_ver, OP_LISTF, ++reqid);
+                s25_put_str(&req, dir);
+                s25_put_str(&req, prefix);
+                s25_put_str(&req, cursor);
+                s25_put_u32(&req, limit);
+                s25_put_u32(&req, options);
+                s25_finish(&req, 0);
+                s25_send_buf(s, &req);
+
+                uint64_t len;
+                uint32_t flags;
+                if (!s25_recv_data(&srv, &len, &flags)) {
+                    printf("No response\n");
+                    break;
+                }
+                char *page = malloc(len + 1);
+                if (!page || (len > 0 && recv_all(s, page, len) <= 0)) {
+                    printf("Connection lost while receiving the listing\n");
+                    free(page);
+                    break;
+                }
+                page[len] = '\0';
+                printf("%s", page);
+                if (len > 1) {
+                    page[len - 1] = '\0';
+                    char *last = strrchr(page, '\n');
+                    snprintf(cursor, sizeof(cursor), "%s", last ? last + 1 : page);
+                }
+                free(page);
+
+                if (!(flags & S25_F_PARTIAL)) break;
+                printf("-- Enter for the next page, q to stop: ");
+                read_line(answer, sizeof(answer));
+                if (answer[0] == 'q') break;
+            }
+
+        /* ===== STATS ===== */
+        } else if (strncmp(line, "stats", 5) == 0) {
+            if (proto_ver != 2) {
+                printf("stats needs the v2 protocol.\n");
+                continue;
+            }
+            char answer[16];
+            printf("Format (text/json): ");
+            read_line(answer, sizeof(answer));
+            s25_start(&req, proto_ver, OP_STATS, ++reqid);
+            s25_put_u32(&req, strcmp(answer, "json") == 0 ? S25_STATS_JSON : S25_STATS_TEXT);
+            s25_finish(&req, 0);
+            s25_send_buf(s, &req);
+
+            uint64_t len;
+            uint32_t flags;
+            if (!s25_recv_data(&srv, &len, &flags)) {
+                printf("No response\n");
+                continue;
+            }
+            char *text = malloc(len + 1);
+            if (!text || (len > 0 && recv_all(s, text, len) <= 0)) {
+                printf("Connection lost while receiving the stats\n");
+                free(text);
+                continue;
+            }
+            text[len] = '\0';
+            if (flags & S25_F_ERROR) printf("Stats unavailable\n");
+            else printf("%s%s", text, len > 0 && text[len - 1] != '\n' ? "\n" : "");
+            free(text);
+
         } else {
-            printf("Unknown command. Supported: uploadf downlf removef downltar dispfnames\n");
+            printf("Unknown command. Supported: uploadf downlf batch pdownlf rangef resumef removef downltar dispfnames listf stats\n");
         }
     }
 
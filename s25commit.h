@@ -0,0 +1,200 @@
+//s25commit.h
+/* ================= durable uploads =================
+ * An upload is written to a temporary file next to its destination and
+ * renamed over it only once complete. Readers see the old file or the new
+ * one, never a partial one, and an upload cut short leaves nothing behind.
+ *
+ * How long the data takes to be durable is the commit mode:
+ *
+ *   none   just the rename, no syncing (the old behaviour's speed)
+ *   sync   fsync() the file before the rename and its directory after it
+ *   group  each file's data is written out with sync_file_range(), which
+ *          needs no journal commit, then renamed; the names (and the cache
+ *          flush behind the data) are made durable by one syncfs() shared
+ *          by every upload finishing at about the same time. The first to
+ *          finish leads the batch: it waits, at most COMMIT_WINDOW_US, for
+ *          the uploads still being written, then syncs for all of them.
+ *          A lone upload does not wait at all.
+ *
+ * In every mode the upload is only acknowledged once published, and with
+ * sync or group only once the new file and its name will survive a crash.
+ * A crash can leave a stray ".name.*.tmp" file, which no listing or archive
+ * picks up since it does not end in the type's extension.
+ */
+#ifndef S25COMMIT_H
+#define S25COMMIT_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <time.h>
+
+#define COMMIT_WINDOW_US 2000   // how long a group commit gathers uploads
+
+enum { COMMIT_NONE, COMMIT_SYNC, COMMIT_GROUP };
+
+static int commit_mode = COMMIT_GROUP;
+
+/* An upload being written */
+struct commit_file {
+    int fd;
+    char tmp[PATH_MAX];
+    char dest[PATH_MAX];
+};
+
+/* An upload waiting in commit_wait() for the sync of its batch */
+struct commit_waiter {
+    int done;                   // its batch was synced,
+    int ok;                     // and whether that worked
+    struct commit_waiter *next;
+};
+
+/* Uploads waiting for a shared sync. The batch being gathered is a list of
+ * its uploads; the thread that syncs it takes the list and gives each of
+ * them the outcome, so every upload hears about its own batch's sync and
+ * no other. */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    struct commit_waiter *batch;
+    int syncing;                // a thread is gathering or syncing a batch
+    int writing;                // uploads that may join the batch soon
+    pthread_cond_t joined;
+} commit_group = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0,
+                   PTHREAD_COND_INITIALIZER };
+
+static uint32_t commit_seq;
+
+/* The commit mode named s, or -1 */
+static int commit_parse_mode(const char *s){
+    if(strcmp(s, "none") == 0) return COMMIT_NONE;
+    if(strcmp(s, "sync") == 0) return COMMIT_SYNC;
+    if(strcmp(s, "group") == 0) return COMMIT_GROUP;
+    return -1;
+}
+
+/* Start writing dest: c->fd is a new temporary file in dest's directory,
+ * or -1 if it cannot be created */
+static int commit_open(struct commit_file *c, const char *dest){
+    c->fd = -1;
+    int n = snprintf(c->dest, sizeof(c->dest), "%s", dest);
+    const char *slash = strrchr(dest, '/');
+    const char *base = slash ? slash + 1 : dest;
+    int dirlen = slash ? (int)(slash - dest) + 1 : 0;
+    int m = snprintf(c->tmp, sizeof(c->tmp), "%.*s.%s.%d.%u.tmp", dirlen, dest, base, (int)getpid(),
+                     __atomic_add_fetch(&commit_seq, 1, __ATOMIC_RELAXED));
+    // A temporary name cut short would lose what keeps it apart from other
+    // uploads' and from the stored files: refuse such a long name
+    if(n < 0 || n >= (int)sizeof(c->dest) || m < 0 || m >= (int)sizeof(c->tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    c->fd = open(c->tmp, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
+    if(c->fd >= 0 && commit_mode == COMMIT_GROUP) {
+        pthread_mutex_lock(&commit_group.lock);
+        commit_group.writing++;
+        pthread_mutex_unlock(&commit_group.lock);
+    }
+    return c->fd;
+}
+
+/* An upload stops being written, so the batch leader need not wait for
+ * it; called with commit_group.lock held */
+static void commit_leave(void){
+    commit_group.writing--;
+    pthread_cond_signal(&commit_group.joined);
+}
+
+/* Finish writing an upload and wait until everything written before is on
+ * disk, sharing one syncfs() of fd's filesystem with the other uploads */
+static int commit_wait(int fd){
+    struct commit_waiter me = { 0, 0, NULL };
+    pthread_mutex_lock(&commit_group.lock);
+    commit_leave();
+    me.next = commit_group.batch;
+    commit_group.batch = &me;
+    while(!me.done){
+        if(commit_group.syncing) {
+            pthread_cond_wait(&commit_group.done, &commit_group.lock);
+            continue;
+        }
+        // Lead this batch: let the uploads still being written join it,
+        // close it, then sync it
+        commit_group.syncing = 1;
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += COMMIT_WINDOW_US * 1000L;
+        if(until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        while(commit_group.writing > 0 &&
+              pthread_cond_timedwait(&commit_group.joined, &commit_group.lock, &until) == 0);
+        struct commit_waiter *closed = commit_group.batch;
+        commit_group.batch = NULL;
+        pthread_mutex_unlock(&commit_group.lock);
+        int ok = syncfs(fd) == 0;
+        pthread_mutex_lock(&commit_group.lock);
+        while(closed){
+            struct commit_waiter *w = closed;
+            closed = w->next;
+            w->ok = ok;
+            w->done = 1;
+        }
+        commit_group.syncing = 0;
+        pthread_cond_broadcast(&commit_group.done);
+    }
+    pthread_mutex_unlock(&commit_group.lock);
+    return me.ok;
+}
+
+/* fsync() the directory holding path */
+static int commit_sync_dir(const char *path){
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    int d = open(dirname(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(d < 0) return 0;
+    int ok = fsync(d) == 0;
+    close(d);
+    return ok;
+}
+
+/* Finish an upload: publish it under its name if ok (its data durable
+ * first, per commit_mode), else throw it away. Returns 1 when published
+ * and durable, -1 when published but the sync of its name failed, 0 when
+ * it was thrown away. */
+static int commit_close(struct commit_file *c, int ok){
+    if(c->fd < 0) return 0;
+    if(ok && commit_mode == COMMIT_SYNC) ok = fsync(c->fd) == 0;
+    if(ok && commit_mode == COMMIT_GROUP) {
+        ok = sync_file_range(c->fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE |
+                             SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == 0;
+    }
+    if(ok && rename(c->tmp, c->dest) < 0) {
+        perror("rename");
+        ok = 0;
+    }
+    if(!ok) {
+        unlink(c->tmp);
+        if(commit_mode == COMMIT_GROUP) {
+            pthread_mutex_lock(&commit_group.lock);
+            commit_leave();
+            pthread_mutex_unlock(&commit_group.lock);
+        }
+    } else if(commit_mode == COMMIT_SYNC && !commit_sync_dir(c->dest)) {
+        ok = -1;
+    } else if(commit_mode == COMMIT_GROUP && !commit_wait(c->fd)) {
+        ok = -1;
+    }
+    close(c->fd);
+    c->fd = -1;
+    return ok;
+}
+
+#endif
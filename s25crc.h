@@ -0,0 +1,159 @@
+//s25crc.h
+/* ================= CRC32C checksums =================
+ * Every object travels with a CRC32C (the Castagnoli polynomial, as in
+ * iSCSI and ext4) from the node that has its bytes to the one that stores
+ * or reads them, and stays tagged with it on disk.
+ *
+ * Where the CPU has SSE4.2 the crc32 instruction takes 8 bytes at a time.
+ * Its latency is three times its throughput, so long buffers are cut into
+ * blocks of three lanes checksummed side by side; the lanes' CRCs are then
+ * joined by multiplying the first two by x^(8 * lane bytes) modulo the
+ * polynomial, a carry-less multiply (PCLMUL) and one more crc32. Other
+ * machines use slicing-by-8 tables. crc_init() picks the routine.
+ *
+ * crc32c(0, buf, len) is the CRC of buf; passing a previous result goes
+ * on from where it stopped, so a stream is checksummed as it goes by.
+ */
+#ifndef S25CRC_H
+#define S25CRC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/xattr.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC_X86 1
+#endif
+
+#define CRC_POLY 0x82f63b78     // Castagnoli, bit-reflected
+#define CRC_LONG 8192           // lane bytes of the hardware loop's long blocks
+#define CRC_SHORT 256           // and of its short ones
+#define CRC_XATTR "user.s25.crc32c"
+
+typedef uint32_t (*crc_fn)(uint32_t crc, const void *buf, size_t len);
+
+static uint32_t crc_table[8][256];
+
+/* x^n modulo the polynomial */
+static inline uint32_t crc_xpow(uint32_t n){
+    uint32_t p = 1u << 31;      // x^0
+    while(n--) p = p & 1 ? (p >> 1) ^ CRC_POLY : p >> 1;
+    return p;
+}
+
+/* Slicing-by-8: eight table lookups per 8 bytes */
+static inline uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len){
+    const uint8_t *p = buf;
+    uint32_t c = ~crc;
+    while(len && ((uintptr_t)p & 7)){
+        c = crc_table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+        len--;
+    }
+    for(; len >= 8; p += 8, len -= 8){
+        uint32_t lo = c ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+        c = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+            crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+            crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+            crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+    }
+    while(len--) c = crc_table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+    return ~c;
+}
+
+#ifdef CRC_X86
+// x^(8 * lane bytes - 33) and x^(16 * lane bytes - 33): with the 33 taken
+// off, clmul then crc32 of the product is exactly the shift by the lane(s)
+static uint32_t crc_k_long[2], crc_k_short[2];
+
+/* Three lanes of n bytes at p, the CRC so far going into the first */
+__attribute__((target("sse4.2,pclmul")))
+static inline uint64_t crc32c_lanes(uint64_t c, const uint8_t *p, size_t n, const uint32_t *k){
+    uint64_t b = 0, d = 0;
+    const uint8_t *end = p + n;
+    for(; p < end; p += 8){
+        uint64_t x, y, z;
+        memcpy(&x, p, 8);
+        memcpy(&y, p + n, 8);
+        memcpy(&z, p + 2 * n, 8);
+        c = _mm_crc32_u64(c, x);
+        b = _mm_crc32_u64(b, y);
+        d = _mm_crc32_u64(d, z);
+    }
+    __m128i a2 = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int)c), _mm_cvtsi32_si128((int)k[1]), 0);
+    __m128i b1 = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int)b), _mm_cvtsi32_si128((int)k[0]), 0);
+    return d ^ _mm_crc32_u64(0, _mm_cvtsi128_si64(_mm_xor_si128(a2, b1)));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static inline uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len){
+    const uint8_t *p = buf;
+    uint64_t c = (uint32_t)~crc;
+    while(len && ((uintptr_t)p & 7)){
+        c = _mm_crc32_u8(c, *p++);
+        len--;
+    }
+    for(; len >= 3 * CRC_LONG; p += 3 * CRC_LONG, len -= 3 * CRC_LONG)
+        c = crc32c_lanes(c, p, CRC_LONG, crc_k_long);
+    for(; len >= 3 * CRC_SHORT; p += 3 * CRC_SHORT, len -= 3 * CRC_SHORT)
+        c = crc32c_lanes(c, p, CRC_SHORT, crc_k_short);
+    for(; len >= 8; p += 8, len -= 8){
+        uint64_t x;
+        memcpy(&x, p, 8);
+        c = _mm_crc32_u64(c, x);
+    }
+    while(len--) c = _mm_crc32_u8(c, *p++);
+    return ~(uint32_t)c;
+}
+#endif
+
+static crc_fn crc32c = crc32c_sw;
+static const char *crc_impl = "table";
+
+/* Build the tables and pick the CRC routine */
+static inline void crc_init(void){
+    for(int n = 0; n < 256; n++){
+        uint32_t c = n;
+        for(int b = 0; b < 8; b++) c = c & 1 ? (c >> 1) ^ CRC_POLY : c >> 1;
+        crc_table[0][n] = c;
+    }
+    for(int n = 0; n < 256; n++)
+        for(int t = 1; t < 8; t++)
+            crc_table[t][n] = crc_table[0][crc_table[t - 1][n] & 0xff] ^ (crc_table[t - 1][n] >> 8);
+#ifdef CRC_X86
+    crc_k_long[0] = crc_xpow(8 * CRC_LONG - 33);
+    crc_k_long[1] = crc_xpow(16 * CRC_LONG - 33);
+    crc_k_short[0] = crc_xpow(8 * CRC_SHORT - 33);
+    crc_k_short[1] = crc_xpow(16 * CRC_SHORT - 33);
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul")) {
+        crc32c = crc32c_hw;
+        crc_impl = "sse4.2";
+    }
+#endif
+}
+
+/* ---------- on disk ----------
+ * A stored file is tagged with its CRC and the size it had, so a file
+ * changed in place behind the server's back no longer matches its tag. */
+
+/* Tag an open file holding size bytes with their crc */
+static inline int crc_save(int fd, uint32_t crc, uint64_t size){
+    uint8_t v[12];
+    for(int i = 0; i < 4; i++) v[i] = crc >> (24 - 8 * i);
+    for(int i = 0; i < 8; i++) v[4 + i] = size >> (56 - 8 * i);
+    return fsetxattr(fd, CRC_XATTR, v, sizeof(v), 0) == 0;
+}
+
+/* The CRC a file of size bytes was tagged with; 0 if it has none */
+static inline int crc_load(int fd, uint64_t size, uint32_t *crc){
+    uint8_t v[12];
+    if(fgetxattr(fd, CRC_XATTR, v, sizeof(v)) != (ssize_t)sizeof(v)) return 0;
+    uint64_t tagged = 0;
+    for(int i = 0; i < 8; i++) tagged = tagged << 8 | v[4 + i];
+    *crc = (uint32_t)v[0] << 24 | (uint32_t)v[1] << 16 | (uint32_t)v[2] << 8 | v[3];
+    return tagged == size;
+}
+
+#endif
@@ -0,0 +1,331 @@
+//s25engine.h
+/* ================= epoll connection engine =================
+ * Shared by S1 and the storage servers. The main thread owns the epoll set
+ * and accepts connections. Each client socket is armed with EPOLLONESHOT, so
+ * an idle connection costs nothing but its fd. When bytes arrive the main
+ * thread peeks at them, consuming none, and measures them with the server's
+ * head callback: a request goes to one of a fixed set of worker threads only
+ * once its head (its fields, up to any file contents) is queued whole. Until
+ * then the socket stays in the epoll set with SO_RCVLOWAT raised to the size
+ * of the head, so a client that sends half a command and stalls holds no
+ * worker.
+ *
+ * The worker runs exactly one command through the serve callback and then
+ * re-arms the socket. It uses blocking I/O, so while it runs the epoll
+ * thread also keeps the command to a minimum pace: every ENGINE_IO_TIMEOUT
+ * seconds, a command that has not moved ENGINE_MIN_RATE bytes a second
+ * across its socket (either way, as counted by the kernel's TCP_INFO) has
+ * the socket shut down under it, and the worker is free again. A peer that
+ * stalls, or trickles a byte at a time, cannot keep a worker; a transfer
+ * at a usable rate holds one until it is done.
+ */
+#ifndef S25ENGINE_H
+#define S25ENGINE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <time.h>
+#include <linux/tcp.h>
+#include "s25metrics.h"
+
+#define MAX_EVENTS 256
+#define WORKERS_MIN 4
+#define ENGINE_HEAD_MAX 65536   // longest request head waited for whole
+#define ENGINE_IO_TIMEOUT 30    // seconds over which a command's pace is judged
+#define ENGINE_MIN_RATE 4096    // bytes a second a command must keep up
+
+/* Connection states for the epoll engine */
+enum conn_state { CONN_IDLE, CONN_READING, CONN_BUSY, CONN_CLOSED };
+
+struct conn {
+    int fd;
+    enum conn_state state;
+    int lowat;              // SO_RCVLOWAT set on fd
+    struct conn *next;      // run queue link
+    // Pace of the command running on it (under busy_lock)
+    uint64_t moved;         // bytes through fd at the last check
+    time_t checked;         // when that was (engine_clock)
+    uint64_t credit;        // bytes it may still fall short by (engine_credit)
+};
+
+/* Runs one command on a ready socket; returns 1 to keep it, 0 to close it */
+typedef int (*serve_fn)(int fd);
+
+/* How many bytes a request's head takes, judged from the first n (n > 0)
+ * that are queued; a guess short of the end is fine while some of it is
+ * still missing, as long as it is more than n */
+typedef size_t (*head_fn)(const char *p, size_t n);
+
+// Engine state shared between the epoll thread and the workers
+static int epfd = -1;
+static serve_fn engine_serve;
+static head_fn engine_head;
+static char engine_peek[ENGINE_HEAD_MAX];  // the epoll thread's
+static struct conn *run_head, *run_tail;
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t run_cond = PTHREAD_COND_INITIALIZER;
+static struct conn **engine_busy;      // the command each worker is running
+static int engine_workers;
+static pthread_mutex_t busy_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct conn *engine_current;
+
+/* Default worker count: one per CPU, never fewer than WORKERS_MIN */
+static int default_workers(void){
+    int n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    return n < WORKERS_MIN ? WORKERS_MIN : n;
+}
+
+/* Put a connection on the run queue for the workers */
+static void engine_push(struct conn *c){
+    pthread_mutex_lock(&run_lock);
+    c->next = NULL;
+    if(run_tail) run_tail->next = c; else run_head = c;
+    run_tail = c;
+    pthread_cond_signal(&run_cond);
+    pthread_mutex_unlock(&run_lock);
+}
+
+static struct conn *engine_pop(void){
+    pthread_mutex_lock(&run_lock);
+    while(!run_head) pthread_cond_wait(&run_cond, &run_lock);
+    struct conn *c = run_head;
+    run_head = c->next;
+    if(!run_head) run_tail = NULL;
+    pthread_mutex_unlock(&run_lock);
+    return c;
+}
+
+/* Wait for the next event on a connection; 0 if it cannot be re-armed */
+static int engine_arm(struct conn *c){
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = c;
+    if(epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) == 0) return 1;
+    perror("epoll_ctl mod");
+    return 0;
+}
+
+static void engine_close(struct conn *c){
+    c->state = CONN_CLOSED;
+    metrics_conn(-1);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c);
+}
+
+/* Wake up only once lowat bytes are queued */
+static void engine_lowat(struct conn *c, int lowat){
+    if(lowat == c->lowat) return;
+    if(setsockopt(c->fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat)) == 0) c->lowat = lowat;
+}
+
+/* Has the head of c's next request arrived? Returns 1 when it is queued
+ * whole, 0 to wait for more, -1 when the connection is finished: closed,
+ * or closed for writing before its request was whole. */
+static int engine_head_ready(struct conn *c, uint32_t events){
+    ssize_t r = recv(c->fd, engine_peek, ENGINE_HEAD_MAX, MSG_PEEK | MSG_DONTWAIT);
+    if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if(r <= 0) {
+        return -1;
+    }
+    size_t need = engine_head(engine_peek, r);
+    if(need > ENGINE_HEAD_MAX) need = ENGINE_HEAD_MAX;
+    if((size_t)r >= need) {
+        engine_lowat(c, 1);     // the worker reads the rest as it comes
+        return 1;
+    }
+    if(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        return -1;
+    }
+    engine_lowat(c, (int)need);
+    return 0;
+}
+
+static time_t engine_clock(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/* Bytes received and acknowledged on socket fd so far */
+static uint64_t engine_moved(int fd){
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    memset(&ti, 0, sizeof(ti));
+    if(getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0) return 0;
+    return ti.tcpi_bytes_received + ti.tcpi_bytes_acked;
+}
+
+/* Let the command running on this thread fall short of the minimum pace by
+ * up to bytes more, e.g. while its client moves that much elsewhere before
+ * it carries on. Nothing outside the engine's workers. */
+static inline void engine_credit(uint64_t bytes){
+    pthread_mutex_lock(&busy_lock);
+    if(engine_current) engine_current->credit += bytes;
+    pthread_mutex_unlock(&busy_lock);
+}
+
+/* Shut down the sockets of commands that moved too little since their last
+ * check, ENGINE_IO_TIMEOUT or more seconds ago. Their workers' blocking
+ * calls then fail, so the commands end and the connections are closed. */
+static void engine_watch(time_t now){
+    pthread_mutex_lock(&busy_lock);
+    for(int i = 0; i < engine_workers; i++){
+        struct conn *c = engine_busy[i];
+        if(!c || now - c->checked < ENGINE_IO_TIMEOUT) continue;
+        uint64_t moved = engine_moved(c->fd);
+        uint64_t need = (uint64_t)ENGINE_MIN_RATE * (now - c->checked);
+        uint64_t got = moved - c->moved;
+        if(got < need && c->credit >= need - got) {
+            c->credit -= need - got;
+        } else if(got < need) {
+            shutdown(c->fd, SHUT_RDWR);
+        }
+        c->moved = moved;
+        c->checked = now;
+    }
+    pthread_mutex_unlock(&busy_lock);
+}
+
+/* Worker thread: drive ready connections through one state transition */
+static void *engine_worker(void *arg){
+    struct conn **slot = arg;
+    while(1) {
+        struct conn *c = engine_pop();
+        pthread_mutex_lock(&busy_lock);
+        c->moved = engine_moved(c->fd);
+        c->checked = engine_clock();
+        c->credit = 0;
+        *slot = engine_current = c;
+        pthread_mutex_unlock(&busy_lock);
+
+        int keep = engine_serve(c->fd);
+
+        pthread_mutex_lock(&busy_lock);
+        *slot = engine_current = NULL;
+        pthread_mutex_unlock(&busy_lock);
+
+        if(keep) {
+            c->state = CONN_IDLE;
+            if(engine_arm(c)) continue;
+        }
+        engine_close(c);
+    }
+    return NULL;
+}
+
+/* Accept on sockfd forever, running serve() for every request once
+ * head() says it has arrived */
+static int run_engine(int sockfd, int workers, serve_fn serve, head_fn head){
+    engine_serve = serve;
+    engine_head = head;
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epfd < 0){
+        perror("epoll_create1");
+        return 1;
+    }
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;     // NULL marks the listening socket
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0){
+        perror("epoll_ctl add");
+        return 1;
+    }
+
+    engine_busy = calloc(workers, sizeof(*engine_busy));
+    if(!engine_busy){
+        perror("calloc");
+        return 1;
+    }
+    engine_workers = workers;
+    for(int i = 0; i < workers; i++){
+        pthread_t t;
+        if(pthread_create(&t, NULL, engine_worker, &engine_busy[i]) != 0){
+            perror("pthread_create");
+            return 1;
+        }
+        pthread_detach(t);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    time_t watched = engine_clock();
+    while(1) {
+        // Wake up at least once a second to keep the workers' commands moving
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+        time_t now = engine_clock();
+        if(now != watched) {
+            engine_watch(now);
+            watched = now;
+        }
+        if(n < 0){
+            if(errno == EINTR) continue;
+            perror("epoll_wait");
+            return 1;
+        }
+        for(int i = 0; i < n; i++){
+            struct conn *c = events[i].data.ptr;
+            if(c == NULL){
+                // Drain the accept queue; the listening socket is non-blocking
+                while(1) {
+                    int fd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC);
+                    if(fd < 0){
+                        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                            perror("accept");
+                        break;
+                    }
+                    // Replies are a small header followed by the data; without
+                    // this the data waits out the peer's delayed ACK
+                    int one = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    // The socket stays blocking for the workers; the epoll
+                    // thread only peeks with MSG_DONTWAIT
+                    c = calloc(1, sizeof(*c));
+                    if(!c){
+                        close(fd);
+                        continue;
+                    }
+                    c->fd = fd;
+                    c->state = CONN_IDLE;
+                    c->lowat = 1;
+                    struct epoll_event cev;
+                    cev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+                    cev.data.ptr = c;
+                    if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &cev) < 0){
+                        perror("epoll_ctl add");
+                        close(fd);
+                        free(c);
+                        continue;
+                    }
+                    metrics_conn(1);
+                }
+                continue;
+            }
+            // One-shot: the fd stays disarmed until it is re-armed here, for
+            // the rest of a head, or by the worker once the command is done
+            int ready = engine_head_ready(c, events[i].events);
+            if(ready > 0) {
+                c->state = CONN_BUSY;
+                engine_push(c);
+            } else if(ready < 0 || !engine_arm(c)) {
+                engine_close(c);
+            } else {
+                c->state = c->lowat > 1 ? CONN_READING : CONN_IDLE;
+            }
+        }
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,486 @@
+//s25index.h
+/* ================= filename index =================
+ * Each server keeps, per directory, the sorted names of its files of one
+ * type and of the subdirectories, in memory. A listing copies names out
+ * instead of reading and sorting the directory, a page of a listing is a
+ * range scan, and uploads and removes insert or delete a single name.
+ *
+ * A directory's names are trusted while its mtime is the one they were
+ * read at, so files changed behind the server's back are picked up by a
+ * rescan on the next listing. A scan that lands in the same second as the
+ * directory's last change is not trusted (another change in that second
+ * would leave the mtime as it is), and is repeated next time.
+ *
+ * Every directory has its own lock. A recursive page holds the locks of
+ * the directories above the one it is reading, always taken top-down.
+ *
+ * The index is saved to a snapshot file now and then and loaded back at
+ * startup, so a restarted server does not rescan directories that did not
+ * change.
+ */
+#ifndef S25INDEX_H
+#define S25INDEX_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define INDEX_BUCKETS 4096
+#define INDEX_SAVE_CHANGES 1024 // changed names before the snapshot is rewritten
+#define INDEX_SAVE_AGE 60       // or seconds since the last one, once changed
+#define INDEX_MAGIC "s25index 2"
+
+/* A sorted set of names */
+struct name_set {
+    char **v;
+    size_t n, cap;
+};
+
+/* One directory: its files of the indexed type and its subdirectories */
+struct index_dir {
+    char *path;
+    pthread_rwlock_t lock;  // guards everything below
+    struct timespec mtime;  // directory mtime the names reflect; 0 = rescan
+    struct name_set files;
+    struct name_set dirs;   // as "name/", so they sort where their contents do
+    struct index_dir *next; // hash chain, under index_lock
+};
+
+static struct index_dir *index_tab[INDEX_BUCKETS];
+static size_t index_ndirs;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t index_save_lock = PTHREAD_MUTEX_INITIALIZER;
+static char index_ext[16];
+static char index_file[PATH_MAX];
+static unsigned index_changes;
+static time_t index_saved;
+
+static int name_cmp(const void *a, const void *b){
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Position of name in s, or where it would go; *found tells which */
+static size_t set_search(const struct name_set *s, const char *name, int *found){
+    size_t lo = 0, hi = s->n;
+    while(lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+        int c = strcmp(s->v[mid], name);
+        if(c == 0){
+            *found = 1;
+            return mid;
+        }
+        if(c < 0) lo = mid + 1; else hi = mid;
+    }
+    *found = 0;
+    return lo;
+}
+
+/* Add name at position at (at = s->n appends) */
+static int set_put(struct name_set *s, size_t at, const char *name){
+    if(s->n == s->cap){
+        size_t cap = s->cap ? s->cap * 2 : 16;
+        char **grown = realloc(s->v, cap * sizeof(*grown));
+        if(!grown) return 0;
+        s->v = grown;
+        s->cap = cap;
+    }
+    char *copy = strdup(name);
+    if(!copy) return 0;
+    memmove(s->v + at + 1, s->v + at, (s->n - at) * sizeof(*s->v));
+    s->v[at] = copy;
+    s->n++;
+    return 1;
+}
+
+static int set_insert(struct name_set *s, const char *name){
+    int found;
+    size_t at = set_search(s, name, &found);
+    return found || set_put(s, at, name);
+}
+
+static void set_delete(struct name_set *s, const char *name){
+    int found;
+    size_t at = set_search(s, name, &found);
+    if(!found) return;
+    free(s->v[at]);
+    memmove(s->v + at, s->v + at + 1, (s->n - at - 1) * sizeof(*s->v));
+    s->n--;
+}
+
+static void set_clear(struct name_set *s){
+    for(size_t i = 0; i < s->n; i++) free(s->v[i]);
+    free(s->v);
+    s->v = NULL;
+    s->n = s->cap = 0;
+}
+
+/* Canonical form of a directory path: no repeated or trailing '/' */
+static void index_key(const char *in, char *out, size_t outlen){
+    size_t k = 0;
+    for(const char *p = in; *p && k + 1 < outlen; p++){
+        if(*p == '/' && k > 0 && out[k - 1] == '/') continue;
+        out[k++] = *p;
+    }
+    while(k > 1 && out[k - 1] == '/') k--;
+    out[k] = '\0';
+}
+
+static unsigned index_hash(const char *s){
+    unsigned h = 2166136261u;
+    while(*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h % INDEX_BUCKETS;
+}
+
+/* The entry for directory key, created on demand (create = 1). Entries
+ * are never freed, so the pointer stays valid. */
+static struct index_dir *index_dir_get(const char *key, int create){
+    unsigned h = index_hash(key);
+    pthread_mutex_lock(&index_lock);
+    struct index_dir *d = index_tab[h];
+    while(d && strcmp(d->path, key) != 0) d = d->next;
+    if(!d && create && (d = calloc(1, sizeof(*d)))){
+        if((d->path = strdup(key))){
+            pthread_rwlock_init(&d->lock, NULL);
+            d->next = index_tab[h];
+            index_tab[h] = d;
+            index_ndirs++;
+        } else {
+            free(d);
+            d = NULL;
+        }
+    }
+    pthread_mutex_unlock(&index_lock);
+    return d;
+}
+
+/* Is name a file of the indexed type? */
+static int index_match(const char *name){
+    size_t n = strlen(name), e = strlen(index_ext);
+    return n > e && strcmp(name + n - e, index_ext) == 0 && !strchr(name, '\n');
+}
+
+/* Read a directory into d (write-locked), given the stat taken before. On
+ * failure d is left marked for a rescan. Returns the names read. */
+static size_t index_scan(struct index_dir *d, const struct stat *st){
+    set_clear(&d->files);
+    set_clear(&d->dirs);
+    d->mtime.tv_sec = d->mtime.tv_nsec = 0;
+    DIR *dir = opendir(d->path);
+    if(!dir) return 0;
+    struct dirent *de;
+    int ok = 1;
+    while(ok && (de = readdir(dir)) != NULL){
+        if(de->d_type == DT_DIR){
+            char name[NAME_MAX + 2];
+            snprintf(name, sizeof(name), "%s/", de->d_name);
+            if(strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0 &&
+               !strchr(de->d_name, '\n'))
+                ok = set_put(&d->dirs, d->dirs.n, name);
+        } else if(de->d_type == DT_REG && index_match(de->d_name)) {
+            ok = set_put(&d->files, d->files.n, de->d_name);
+        }
+    }
+    closedir(dir);
+    if(d->files.n > 1) qsort(d->files.v, d->files.n, sizeof(char *), name_cmp);
+    if(d->dirs.n > 1) qsort(d->dirs.v, d->dirs.n, sizeof(char *), name_cmp);
+    // changed in the second of the scan: something may have been missed
+    if(ok && time(NULL) > st->st_mtim.tv_sec) d->mtime = st->st_mtim;
+    return d->files.n + d->dirs.n;
+}
+
+static int index_fresh(const struct index_dir *d, const struct stat *st){
+    return d->mtime.tv_sec != 0 && d->mtime.tv_sec == st->st_mtim.tv_sec &&
+           d->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* Directory key, read-locked and up to date; NULL if it is not a
+ * directory. The caller unlocks d->lock. */
+static struct index_dir *index_acquire(const char *key){
+    struct stat st;
+    if(stat(key, &st) < 0 || !S_ISDIR(st.st_mode)) return NULL;
+    struct index_dir *d = index_dir_get(key, 1);
+    if(!d) return NULL;
+    pthread_rwlock_rdlock(&d->lock);
+    if(index_fresh(d, &st)) return d;
+    pthread_rwlock_unlock(&d->lock);
+    pthread_rwlock_wrlock(&d->lock);
+    if(!index_fresh(d, &st)){
+        size_t n = index_scan(d, &st);
+        __atomic_add_fetch(&index_changes, n ? n : 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&d->lock);
+    pthread_rwlock_rdlock(&d->lock);
+    return d;
+}
+
+static void index_write_set(FILE *f, const struct name_set *s){
+    for(size_t i = 0; i < s->n; i++) fprintf(f, "%s\n", s->v[i]);
+}
+
+/* Write the whole index to the snapshot file (temp file + rename) */
+static void index_save(void){
+    if(!index_file[0] || pthread_mutex_trylock(&index_save_lock) != 0) return;
+    __atomic_store_n(&index_changes, 0, __ATOMIC_RELAXED);
+    index_saved = time(NULL);
+
+    // Take the list of entries first: no directory lock under index_lock
+    pthread_mutex_lock(&index_lock);
+    size_t n = 0;
+    struct index_dir **all = malloc((index_ndirs + 1) * sizeof(*all));
+    for(int b = 0; all && b < INDEX_BUCKETS; b++)
+        for(struct index_dir *d = index_tab[b]; d; d = d->next) all[n++] = d;
+    pthread_mutex_unlock(&index_lock);
+
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", index_file);
+    int fd = all ? mkstemp(tmp) : -1;
+    FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if(!f){
+        if(fd >= 0) close(fd);
+        free(all);
+        pthread_mutex_unlock(&index_save_lock);
+        return;
+    }
+    fprintf(f, "%s %s\n", INDEX_MAGIC, index_ext);
+    for(size_t i = 0; i < n; i++){
+        struct index_dir *d = all[i];
+        pthread_rwlock_rdlock(&d->lock);
+        if(d->mtime.tv_sec != 0){
+            fprintf(f, "D %lld %ld %zu %zu %s\n", (long long)d->mtime.tv_sec,
+                    d->mtime.tv_nsec, d->files.n, d->dirs.n, d->path);
+            index_write_set(f, &d->files);
+            index_write_set(f, &d->dirs);
+        }
+        pthread_rwlock_unlock(&d->lock);
+    }
+    free(all);
+    if(fclose(f) == 0) rename(tmp, index_file);
+    else unlink(tmp);
+    pthread_mutex_unlock(&index_save_lock);
+}
+
+/* Rewrite the snapshot if enough has changed; called with no lock held */
+static void index_maybe_save(void){
+    unsigned n = __atomic_load_n(&index_changes, __ATOMIC_RELAXED);
+    if(n >= INDEX_SAVE_CHANGES || (n > 0 && time(NULL) - index_saved >= INDEX_SAVE_AGE))
+        index_save();
+}
+
+/* Set up the index for files ending in ext, loading the snapshot at file
+ * if there is one. Nothing is scanned here: a directory is read the first
+ * time it is listed, if its snapshot entry is missing or out of date. */
+static void index_open(const char *file, const char *ext){
+    snprintf(index_ext, sizeof(index_ext), "%s", ext);
+    snprintf(index_file, sizeof(index_file), "%s", file);
+    index_saved = time(NULL);
+    FILE *f = fopen(file, "r");
+    if(!f) return;
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len = getline(&line, &cap, f);
+    char magic[64];
+    snprintf(magic, sizeof(magic), "%s %s\n", INDEX_MAGIC, ext);
+    if(len < 0 || strcmp(line, magic) != 0){
+        free(line);
+        fclose(f);
+        return;     // another format or type: start empty
+    }
+    struct index_dir *d = NULL;
+    size_t files = 0, dirs = 0;
+    while((len = getline(&line, &cap, f)) > 0){
+        if(line[len - 1] == '\n') line[--len] = '\0';
+        if(files + dirs == 0){
+            long long sec;
+            long nsec;
+            int at = 0;
+            if(sscanf(line, "D %lld %ld %zu %zu %n", &sec, &nsec, &files, &dirs, &at) < 4 ||
+               at == 0) break;
+            char key[PATH_MAX];
+            index_key(line + at, key, sizeof(key));
+            if(!(d = index_dir_get(key, 1))) break;
+            set_clear(&d->files);
+            set_clear(&d->dirs);
+            d->mtime.tv_sec = sec;
+            d->mtime.tv_nsec = nsec;
+            continue;
+        }
+        // names were saved in order, so inserting appends
+        struct name_set *s = files > 0 ? &d->files : &d->dirs;
+        if(!set_insert(s, line)) d->mtime.tv_sec = d->mtime.tv_nsec = 0;
+        if(files > 0) files--; else dirs--;
+    }
+    if(files + dirs > 0 && d) d->mtime.tv_sec = d->mtime.tv_nsec = 0;  // truncated file
+    free(line);
+    fclose(f);
+}
+
+/* Sorted names of the indexed files in dir, as a malloc'd array of
+ * malloc'd strings; NULL with *count 0 if there are none */
+static char **index_list(const char *dir, size_t *count){
+    char key[PATH_MAX];
+    index_key(dir, key, sizeof(key));
+    *count = 0;
+    struct index_dir *d = index_acquire(key);
+    if(!d) return NULL;
+    char **names = NULL;
+    if(d->files.n > 0 && (names = malloc(d->files.n * sizeof(*names)))){
+        size_t i = 0;
+        for(; i < d->files.n && (names[i] = strdup(d->files.v[i])); i++);
+        *count = i;
+    }
+    pthread_rwlock_unlock(&d->lock);
+    index_maybe_save();
+    return names;
+}
+
+/* ================= listing pages =================
+ * A page lists the entries of a directory in strcmp order of their path
+ * relative to it: the indexed files, and either the subdirectories (as
+ * "name/") or, recursively, everything below them. Only entries starting
+ * with prefix and sorting after cursor are taken, up to limit of them.
+ *
+ * Subdirectories are kept as "d/", so their contents can be merged with
+ * the files next to them without sorting anything.
+ */
+struct index_pager {
+    const char *prefix;
+    const char *cursor;     // "" = from the start
+    size_t limit;
+    int recursive;
+    char **out;
+    size_t n;               // collects up to limit + 1 to tell if there is more
+};
+
+static int starts_with(const char *s, const char *prefix){
+    return strncmp(s, prefix, strlen(prefix)) == 0;
+}
+
+/* Is entry k past the start of the page? */
+static int page_after(const struct index_pager *pg, const char *k){
+    return (!pg->cursor[0] || strcmp(k, pg->cursor) > 0) && strcmp(k, pg->prefix) >= 0;
+}
+
+/* Could anything below subdirectory s ("rel/d/") be past the start? */
+static int page_subtree_after(const struct index_pager *pg, const char *s){
+    return (!pg->cursor[0] || strcmp(s, pg->cursor) > 0 || starts_with(pg->cursor, s)) &&
+           (strcmp(s, pg->prefix) >= 0 || starts_with(pg->prefix, s));
+}
+
+/* First i for which rel + s->v[i] is past the start of the page; with
+ * subtree, s->v[i] is a subdirectory standing for everything below it */
+static size_t page_lower(const struct index_pager *pg, const struct name_set *s,
+                         const char *rel, int subtree){
+    size_t lo = 0, hi = s->n;
+    char k[PATH_MAX];
+    while(lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+        snprintf(k, sizeof(k), "%s%s", rel, s->v[mid]);
+        if(subtree ? page_subtree_after(pg, k) : page_after(pg, k)) hi = mid;
+        else lo = mid + 1;
+    }
+    return lo;
+}
+
+static int page_push(struct index_pager *pg, const char *k){
+    char *copy = strdup(k);
+    if(!copy) return 0;
+    pg->out[pg->n++] = copy;
+    return 1;
+}
+
+/* Add the entries of directory abs to the page; rel is its path within
+ * the listing, "" or ending in '/' */
+static void page_dir(struct index_pager *pg, const char *abs, const char *rel){
+    struct index_dir *d = index_acquire(abs);
+    if(!d) return;
+    size_t i = page_lower(pg, &d->files, rel, 0);
+    size_t j = page_lower(pg, &d->dirs, rel, pg->recursive);
+    char fk[PATH_MAX], dk[PATH_MAX];
+    while(pg->n <= pg->limit){
+        int hf = 0, hd = 0;
+        if(i < d->files.n){
+            snprintf(fk, sizeof(fk), "%s%s", rel, d->files.v[i]);
+            hf = starts_with(fk, pg->prefix);
+            if(!hf) i = d->files.n;     // sorted: the rest is past the prefix
+        }
+        if(j < d->dirs.n){
+            snprintf(dk, sizeof(dk), "%s%s", rel, d->dirs.v[j]);
+            hd = starts_with(dk, pg->prefix) || (pg->recursive && starts_with(pg->prefix, dk));
+            if(!hd) j = d->dirs.n;
+        }
+        if(!hf && !hd) break;
+        if(hf && (!hd || strcmp(fk, dk) < 0)){
+            if(!page_push(pg, fk)) break;
+            i++;
+        } else {
+            if(pg->recursive){
+                char child[PATH_MAX];
+                snprintf(child, sizeof(child), "%s/%.*s", d->path,
+                         (int)strlen(d->dirs.v[j]) - 1, d->dirs.v[j]);
+                page_dir(pg, child, dk);
+            } else if(!page_push(pg, dk)) {
+                break;
+            }
+            j++;
+        }
+    }
+    pthread_rwlock_unlock(&d->lock);
+}
+
+/* One page of the listing of dir. Returns the entries as a malloc'd array
+ * of malloc'd strings (NULL if none) and sets *more if entries follow the
+ * last one, which is then the cursor for the next page. */
+static char **index_page(const char *dir, const char *prefix, const char *cursor,
+                         size_t limit, int recursive, size_t *count, int *more){
+    char key[PATH_MAX];
+    index_key(dir, key, sizeof(key));
+    struct index_pager pg = { prefix, cursor, limit, recursive, NULL, 0 };
+    *count = 0;
+    *more = 0;
+    if(limit == 0 || !(pg.out = malloc((limit + 1) * sizeof(char *)))) return NULL;
+    page_dir(&pg, key, "");
+    if(pg.n > limit){
+        free(pg.out[--pg.n]);
+        *more = 1;
+    }
+    *count = pg.n;
+    index_maybe_save();
+    return pg.out;
+}
+
+/* Record that a file was stored at path (add 1) or removed from it (add 0) */
+static void index_update(const char *path, int add){
+    char key[PATH_MAX];
+    index_key(path, key, sizeof(key));
+    char *slash = strrchr(key, '/');
+    if(!slash || slash == key || !index_match(slash + 1)) return;
+    *slash = '\0';
+
+    struct index_dir *d = index_dir_get(key, 0);
+    if(!d) return;      // never listed: read on its first listing
+    pthread_rwlock_wrlock(&d->lock);
+    struct stat st;
+    if(d->mtime.tv_sec != 0){
+        // an untrusted directory is rescanned on its next listing anyway
+        int ok = 1;
+        if(add) ok = set_insert(&d->files, slash + 1);
+        else set_delete(&d->files, slash + 1);
+        if(ok && stat(key, &st) == 0) {
+            d->mtime = st.st_mtim;
+        } else {
+            d->mtime.tv_sec = d->mtime.tv_nsec = 0;
+        }
+    }
+    pthread_rwlock_unlock(&d->lock);
+    __atomic_add_fetch(&index_changes, 1, __ATOMIC_RELAXED);
+    index_maybe_save();
+}
+
+#endif
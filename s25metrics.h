@@ -0,0 +1,279 @@
+//s25metrics.h
+/* ================= metrics =================
+ * Counters and latency histograms kept by S1 and the storage servers and
+ * reported by the stats command: commands served and how long they took,
+ * S1's calls to the storage servers, bytes read and written on sockets,
+ * connections and failed connects to storage servers.
+ *
+ * Every thread counts into a shard of its own, so recording takes no lock
+ * and shares no cache line with other threads; a stats request adds the
+ * shards up while they keep counting. The shards live in one shared
+ * mapping made by metrics_init(), so the children of S1's fork mode count
+ * into it too. A process that never called metrics_init() (the client)
+ * counts nothing.
+ *
+ * Latencies go into log-linear histograms in the style of HdrHistogram:
+ * values below HIST_SUB microseconds get a bucket each, and every power of
+ * two above that is split into HIST_SUB buckets. A value is thus known to
+ * within 1/HIST_SUB of itself (6%), from a microsecond to hours, in a few
+ * hundred counters.
+ */
+#ifndef S25METRICS_H
+#define S25METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_EXP_MAX 36                 // 2^36 us, about 19 hours
+#define HIST_BUCKETS ((HIST_EXP_MAX - HIST_SUB_BITS + 2) * HIST_SUB)
+#define METRICS_SHARDS 128              // threads (beyond that they share one)
+#define METRIC_OPS 16
+
+/* A latency histogram, in microseconds */
+struct hist {
+    uint64_t count, sum, max;
+    uint64_t bucket[HIST_BUCKETS];
+};
+
+/* One thread's counters */
+struct metrics_shard {
+    uint64_t bytes_in, bytes_out;
+    int64_t conns_active;           // this shard's opens minus closes
+    uint64_t conns_total;
+    uint64_t connect_failures;      // to storage servers
+    struct hist cmd[METRIC_OPS];    // commands served
+    struct hist call[METRIC_OPS];   // calls to storage servers
+} __attribute__((aligned(64)));
+
+struct metrics_arena {
+    uint32_t used;                  // shards handed out
+    time_t started;
+    struct metrics_shard shard[METRICS_SHARDS];
+};
+
+// Commands by metric slot: client commands, then storage server commands
+static const char *const metrics_names[METRIC_OPS] = {
+    "uploadf", "downlf", "removef", "downltar", "dispfnames", "listf", "stats",
+    "upload", "get", "remove", "list", "tar", "ping", "page", "tput", "tget",
+};
+
+static struct metrics_arena *metrics_arena;
+static const char *metrics_server = "";
+static __thread struct metrics_shard *metrics_local;
+
+static inline uint64_t metrics_now_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* ---------- histograms ---------- */
+
+static inline int hist_bucket(uint64_t v){
+    if(v < HIST_SUB) return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    if(e > HIST_EXP_MAX) return HIST_BUCKETS - 1;
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* The largest value bucket b holds */
+static inline uint64_t hist_upper(int b){
+    if(b < HIST_SUB) return b;
+    int e = b / HIST_SUB - 1 + HIST_SUB_BITS;
+    uint64_t low = (uint64_t)(HIST_SUB + b % HIST_SUB) << (e - HIST_SUB_BITS);
+    return low + (1ULL << (e - HIST_SUB_BITS)) - 1;
+}
+
+/* Record v; safe against concurrent adds to the same histogram */
+static inline void hist_add(struct hist *h, uint64_t v){
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->bucket[hist_bucket(v)], 1, __ATOMIC_RELAXED);
+    uint64_t m = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while(v > m && !__atomic_compare_exchange_n(&h->max, &m, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* Add src, which may still be counting, into dst */
+static inline void hist_merge(struct hist *dst, const struct hist *src){
+    uint64_t m = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if(m > dst->max) dst->max = m;
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    // The count is taken from the buckets so the quantiles add up
+    for(int b = 0; b < HIST_BUCKETS; b++){
+        uint64_t n = __atomic_load_n(&src->bucket[b], __ATOMIC_RELAXED);
+        dst->bucket[b] += n;
+        dst->count += n;
+    }
+}
+
+/* The value below which a fraction q of the recorded values lie (the top
+ * of its bucket, at most the largest value seen) */
+static inline uint64_t hist_quantile(const struct hist *h, double q){
+    if(h->count == 0) return 0;
+    uint64_t rank = (uint64_t)(q * h->count + 0.5), seen = 0;
+    if(rank < 1) rank = 1;
+    for(int b = 0; b < HIST_BUCKETS; b++){
+        seen += h->bucket[b];
+        if(seen >= rank) return hist_upper(b) < h->max ? hist_upper(b) : h->max;
+    }
+    return h->max;
+}
+
+/* ---------- recording ---------- */
+
+/* The calling thread's shard; NULL when not counting */
+static inline struct metrics_shard *metrics_shard(void){
+    if(!metrics_local && metrics_arena) {
+        uint32_t i = __atomic_fetch_add(&metrics_arena->used, 1, __ATOMIC_RELAXED);
+        metrics_local = &metrics_arena->shard[i < METRICS_SHARDS ? i : METRICS_SHARDS - 1];
+    }
+    return metrics_local;
+}
+
+/* Start counting, as server name; before any thread or child is made */
+static inline int metrics_init(const char *name){
+    void *p = mmap(NULL, sizeof(struct metrics_arena), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(p == MAP_FAILED) {
+        perror("mmap metrics");
+        return 0;
+    }
+    metrics_arena = p;
+    metrics_arena->started = time(NULL);
+    metrics_server = name;
+    metrics_shard();            // fork mode's children count into this one
+    return 1;
+}
+
+/* The metric slot of an opcode, or -1 */
+static inline int metrics_slot(int op){
+    if(op >= 1 && op <= 7) return op - 1;
+    if(op >= 16 && op < 16 + METRIC_OPS - 7) return op - 16 + 7;
+    return -1;
+}
+
+/* Bytes read from and written to a socket */
+static inline void metrics_io(uint64_t in, uint64_t out){
+    struct metrics_shard *s = metrics_shard();
+    if(!s) return;
+    if(in) __atomic_fetch_add(&s->bytes_in, in, __ATOMIC_RELAXED);
+    if(out) __atomic_fetch_add(&s->bytes_out, out, __ATOMIC_RELAXED);
+}
+
+/* A connection was accepted (1) or closed (-1) */
+static inline void metrics_conn(int delta){
+    struct metrics_shard *s = metrics_shard();
+    if(!s) return;
+    __atomic_fetch_add(&s->conns_active, delta, __ATOMIC_RELAXED);
+    if(delta > 0) __atomic_fetch_add(&s->conns_total, 1, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_connect_failed(void){
+    struct metrics_shard *s = metrics_shard();
+    if(s) __atomic_fetch_add(&s->connect_failures, 1, __ATOMIC_RELAXED);
+}
+
+/* A command op served, started at start (metrics_now_us()) */
+static inline void metrics_command(int op, uint64_t start){
+    struct metrics_shard *s = metrics_shard();
+    int i = metrics_slot(op);
+    if(s && i >= 0) hist_add(&s->cmd[i], metrics_now_us() - start);
+}
+
+/* A call op made to a storage server, started at start */
+static inline void metrics_call(int op, uint64_t start){
+    struct metrics_shard *s = metrics_shard();
+    int i = metrics_slot(op);
+    if(s && i >= 0) hist_add(&s->call[i], metrics_now_us() - start);
+}
+
+/* ---------- reporting ---------- */
+
+static inline void metrics_hist_json(FILE *f, const struct hist *h){
+    fprintf(f, "{\"count\":%llu,\"mean_us\":%llu,\"p50_us\":%llu,\"p90_us\":%llu,"
+               "\"p99_us\":%llu,\"p999_us\":%llu,\"max_us\":%llu}",
+            (unsigned long long)h->count, (unsigned long long)(h->count ? h->sum / h->count : 0),
+            (unsigned long long)hist_quantile(h, 0.5), (unsigned long long)hist_quantile(h, 0.9),
+            (unsigned long long)hist_quantile(h, 0.99), (unsigned long long)hist_quantile(h, 0.999),
+            (unsigned long long)h->max);
+}
+
+static inline void metrics_hist_text(FILE *f, const char *name, const struct hist *h){
+    fprintf(f, "%-12s %10llu %9llu %9llu %9llu %9llu %9llu %9llu\n", name,
+            (unsigned long long)h->count, (unsigned long long)(h->count ? h->sum / h->count : 0),
+            (unsigned long long)hist_quantile(h, 0.5), (unsigned long long)hist_quantile(h, 0.9),
+            (unsigned long long)hist_quantile(h, 0.99), (unsigned long long)hist_quantile(h, 0.999),
+            (unsigned long long)h->max);
+}
+
+/* One table of histograms (commands or calls); only those used appear */
+static inline void metrics_table(FILE *f, int json, const char *title, const struct hist *h){
+    int first = 1;
+    for(int i = 0; i < METRIC_OPS; i++){
+        if(h[i].count == 0) continue;
+        if(json) {
+            fprintf(f, "%s\"%s\":", first ? "" : ",", metrics_names[i]);
+            metrics_hist_json(f, &h[i]);
+        } else {
+            if(first) fprintf(f, "%-12s %10s %9s %9s %9s %9s %9s %9s\n", title, "count",
+                              "mean_us", "p50_us", "p90_us", "p99_us", "p999_us", "max_us");
+            metrics_hist_text(f, metrics_names[i], &h[i]);
+        }
+        first = 0;
+    }
+}
+
+/* Write this server's figures to f as text or as one JSON object */
+static inline int metrics_report(FILE *f, int json){
+    if(!metrics_arena) return 0;
+    struct metrics_shard *sum = calloc(1, sizeof(*sum));
+    if(!sum) return 0;
+    uint32_t used = __atomic_load_n(&metrics_arena->used, __ATOMIC_RELAXED);
+    if(used > METRICS_SHARDS) used = METRICS_SHARDS;
+    for(uint32_t i = 0; i < used; i++){
+        const struct metrics_shard *s = &metrics_arena->shard[i];
+        sum->bytes_in += __atomic_load_n(&s->bytes_in, __ATOMIC_RELAXED);
+        sum->bytes_out += __atomic_load_n(&s->bytes_out, __ATOMIC_RELAXED);
+        sum->conns_active += __atomic_load_n(&s->conns_active, __ATOMIC_RELAXED);
+        sum->conns_total += __atomic_load_n(&s->conns_total, __ATOMIC_RELAXED);
+        sum->connect_failures += __atomic_load_n(&s->connect_failures, __ATOMIC_RELAXED);
+        for(int k = 0; k < METRIC_OPS; k++){
+            hist_merge(&sum->cmd[k], &s->cmd[k]);
+            hist_merge(&sum->call[k], &s->call[k]);
+        }
+    }
+    long long up = (long long)(time(NULL) - metrics_arena->started);
+    if(json) {
+        fprintf(f, "{\"server\":\"%s\",\"uptime_s\":%lld,\"threads\":%u,"
+                   "\"connections\":{\"active\":%lld,\"total\":%llu},"
+                   "\"bytes\":{\"in\":%llu,\"out\":%llu},\"backend_connect_failures\":%llu,"
+                   "\"commands\":{", metrics_server, up, used,
+                (long long)sum->conns_active, (unsigned long long)sum->conns_total,
+                (unsigned long long)sum->bytes_in, (unsigned long long)sum->bytes_out,
+                (unsigned long long)sum->connect_failures);
+        metrics_table(f, 1, NULL, sum->cmd);
+        fprintf(f, "},\"backend_calls\":{");
+        metrics_table(f, 1, NULL, sum->call);
+        fprintf(f, "}}");
+    } else {
+        fprintf(f, "%s: up %lld s, %u threads\n"
+                   "connections: %lld active, %llu total\n"
+                   "bytes: %llu in, %llu out\n"
+                   "backend connect failures: %llu\n", metrics_server, up, used,
+                (long long)sum->conns_active, (unsigned long long)sum->conns_total,
+                (unsigned long long)sum->bytes_in, (unsigned long long)sum->bytes_out,
+                (unsigned long long)sum->connect_failures);
+        metrics_table(f, 0, "command", sum->cmd);
+        metrics_table(f, 0, "backend call", sum->call);
+    }
+    free(sum);
+    return 1;
+}
+
+#endif
@@ -0,0 +1,785 @@
+//s25proto.h
+/* Wire protocol shared by the client, S1 and the storage servers.
+ *
+ * v1 (legacy): every string is a zero-padded BUF-byte frame, integers are
+ * raw host-order ints and replies carry no header. The client sends its
+ * command name as a NUL-terminated string; S1 sends backend commands as
+ * BUF-byte frames.
+ *
+ * v2: every request and reply starts with a fixed 24-byte header
+ *
+ *     u16 magic | u8 version | u8 opcode | u32 flags | u32 reqid |
+ *     u32 reserved | u64 len
+ *
+ * in network byte order, followed by len payload bytes. Payload fields are
+ * u32 counts, u64 sizes and u16 length-prefixed strings; file contents
+ * follow their size field unpadded. Each item of a v2 request (a file, a
+ * path, a listing) gets exactly one DATA or STATUS reply carrying the
+ * request's id.
+ *
+ * Servers detect the version from the first byte of every request: the v2
+ * magic is not printable ASCII, so it never starts a v1 command name.
+ *
+ * Large-object mode (v2 only): when a request carries S25_F_CHUNKED, file
+ * contents travel as a run of DATA frames of at most S25_CHUNK bytes, all
+ * but the last flagged S25_F_MORE. The receiver acknowledges every chunk
+ * with a STATUS frame whose u64 payload is the number of bytes stored so
+ * far, and the sender never has more than S25_WINDOW chunks unacknowledged,
+ * so memory and per-chunk latency do not depend on the object size. A
+ * sender that gets an error ack stops early with an empty S25_F_ERROR chunk.
+ * On uploads the flag is set by the client; on downloads it tells the server
+ * the client accepts chunked data, and the DATA reply for a chunked item
+ * carries S25_F_CHUNKED as well.
+ *
+ * Ranged reads (v2 only): a downlf or get with S25_F_RANGE carries a u64
+ * offset and a u64 length (0 = to the end) after every path. The DATA reply
+ * is flagged S25_F_RANGE and its payload starts with the u64 size of the
+ * whole file, followed by the bytes of the range (clamped to the file).
+ *
+ * Checksums (v2 only): a request flagged S25_F_CRC says its sender checks
+ * CRC32Cs (s25crc.h). On an upload every file's contents, chunked or not,
+ * are followed by the 4-byte CRC32C of the file, big-endian; the receiver
+ * checks it and refuses the file if it does not match. On a download it
+ * asks for the same: a DATA reply flagged S25_F_CRC is followed by the CRC
+ * of the whole file, which only replies covering all of the file carry.
+ * Once announced the CRC is always sent, even after an aborted chunked
+ * transfer, so the stream stays in sync.
+ *
+ * Redirects (v2 only): a downlf or uploadf flagged S25_F_REDIRECT says the
+ * client can move a file's bytes to or from a storage server itself. S1
+ * may then answer a downlf item with a DATA reply flagged S25_F_REDIRECT
+ * whose payload is a placement: host, u32 port, the path on that server,
+ * the u64 file size and a token (s25token.h), u64 expiry and u64 MAC. The
+ * client fetches the file there with OP_TGET (path, token, then the usual
+ * range fields). On such an uploadf the client sends each file's name and
+ * size and waits: a placement sends it to OP_TPUT (path, size, token, then
+ * contents as for OP_UPLOAD) and the storage server's STATUS is the file's
+ * answer; a STATUS flagged S25_F_MORE asks for the contents on the S1
+ * connection as usual; any other STATUS refuses the file. The uploadf's
+ * len then counts only the names and sizes.
+ *
+ * Signed requests (v2 only): with a key loaded (s25token.h) S1 flags its
+ * requests to the storage servers S25_F_SIGNED and ends their fields,
+ * before any file contents, with a u64 expiry, a random u64 nonce and a
+ * u64 MAC under the key of the opcode, the flags, the request id, the
+ * expiry, the nonce and the fields before it. A storage server with a key
+ * runs no other request but tokened OP_TPUT and OP_TGET, and none whose
+ * signature it has accepted before; one without a key reads and ignores
+ * the signature. File contents and replies are not signed.
+ *
+ * Statistics (v2 only): OP_STATS carries a u32 format, S25_STATS_TEXT or
+ * S25_STATS_JSON, and is answered by one DATA reply holding the server's
+ * figures (s25metrics.h) in that format. S1 asks every storage server for
+ * theirs and adds them to its own.
+ */
+#ifndef S25PROTO_H
+#define S25PROTO_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include "s25crc.h"
+#include "s25token.h"
+#include "s25metrics.h"
+
+#ifndef BUF
+#define BUF 4096
+#endif
+
+#define S25_MAGIC 0xA525
+#define S25_MAGIC_HI 0xA5       // first byte on the wire
+#define S25_VERSION 2
+#define S25_HDR_LEN 24
+#define S25_FIELDS_MAX (4*BUF + 64)     // room for a full v1 request head
+#define S25_CHUNK (4 << 20)     // bytes per chunk in large-object mode
+#define S25_WINDOW 4            // unacknowledged chunks a sender may have out
+#define S25_CRC_LEN 4           // bytes of the CRC32C after an object
+#define S25_IO_BUF 65536        // bytes per recv() when copying an object
+
+/* Opcodes */
+enum s25_op {
+    // client -> S1
+    OP_UPLOADF = 1,
+    OP_DOWNLF = 2,
+    OP_REMOVEF = 3,
+    OP_DOWNLTAR = 4,
+    OP_DISPFNAMES = 5,
+    OP_LISTF = 6,           // one page of a listing (v2 only)
+    OP_STATS = 7,           // counters and latencies (v2 only; also to storage servers)
+    // S1 -> storage servers
+    OP_UPLOAD = 16,
+    OP_GET = 17,
+    OP_REMOVE = 18,
+    OP_LIST = 19,
+    OP_TAR = 20,
+    OP_PING = 21,
+    OP_PAGE = 22,           // one page of a storage server's listing (v2 only)
+    // client -> storage servers, with a token from S1 (v2 only)
+    OP_TPUT = 23,
+    OP_TGET = 24,
+    // replies
+    OP_DATA = 64,
+    OP_STATUS = 65,
+};
+
+/* Header flags */
+#define S25_F_MORE 0x1      // another DATA frame for the same item follows
+#define S25_F_ERROR 0x2     // the item failed (not found, storage error...)
+#define S25_F_CHUNKED 0x4   // file contents travel as acknowledged chunks
+#define S25_F_RANGE 0x8     // paths carry an offset/length; replies the file size
+#define S25_F_PARTIAL 0x10  // a listing page: more entries follow its last one
+#define S25_F_CRC 0x20      // objects are followed by their CRC32C
+#define S25_F_REDIRECT 0x40 // the client can be sent to a storage server
+#define S25_F_SIGNED 0x80   // the fields end with S1's signature
+
+/* Listing pages: dir, prefix, cursor (strings), limit, options (u32s) */
+#define S25_PAGE_MAX 10000      // entries per page at most
+#define S25_LIST_RECURSIVE 0x1  // list everything below the directory
+
+/* Statistics formats */
+#define S25_STATS_TEXT 0
+#define S25_STATS_JSON 1
+
+struct s25_hdr {
+    uint8_t version;
+    uint8_t opcode;
+    uint32_t flags;
+    uint32_t reqid;
+    uint64_t len;
+};
+
+/* One end of a conversation: the socket, the protocol version spoken on it
+ * and, on the serving side, the id and flags of the request being answered.
+ * On the requesting side reqid is the id echoed by the last v2 reply. */
+struct s25_peer {
+    int fd;
+    int ver;
+    uint32_t reqid;
+    uint32_t flags;
+};
+
+/* Where a client is sent for a file's bytes */
+struct s25_redirect {
+    char host[BUF];
+    uint32_t port;
+    char path[BUF];         // on that storage server
+    uint64_t size;
+    struct s25_token token;
+};
+
+/* Outgoing request head (header plus small fields), sent with one write */
+struct s25_buf {
+    int ver;
+    size_t len;
+    char data[S25_FIELDS_MAX];
+};
+
+/* v1 command names; OP_TAR travels as a "get" of the path "TAR" */
+static const struct { int op; const char *name; } s25_v1_names[] = {
+    { OP_UPLOADF, "uploadf" }, { OP_DOWNLF, "downlf" },
+    { OP_REMOVEF, "removef" }, { OP_DOWNLTAR, "downltar" },
+    { OP_DISPFNAMES, "dispfnames" },
+    { OP_UPLOAD, "upload" }, { OP_GET, "get" }, { OP_REMOVE, "remove" },
+    { OP_LIST, "list" }, { OP_PING, "ping" },
+};
+
+static inline const char *s25_v1_name(int op){
+    for(size_t i = 0; i < sizeof(s25_v1_names)/sizeof(s25_v1_names[0]); i++)
+        if(s25_v1_names[i].op == op) return s25_v1_names[i].name;
+    return "";
+}
+
+/* Map a v1 command name to its opcode, 0 if unknown */
+static inline int s25_v1_opcode(const char *cmd){
+    for(size_t i = 0; i < sizeof(s25_v1_names)/sizeof(s25_v1_names[0]); i++)
+        if(strcmp(cmd, s25_v1_names[i].name) == 0) return s25_v1_names[i].op;
+    return 0;
+}
+
+/* Reliable recv for fixed-size data */
+static inline ssize_t recv_all(int sock, void *buf, size_t len){
+    size_t recvd = 0;
+    while(recvd < len){
+        ssize_t r = recv(sock, (char*)buf + recvd, len - recvd, 0);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) {
+            metrics_io(recvd, 0);
+            return r;
+        }
+        recvd += r;
+    }
+    metrics_io(recvd, 0);
+    return recvd;
+}
+
+/* Send all of buf, retrying short writes */
+static inline int send_all(int sock, const void *buf, size_t len){
+    size_t sent = 0;
+    while(sent < len){
+        ssize_t w = send(sock, (const char*)buf + sent, len - sent, 0);
+        if(w < 0 && errno == EINTR) continue;
+        if(w <= 0) {
+            metrics_io(0, sent);
+            return 0;
+        }
+        sent += w;
+    }
+    metrics_io(0, sent);
+    return 1;
+}
+
+/* Read and discard len bytes */
+static inline int s25_drain(int sock, uint64_t len){
+    char tmp[BUF];
+    while(len > 0){
+        ssize_t r = recv(sock, tmp, len > BUF ? BUF : len, 0);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) return 0;
+        metrics_io(r, 0);
+        len -= r;
+    }
+    return 1;
+}
+
+static inline void s25_be64(char *p, uint64_t v){
+    for(int i = 7; i >= 0; i--){ p[i] = (char)(v & 0xff); v >>= 8; }
+}
+
+static inline uint64_t s25_get_be64(const char *p){
+    uint64_t v = 0;
+    for(int i = 0; i < 8; i++) v = (v << 8) | (unsigned char)p[i];
+    return v;
+}
+
+static inline void s25_pack_hdr(char *p, int op, uint32_t flags, uint32_t reqid, uint64_t len){
+    uint16_t magic = htons(S25_MAGIC);
+    uint32_t f = htonl(flags), id = htonl(reqid), zero = 0;
+    memcpy(p, &magic, 2);
+    p[2] = S25_VERSION;
+    p[3] = (char)op;
+    memcpy(p + 4, &f, 4);
+    memcpy(p + 8, &id, 4);
+    memcpy(p + 12, &zero, 4);
+    s25_be64(p + 16, len);
+}
+
+/* Decode the v2 header at p; 0 on a bad magic/version */
+static inline int s25_parse_hdr(const char *p, struct s25_hdr *h){
+    uint16_t magic;
+    uint32_t f, id;
+    memcpy(&magic, p, 2);
+    memcpy(&f, p + 4, 4);
+    memcpy(&id, p + 8, 4);
+    if(ntohs(magic) != S25_MAGIC || (unsigned char)p[2] != S25_VERSION) return 0;
+    h->version = p[2];
+    h->opcode = p[3];
+    h->flags = ntohl(f);
+    h->reqid = ntohl(id);
+    h->len = s25_get_be64(p + 16);
+    return 1;
+}
+
+/* Read a v2 header; 0 on EOF or a bad magic/version */
+static inline int s25_recv_hdr(int sock, struct s25_hdr *h){
+    char p[S25_HDR_LEN];
+    return recv_all(sock, p, S25_HDR_LEN) == S25_HDR_LEN && s25_parse_hdr(p, h);
+}
+
+static inline int s25_send_hdr(int sock, int op, uint32_t flags, uint32_t reqid, uint64_t len){
+    char p[S25_HDR_LEN];
+    s25_pack_hdr(p, op, flags, reqid, len);
+    return send_all(sock, p, S25_HDR_LEN);
+}
+
+/* Send the CRC32C that follows an object */
+static inline int s25_send_crc(int sock, uint32_t crc){
+    crc = htonl(crc);
+    return send_all(sock, &crc, S25_CRC_LEN);
+}
+
+static inline int s25_recv_crc(int sock, uint32_t *crc){
+    uint32_t n;
+    if(recv_all(sock, &n, S25_CRC_LEN) != S25_CRC_LEN) return 0;
+    *crc = ntohl(n);
+    return 1;
+}
+
+/* ---------- building requests ---------- */
+
+static inline void s25_put_u32(struct s25_buf *b, uint32_t v){
+    if(b->ver == 1){
+        int i = (int)v;
+        memcpy(b->data + b->len, &i, sizeof(int));
+        b->len += sizeof(int);
+    } else {
+        v = htonl(v);
+        memcpy(b->data + b->len, &v, 4);
+        b->len += 4;
+    }
+}
+
+/* Sizes are 64-bit in v2; v1 can only carry an int */
+static inline void s25_put_u64(struct s25_buf *b, uint64_t v){
+    if(b->ver == 1){
+        s25_put_u32(b, v > INT_MAX ? 0 : (uint32_t)v);
+    } else {
+        s25_be64(b->data + b->len, v);
+        b->len += 8;
+    }
+}
+
+static inline void s25_put_str(struct s25_buf *b, const char *s){
+    size_t n = strnlen(s, BUF - 1);
+    if(b->ver == 1){
+        memset(b->data + b->len, 0, BUF);
+        memcpy(b->data + b->len, s, n);
+        b->len += BUF;
+    } else {
+        uint16_t l = htons((uint16_t)n);
+        memcpy(b->data + b->len, &l, 2);
+        memcpy(b->data + b->len + 2, s, n);
+        b->len += 2 + n;
+    }
+}
+
+/* Wire size of a string field in version ver */
+static inline size_t s25_str_len(int ver, const char *s){
+    return ver == 1 ? BUF : 2 + strnlen(s, BUF - 1);
+}
+
+/* Start a request: v2 reserves the header, v1 writes the command name */
+static inline void s25_start(struct s25_buf *b, int ver, int op, uint32_t reqid){
+    b->ver = ver;
+    b->len = 0;
+    if(ver == 2){
+        s25_pack_hdr(b->data, op, 0, reqid, 0);
+        b->len = S25_HDR_LEN;
+    } else if(op < OP_UPLOAD){
+        // client commands are NUL-terminated names
+        const char *name = s25_v1_name(op);
+        memcpy(b->data, name, strlen(name) + 1);
+        b->len = strlen(name) + 1;
+    } else {
+        s25_put_str(b, op == OP_TAR ? "get" : s25_v1_name(op));
+        if(op == OP_TAR) s25_put_str(b, "TAR");
+    }
+}
+
+/* Start a bare run of fields with no header (e.g. per-file upload fields) */
+static inline void s25_fields(struct s25_buf *b, int ver){
+    b->ver = ver;
+    b->len = 0;
+}
+
+/* Set header flags on a v2 request (v1 has nowhere to put them) */
+static inline void s25_set_flags(struct s25_buf *b, uint32_t flags){
+    if(b->ver != 2) return;
+    flags = htonl(flags);
+    memcpy(b->data + 4, &flags, 4);
+}
+
+/* Seal a request: extra is the payload that will follow after b */
+static inline void s25_finish(struct s25_buf *b, uint64_t extra){
+    if(b->ver == 2) s25_be64(b->data + 16, b->len - S25_HDR_LEN + extra);
+}
+
+static inline int s25_send_buf(int sock, const struct s25_buf *b){
+    return send_all(sock, b->data, b->len);
+}
+
+/* ---------- reading fields ---------- */
+
+static inline int s25_recv_u32(struct s25_peer *p, uint32_t *v){
+    if(p->ver == 1){
+        int i;
+        if(recv_all(p->fd, &i, sizeof(int)) != sizeof(int)) return 0;
+        *v = i < 0 ? 0 : (uint32_t)i;
+        return 1;
+    }
+    uint32_t n;
+    if(recv_all(p->fd, &n, 4) != 4) return 0;
+    *v = ntohl(n);
+    return 1;
+}
+
+static inline int s25_recv_u64(struct s25_peer *p, uint64_t *v){
+    if(p->ver == 1){
+        uint32_t n;
+        if(!s25_recv_u32(p, &n)) return 0;
+        *v = n;
+        return 1;
+    }
+    char b[8];
+    if(recv_all(p->fd, b, 8) != 8) return 0;
+    *v = s25_get_be64(b);
+    return 1;
+}
+
+/* Read a string field into out (always NUL-terminated, truncated to cap) */
+static inline int s25_recv_str(struct s25_peer *p, char *out, size_t cap){
+    if(p->ver == 1){
+        char frame[BUF];
+        if(recv_all(p->fd, frame, BUF) != BUF) return 0;
+        frame[BUF-1] = 0;
+        strncpy(out, frame, cap - 1);
+        out[cap-1] = 0;
+        return 1;
+    }
+    uint16_t l;
+    if(recv_all(p->fd, &l, 2) != 2) return 0;
+    size_t n = ntohs(l), keep = n < cap ? n : cap - 1;
+    if(recv_all(p->fd, out, keep) != (ssize_t)keep) return 0;
+    out[keep] = 0;
+    return keep == n || s25_drain(p->fd, n - keep);
+}
+
+/* ---------- request heads ----------
+ * A server only hands a request to a worker once its head (s25engine.h)
+ * has arrived. These measure a head in the bytes queued so far, without
+ * consuming them.
+ */
+
+/* Where a run of fields starting at off ends in the n bytes at p: 'u' a
+ * u32, 'l' a u64, 's' a string. While some have not arrived, this is only
+ * as far as their lengths are known, but always past n. */
+static inline size_t s25_fields_end(const char *p, size_t n, int ver, size_t off, const char *fields){
+    for(; *fields; fields++){
+        if(*fields == 'u' || (*fields == 'l' && ver == 1)) {
+            off += ver == 1 ? sizeof(int) : 4;
+        } else if(*fields == 'l') {
+            off += 8;
+        } else if(ver == 1) {
+            off += BUF;
+        } else {
+            uint16_t l;
+            if(off + 2 > n) return off + 2;
+            memcpy(&l, p + off, 2);
+            off += 2 + ntohs(l);
+        }
+    }
+    return off;
+}
+
+/* The u32 field at off, which must have arrived */
+static inline uint32_t s25_peek_u32(const char *p, int ver, size_t off){
+    if(ver == 1){
+        int i;
+        memcpy(&i, p + off, sizeof(int));
+        return i < 0 ? 0 : (uint32_t)i;
+    }
+    uint32_t n;
+    memcpy(&n, p + off, 4);
+    return ntohl(n);
+}
+
+/* ---------- replies ---------- */
+
+/* v1 sizes are ints, so larger objects cannot be announced to a v1 peer */
+static inline int s25_can_carry(const struct s25_peer *p, uint64_t len){
+    return p->ver == 2 || len <= INT_MAX;
+}
+
+/* Announce len bytes of data for the current item. v1 only has an int
+ * size, where 0 doubles as "not found". */
+static inline int s25_reply_data(struct s25_peer *p, uint64_t len, uint32_t flags){
+    if(p->ver == 1){
+        int sz = (flags & S25_F_ERROR) || len > INT_MAX ? 0 : (int)len;
+        return send_all(p->fd, &sz, sizeof(int));
+    }
+    return s25_send_hdr(p->fd, OP_DATA, flags, p->reqid, len);
+}
+
+/* Report success or failure of the current item (v1 has no status) */
+static inline int s25_reply_status(struct s25_peer *p, int ok){
+    if(p->ver == 1) return 1;
+    return s25_send_hdr(p->fd, OP_STATUS, ok ? 0 : S25_F_ERROR, p->reqid, 0);
+}
+
+/* Read a data announcement; *len is 0 and S25_F_ERROR set on failure */
+static inline int s25_recv_data(struct s25_peer *p, uint64_t *len, uint32_t *flags){
+    if(p->ver == 1){
+        int sz;
+        if(recv_all(p->fd, &sz, sizeof(int)) != sizeof(int)) return 0;
+        *len = sz > 0 ? (uint64_t)sz : 0;
+        *flags = sz > 0 ? 0 : S25_F_ERROR;
+        return 1;
+    }
+    struct s25_hdr h;
+    if(!s25_recv_hdr(p->fd, &h)) return 0;
+    p->reqid = h.reqid;
+    if(h.opcode != OP_DATA){
+        // a STATUS in place of data means the item failed
+        if(!s25_drain(p->fd, h.len)) return 0;
+        *len = 0;
+        *flags = h.flags | S25_F_ERROR;
+        return 1;
+    }
+    *len = h.len;
+    *flags = h.flags;
+    return 1;
+}
+
+/* Clamp a requested range to a file of size bytes; len 0 means "to the end" */
+static inline void s25_clamp_range(uint64_t size, uint64_t *off, uint64_t *len){
+    if(*off > size) *off = size;
+    if(*len == 0 || *len > size - *off) *len = size - *off;
+}
+
+/* Announce the len bytes of a download item. For a ranged request the
+ * reply also tells the size of the whole file. */
+static inline int s25_reply_object(struct s25_peer *p, uint64_t size, uint64_t len, uint32_t flags){
+    if(!(p->flags & S25_F_RANGE)) return s25_reply_data(p, len, flags);
+    char b[S25_HDR_LEN + 8];
+    s25_pack_hdr(b, OP_DATA, flags | S25_F_RANGE, p->reqid, 8 + len);
+    s25_be64(b + S25_HDR_LEN, size);
+    return send_all(p->fd, b, sizeof(b));
+}
+
+/* Read a download item announcement: *len is the number of bytes that
+ * follow and *size the size of the whole file (the same unless ranged) */
+static inline int s25_recv_object(struct s25_peer *p, uint64_t *len, uint32_t *flags, uint64_t *size){
+    if(!s25_recv_data(p, len, flags)) return 0;
+    *size = *len;
+    if((*flags & (S25_F_RANGE | S25_F_ERROR)) != S25_F_RANGE) return 1;
+    char b[8];
+    if(*len < 8 || recv_all(p->fd, b, 8) != 8) return 0;
+    *size = s25_get_be64(b);
+    *len -= 8;
+    return 1;
+}
+
+/* Read a status reply; returns 1 ok, 0 failed, -1 connection lost.
+ * v1 peers send no status, so the item is assumed to have worked. */
+static inline int s25_recv_status(struct s25_peer *p){
+    if(p->ver == 1) return 1;
+    struct s25_hdr h;
+    if(!s25_recv_hdr(p->fd, &h) || !s25_drain(p->fd, h.len)) return -1;
+    p->reqid = h.reqid;
+    return !(h.flags & S25_F_ERROR);
+}
+
+/* ---------- redirects ---------- */
+
+static inline void s25_put_token(struct s25_buf *b, const struct s25_token *t){
+    s25_put_u64(b, t->expiry);
+    s25_put_u64(b, t->mac);
+}
+
+static inline int s25_recv_token(struct s25_peer *p, struct s25_token *t){
+    return s25_recv_u64(p, &t->expiry) && s25_recv_u64(p, &t->mac);
+}
+
+/* Answer the current item with a placement instead of the file */
+static inline int s25_reply_redirect(struct s25_peer *p, const struct s25_redirect *r){
+    struct s25_buf b;
+    s25_start(&b, 2, OP_DATA, p->reqid);
+    s25_put_str(&b, r->host);
+    s25_put_u32(&b, r->port);
+    s25_put_str(&b, r->path);
+    s25_put_u64(&b, r->size);
+    s25_put_token(&b, &r->token);
+    s25_set_flags(&b, S25_F_REDIRECT);
+    s25_finish(&b, 0);
+    return s25_send_buf(p->fd, &b);
+}
+
+/* Read the placement announced by a DATA reply flagged S25_F_REDIRECT */
+static inline int s25_recv_redirect(struct s25_peer *p, struct s25_redirect *r){
+    return s25_recv_str(p, r->host, sizeof(r->host)) && s25_recv_u32(p, &r->port) &&
+           s25_recv_str(p, r->path, sizeof(r->path)) && s25_recv_u64(p, &r->size) &&
+           s25_recv_token(p, &r->token);
+}
+
+/* ---------- signed requests ---------- */
+
+/* The MAC signing a request: its opcode, flags, id, expiry and nonce, then
+ * the len bytes of its fields */
+static inline uint64_t s25_request_mac(int op, uint32_t flags, uint32_t reqid, uint64_t expiry,
+                                       uint64_t nonce, const char *fields, size_t len){
+    uint8_t m[25 + S25_FIELDS_MAX];
+    if(len > S25_FIELDS_MAX) len = S25_FIELDS_MAX;
+    m[0] = (uint8_t)op;
+    for(int i = 0; i < 4; i++){
+        m[1 + i] = flags >> (24 - 8 * i);
+        m[5 + i] = reqid >> (24 - 8 * i);
+    }
+    for(int i = 0; i < 8; i++){
+        m[9 + i] = expiry >> (56 - 8 * i);
+        m[17 + i] = nonce >> (56 - 8 * i);
+    }
+    memcpy(m + 25, fields, len);
+    return siphash24(token_key, m, 25 + len);
+}
+
+/* Sign a request once its flags and fields are in; nothing without a key,
+ * or in v1, which has no flags to say so. The random nonce makes every
+ * signature S1 sends a different one, even for the same request sent
+ * twice in a second, from S1 or from a fork-mode child of it. */
+static inline void s25_sign(struct s25_buf *b){
+    static uint32_t fallback;
+    if(b->ver != 2 || !token_ready) return;
+    uint32_t flags, reqid;
+    memcpy(&flags, b->data + 4, 4);
+    memcpy(&reqid, b->data + 8, 4);
+    flags = ntohl(flags) | S25_F_SIGNED;
+    reqid = ntohl(reqid);
+    s25_set_flags(b, flags);
+    uint64_t expiry = (uint64_t)time(NULL) + TOKEN_TTL, nonce;
+    if(getrandom(&nonce, sizeof(nonce), 0) != sizeof(nonce)) {
+        nonce = (uint64_t)getpid() << 32 | __atomic_add_fetch(&fallback, 1, __ATOMIC_RELAXED);
+    }
+    uint64_t mac = s25_request_mac((uint8_t)b->data[3], flags, reqid, expiry, nonce,
+                                   b->data + S25_HDR_LEN, b->len - S25_HDR_LEN);
+    s25_put_u64(b, expiry);
+    s25_put_u64(b, nonce);
+    s25_put_u64(b, mac);
+}
+
+/* Read the signature of request op, if it has one, and check it against
+ * the request's fields re-encoded in f. Returns 1 for a live signature
+ * under the key that was not presented before, 0 for none or any other,
+ * -1 if the connection failed. */
+static inline int s25_recv_sig(struct s25_peer *p, int op, const struct s25_buf *f){
+    uint64_t expiry, nonce, mac;
+    if(p->ver != 2 || !(p->flags & S25_F_SIGNED)) return 0;
+    if(!s25_recv_u64(p, &expiry) || !s25_recv_u64(p, &nonce) || !s25_recv_u64(p, &mac)) {
+        return -1;
+    }
+    return token_ready && expiry >= (uint64_t)time(NULL) &&
+           token_equal(s25_request_mac(op, p->flags, p->reqid, expiry, nonce, f->data, f->len), mac) &&
+           token_first_use(mac, expiry);
+}
+
+/* ---------- large-object mode ---------- */
+
+/* Moves len bytes of an object at offset off onto / off the socket. A
+ * payload function returns 1 when all bytes were sent. A sink must consume
+ * all len bytes and returns 1 when they were stored, 0 when they were
+ * consumed but not stored, -1 when the connection failed. */
+typedef int (*s25_payload_fn)(void *ctx, int sock, uint64_t off, uint64_t len);
+typedef int (*s25_sink_fn)(void *ctx, int sock, uint64_t off, uint64_t len);
+
+/* Bytes on the wire for a chunked object of len bytes (an empty object
+ * has no chunks at all) */
+static inline uint64_t s25_chunked_len(uint64_t len){
+    return len + (len + S25_CHUNK - 1) / S25_CHUNK * S25_HDR_LEN;
+}
+
+/* Acknowledge a chunk: done is the number of bytes stored so far */
+static inline int s25_send_ack(struct s25_peer *p, uint64_t done, int ok){
+    char b[S25_HDR_LEN + 8];
+    s25_pack_hdr(b, OP_STATUS, ok ? 0 : S25_F_ERROR, p->reqid, 8);
+    s25_be64(b + S25_HDR_LEN, done);
+    return send_all(p->fd, b, sizeof(b));
+}
+
+/* Read a chunk ack; 1 ok, 0 refused, -1 connection lost */
+static inline int s25_recv_ack(struct s25_peer *p){
+    struct s25_hdr h;
+    if(!s25_recv_hdr(p->fd, &h) || h.opcode != OP_STATUS) return -1;
+    if(!s25_drain(p->fd, h.len)) return -1;
+    return !(h.flags & S25_F_ERROR);
+}
+
+/* Send a len-byte object as chunks produced by fn, keeping at most
+ * S25_WINDOW of them unacknowledged. Returns 1 when every chunk was
+ * acknowledged, 0 when the receiver refused the object (the stream is still
+ * in sync), -1 when the connection failed. */
+static inline int s25_send_chunked(struct s25_peer *p, uint64_t len, s25_payload_fn fn, void *ctx){
+    uint64_t off = 0;
+    int inflight = 0, ok = 1, more = len > 0;
+    while(more){
+        uint64_t n = len - off > S25_CHUNK ? S25_CHUNK : len - off;
+        if(!ok) n = 0;          // refused: finish with an empty error chunk
+        more = ok && off + n < len;
+        uint32_t flags = (more ? S25_F_MORE : 0) | (ok ? 0 : S25_F_ERROR);
+        if(!s25_send_hdr(p->fd, OP_DATA, flags, p->reqid, n)) return -1;
+        if(n > 0 && !fn(ctx, p->fd, off, n)) return -1;
+        off += n;
+        inflight++;
+
+        // Wait for acks once the window is full, and for all of them at the end
+        while(inflight > 0 && (inflight >= S25_WINDOW || !more)){
+            int st = s25_recv_ack(p);
+            if(st < 0) return -1;
+            inflight--;
+            if(st == 0 && ok){
+                ok = 0;
+                if(more) break;
+            }
+        }
+    }
+    return ok;
+}
+
+/* Receive a chunked object of len bytes into sink, acknowledging every
+ * chunk. Returns 1 when all of it was stored, 0 when it was refused or
+ * aborted (the stream is still in sync), -1 when the connection failed. */
+static inline int s25_recv_chunked(struct s25_peer *p, uint64_t len, s25_sink_fn sink, void *ctx){
+    uint64_t off = 0;
+    int ok = 1;
+    while(off < len){
+        struct s25_hdr h;
+        if(!s25_recv_hdr(p->fd, &h) || h.opcode != OP_DATA) return -1;
+        if(h.len > S25_CHUNK || h.len > len - off) return -1;
+        if(h.flags & S25_F_ERROR) ok = 0;           // sender gave up
+        if(h.len > 0){
+            int r = ok ? sink(ctx, p->fd, off, h.len) : (s25_drain(p->fd, h.len) ? 0 : -1);
+            if(r < 0) return -1;
+            if(r == 0) ok = 0;
+        }
+        off += h.len;
+        if(!s25_send_ack(p, off, ok)) return -1;
+        if(!(h.flags & S25_F_MORE)) break;
+    }
+    return ok && off == len;
+}
+
+/* An open file and where in it an object starts; crc is the CRC32C of
+ * what a sink has received so far */
+struct s25_file {
+    int fd;
+    uint64_t base;
+    uint32_t crc;
+};
+
+/* Sink that writes chunks into the struct s25_file pointed to by ctx, or
+ * just drains them if its fd is -1. Chunks must come in order. */
+static inline int s25_file_sink(void *ctx, int sock, uint64_t off, uint64_t len){
+    struct s25_file *file = ctx;
+    int f = file->fd, ok = f >= 0;
+    off += file->base;
+    char buf[S25_IO_BUF];
+    while(len > 0){
+        ssize_t n = recv(sock, buf, len > S25_IO_BUF ? S25_IO_BUF : len, 0);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        metrics_io(n, 0);
+        file->crc = crc32c(file->crc, buf, n);
+        if(ok && pwrite(f, buf, n, off) != n) ok = 0;
+        off += n;
+        len -= n;
+    }
+    return ok;
+}
+
+/* Receive the len bytes of an uploaded file into file, in large-object mode
+ * if the request asked for it, and check them against the CRC that follows
+ * them if it carries one. Returns 1 when they were stored intact, 0 when
+ * they were consumed but not stored (or arrived damaged), -1 when the
+ * connection failed. */
+static inline int s25_recv_file(struct s25_peer *p, uint64_t len, struct s25_file *file){
+    int st = (p->flags & S25_F_CHUNKED) ? s25_recv_chunked(p, len, s25_file_sink, file)
+                                        : s25_file_sink(file, p->fd, 0, len);
+    uint32_t crc;
+    if(st < 0 || !(p->flags & S25_F_CRC)) return st;
+    if(!s25_recv_crc(p->fd, &crc)) return -1;
+    return st && crc == file->crc;
+}
+
+#endif
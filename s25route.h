@@ -0,0 +1,325 @@
+//s25route.h
+/* ================= routing table =================
+ * Maps a file extension to where files of that type are stored: S1 itself
+ * or a storage server (host and port), and the storage root there that
+ * ~/S1 paths are mapped into. The table is read once at startup from a
+ * config file, one route per line:
+ *
+ *     # extension  host        port  root
+ *     .c           local
+ *     .pdf         127.0.0.1   2202  ~/S2
+ *     .pdf         10.0.0.7    2202  /srv/s25/pdf
+ *     .md          docs.lan    5505  /srv/s25/md
+ *
+ * The one "local" route is stored by S1 under ~/S1. A root starting with
+ * "~" is taken relative to S1's $HOME. Routes sharing a host and port
+ * share one backend (and one connection pool). Without a config file the
+ * built-in table below is used.
+ *
+ * Lookups hash the extension into a small open-addressed table, so the
+ * cost per file does not grow with the number of routes.
+ *
+ * A type may have several routes (nodes): its files are then sharded
+ * across them on a consistent-hash ring keyed on the path under ~/S1.
+ * Each node owns ROUTE_VNODES points of the ring, placed by hashing the
+ * node itself, so adding a node to N takes over about 1/(N+1) of the
+ * keys and leaves every other key where it was.
+ *
+ * A type can also keep each file on several of its nodes:
+ *
+ *     .txt         replicas    3     2
+ *
+ * stores every file on the first 3 distinct nodes clockwise from its key
+ * and reports an upload stored once 2 of them hold it (the write quorum;
+ * by default a majority). Such a line comes after the type's nodes.
+ * Or, for large objects, erasure coding:
+ *
+ *     .zip         erasure     4     2
+ *
+ * cuts every file into 4 data and 2 parity fragments (s25rs.h), one on
+ * each of the first 6 nodes from its key; any 4 of them rebuild it.
+ */
+#ifndef S25ROUTE_H
+#define S25ROUTE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#define ROUTES_MAX 64
+#define ROUTE_SLOTS 128         // power of two, > ROUTES_MAX
+#define ROUTE_EXT_MAX 16
+#define ROUTE_HOST_MAX 256
+#define ROUTE_VNODES 128        // ring points per node
+#define ROUTE_FRAGS_MAX 32      // k + m of an erasure-coded type
+
+/* A storage server */
+struct route_backend {
+    char host[ROUTE_HOST_MAX];
+    int port;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+};
+
+/* One node storing files of a type */
+struct route {
+    char ext[ROUTE_EXT_MAX];    // with the dot
+    int backend;                // index into route_backends; -1 = local
+    char root[PATH_MAX];        // storage root on the backend
+};
+
+struct route_point {
+    uint64_t hash;
+    int node;                   // index into routes
+};
+
+/* A file type and the ring of its nodes */
+struct route_type {
+    char ext[ROUTE_EXT_MAX];
+    int local;                  // stored by S1 itself (then its only node)
+    int nodes;
+    int replicas;               // nodes each file is stored on
+    int quorum;                 // of them that must take an upload
+    int data_frags;             // k of an erasure-coded type; 0 = whole copies
+    struct route_point *ring;   // nodes * ROUTE_VNODES points by hash
+};
+
+static struct route_backend route_backends[ROUTES_MAX];
+static int route_nbackends;
+static struct route routes[ROUTES_MAX];
+static int route_n;
+static struct route_type route_types[ROUTES_MAX];
+static int route_ntypes;
+static unsigned char route_slot[ROUTE_SLOTS];   // type index + 1; 0 = empty
+
+static const char *route_defaults[] = {
+    ".c local",
+    ".pdf 127.0.0.1 2202 ~/S2",
+    ".txt 127.0.0.1 3303 ~/S3",
+    ".zip 127.0.0.1 4404 ~/S4",
+};
+
+/* FNV-1a */
+static unsigned route_hash(const char *ext){
+    unsigned h = 2166136261u;
+    for(; *ext; ext++) h = (h ^ (unsigned char)*ext) * 16777619u;
+    return h & (ROUTE_SLOTS - 1);
+}
+
+/* 64-bit FNV-1a with a final mix, for ring positions */
+static uint64_t route_hash64(const char *s){
+    uint64_t h = 14695981039346656037ull;
+    for(; *s; s++) h = (h ^ (unsigned char)*s) * 1099511628211ull;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h;
+}
+
+/* The type for an extension (".pdf"), or NULL */
+static struct route_type *route_find(const char *ext){
+    for(unsigned i = route_hash(ext); route_slot[i]; i = (i + 1) & (ROUTE_SLOTS - 1)){
+        struct route_type *t = &route_types[route_slot[i] - 1];
+        if(strcmp(t->ext, ext) == 0) return t;
+    }
+    return NULL;
+}
+
+/* The type of a file name or path, by its extension, or NULL */
+static const struct route_type *route_type_of(const char *name){
+    const char *dot = strrchr(name, '.');
+    if(!dot || strchr(dot, '/')) return NULL;
+    return route_find(dot);
+}
+
+/* The distinct nodes of type t in ring order from key, the key's owner
+ * first: up to max of them go to out. Returns how many. */
+static int route_walk(const struct route_type *t, const char *key, const struct route **out, int max){
+    size_t npoints = (size_t)t->nodes * ROUTE_VNODES;
+    uint64_t h = route_hash64(key);
+    size_t lo = 0, hi = npoints;
+    while(lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+        if(t->ring[mid].hash < h) lo = mid + 1; else hi = mid;
+    }
+    int n = 0;
+    for(size_t k = 0; k < npoints && n < max && n < t->nodes; k++){
+        const struct route *r = &routes[t->ring[(lo + k) % npoints].node];
+        int seen = 0;
+        for(int j = 0; j < n; j++) seen |= out[j] == r;
+        if(!seen) out[n++] = r;
+    }
+    return n;
+}
+
+static const struct route_backend *route_backend_of(const struct route *r){
+    return r->backend < 0 ? NULL : &route_backends[r->backend];
+}
+
+/* The backend for host:port, resolving and adding it if it is new;
+ * -1 if the host cannot be resolved */
+static int route_add_backend(const char *host, int port){
+    for(int i = 0; i < route_nbackends; i++)
+        if(route_backends[i].port == port && strcmp(route_backends[i].host, host) == 0) return i;
+    if(route_nbackends == ROUTES_MAX) return -1;
+
+    struct addrinfo hints = { 0 }, *ai;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    int err = getaddrinfo(host, service, &hints, &ai);
+    if(err != 0){
+        fprintf(stderr, "route: %s: %s\n", host, gai_strerror(err));
+        return -1;
+    }
+    struct route_backend *b = &route_backends[route_nbackends];
+    snprintf(b->host, sizeof(b->host), "%s", host);
+    b->port = port;
+    memcpy(&b->addr, ai->ai_addr, ai->ai_addrlen);
+    b->addrlen = ai->ai_addrlen;
+    freeaddrinfo(ai);
+    return route_nbackends++;
+}
+
+/* Parse one route line; 1 if it was blank or a comment, 0 if it is bad */
+static int route_parse(const char *line){
+    char ext[ROUTE_EXT_MAX + 1], host[ROUTE_HOST_MAX], root[PATH_MAX];
+    int port = 0, end = 0;
+    int n = sscanf(line, " %16s %255s %d %4095s %n", ext, host, &port, root, &end);
+    if(n <= 0 || ext[0] == '#') return 1;
+    int erasure = n >= 2 && strcmp(host, "erasure") == 0;
+    if(n >= 2 && (erasure || strcmp(host, "replicas") == 0)){
+        // "ext replicas R [W]" or "ext erasure K M" for a type whose nodes
+        // are already known
+        struct route_type *t = route_find(ext);
+        int r = 0, w = 0;
+        end = 0;
+        n = sscanf(line, " %*s %*s %d %n%d %n", &r, &end, &w, &end);
+        if(n < 1 || (line[end] && line[end] != '#') || !t || t->local ||
+           t->replicas > 1) return 0;
+        if(erasure) {
+            // k data and w parity fragments; stored once k + 1 are
+            if(n != 2 || r < 1 || w < 1 || r + w > ROUTE_FRAGS_MAX) return 0;
+            t->data_frags = r;
+            t->replicas = r + w;
+            t->quorum = r + 1;
+            return 1;
+        }
+        if(n == 1) w = r / 2 + 1;
+        if(r < 1 || w < 1 || w > r) return 0;
+        t->replicas = r;
+        t->quorum = w;
+        return 1;
+    }
+    if(n == 2) sscanf(line, " %*s %*s %n", &end);
+    if(n == 3 || (end > 0 && line[end] && line[end] != '#')) return 0;    // stray fields
+    if(ext[0] != '.' || strlen(ext) >= ROUTE_EXT_MAX || strpbrk(ext + 1, "./") ||
+       route_n == ROUTES_MAX) return 0;
+
+    // Another node of a type already seen shards it; S1 itself cannot be
+    // one of several
+    struct route_type *t = route_find(ext);
+    int local = n == 2 && strcmp(host, "local") == 0;
+    if(t && (t->local || local)) return 0;
+
+    struct route *r = &routes[route_n];
+    snprintf(r->ext, sizeof(r->ext), "%s", ext);
+    if(local){
+        // S1 indexes and archives a single type of its own
+        for(int i = 0; i < route_n; i++) if(routes[i].backend < 0) return 0;
+        r->backend = -1;
+        snprintf(r->root, sizeof(r->root), "%s/S1", getenv("HOME"));
+    } else if(n == 4 && port > 0 && port < 65536) {
+        if((r->backend = route_add_backend(host, port)) < 0) return 0;
+        if(root[0] == '~') snprintf(r->root, sizeof(r->root), "%s%s", getenv("HOME"), root + 1);
+        else snprintf(r->root, sizeof(r->root), "%s", root);
+    } else {
+        return 0;
+    }
+    for(int i = 0; i < route_n; i++)
+        if(routes[i].backend == r->backend && strcmp(routes[i].root, r->root) == 0 &&
+           strcmp(routes[i].ext, r->ext) == 0) return 0;    // the same node twice
+
+    if(!t){
+        t = &route_types[route_ntypes];
+        snprintf(t->ext, sizeof(t->ext), "%s", ext);
+        t->local = local;
+        t->replicas = t->quorum = 1;
+        unsigned i = route_hash(t->ext);
+        while(route_slot[i]) i = (i + 1) & (ROUTE_SLOTS - 1);
+        route_slot[i] = ++route_ntypes;
+    }
+    t->nodes++;
+    route_n++;
+    return 1;
+}
+
+static int route_point_cmp(const void *a, const void *b){
+    const struct route_point *x = a, *y = b;
+    return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+/* Place every node of every type on its type's ring */
+static int route_build(void){
+    for(int k = 0; k < route_ntypes; k++){
+        struct route_type *t = &route_types[k];
+        if(t->replicas > t->nodes){
+            fprintf(stderr, "route: %s: needs %d nodes, has %d\n", t->ext, t->replicas, t->nodes);
+            return 0;
+        }
+        t->ring = malloc((size_t)t->nodes * ROUTE_VNODES * sizeof(*t->ring));
+        if(!t->ring) return 0;
+        size_t n = 0;
+        for(int i = 0; i < route_n; i++){
+            if(strcmp(routes[i].ext, t->ext) != 0) continue;
+            const struct route_backend *b = route_backend_of(&routes[i]);
+            for(int v = 0; v < ROUTE_VNODES; v++){
+                char id[ROUTE_HOST_MAX + PATH_MAX + 32];
+                snprintf(id, sizeof(id), "%s:%d%s#%d", b ? b->host : "local",
+                         b ? b->port : 0, routes[i].root, v);
+                t->ring[n].hash = route_hash64(id);
+                t->ring[n].node = i;
+                n++;
+            }
+        }
+        qsort(t->ring, n, sizeof(*t->ring), route_point_cmp);
+    }
+    return 1;
+}
+
+/* Load the routing table from file, or the built-in one if file is NULL
+ * or does not exist and need is 0. Returns 0 on a bad or missing config. */
+static int route_load(const char *file, int need){
+    FILE *f = file ? fopen(file, "r") : NULL;
+    if(!f){
+        if(file && need){
+            perror(file);
+            return 0;
+        }
+        for(size_t i = 0; i < sizeof(route_defaults)/sizeof(route_defaults[0]); i++)
+            if(!route_parse(route_defaults[i])) return 0;
+        return route_build();
+    }
+    char line[PATH_MAX + 512];
+    int lineno = 0, ok = 1;
+    while(ok && fgets(line, sizeof(line), f)){
+        lineno++;
+        if(!route_parse(line)){
+            fprintf(stderr, "%s:%d: bad route: %s", file, lineno, line);
+            ok = 0;
+        }
+    }
+    fclose(f);
+    if(ok && route_n == 0){
+        fprintf(stderr, "%s: no routes\n", file);
+        ok = 0;
+    }
+    return ok && route_build();
+}
+
+#endif
@@ -0,0 +1,256 @@
+//s25rs.h
+/* ================= Reed-Solomon erasure code =================
+ * A systematic (k+m) code over GF(2^8): an object is cut into stripes of
+ * k equal blocks, the k data fragments carry those blocks unchanged and
+ * the m parity fragments linear combinations of them. Parity row i has the
+ * Cauchy coefficients 1 / ((k + i) ^ j), so any k of the k+m fragments,
+ * data or parity, determine the data.
+ *
+ * All the work is in one primitive, dst ^= c * src over a block. It uses
+ * the split-nibble method: c * x = lo[x & 15] ^ hi[x >> 4], two 16-byte
+ * tables that fit one vector register and are looked up 16 (SSSE3 pshufb)
+ * or 32 (AVX2 vpshufb) bytes at a time. rs_init() picks the widest variant
+ * the CPU has; other machines use the same tables a byte at a time.
+ *
+ * Every fragment starts with an RS_HDR-byte header telling the object's
+ * size, the code, the fragment's index and the block size, so any node's
+ * fragment is enough to know how to read the others. A fragment flagged
+ * RS_F_CRC ends, after its last stripe, with the CRC32C of the whole
+ * object, so a full read can be checked without hashing it again.
+ */
+#ifndef S25RS_H
+#define S25RS_H
+
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RS_X86 1
+#endif
+
+#define RS_MAX 32               // k + m at most
+#define RS_BLOCK 65536          // bytes per fragment per stripe
+#define RS_ALIGN 64             // block sizes of small objects round up to this
+#define RS_HDR 64
+#define RS_MAGIC "s25rs 1"      // with its NUL, 8 bytes
+#define RS_F_CRC 0x1            // the fragment ends with the object's CRC32C
+#define RS_CRC_LEN 4
+
+/* A (k+m) code: row r of gen gives fragment r from the k data blocks */
+struct rs_code {
+    int k, m;
+    uint8_t gen[RS_MAX][RS_MAX];
+};
+
+/* What a fragment header says */
+struct rs_frag {
+    uint64_t size;              // of the whole object
+    uint32_t k, m, index, block;
+    uint32_t flags;
+};
+
+typedef void (*rs_mul_fn)(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n);
+
+static uint8_t rs_exp[512], rs_log[256];
+static uint8_t rs_nib[256][2][16];      // c * low nibble, c * high nibble
+
+static uint8_t gf_mul(uint8_t a, uint8_t b){
+    return a && b ? rs_exp[rs_log[a] + rs_log[b]] : 0;
+}
+
+static uint8_t gf_inv(uint8_t a){
+    return rs_exp[255 - rs_log[a]];
+}
+
+/* dst ^= c * src, a byte at a time */
+static void rs_mul_add_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n){
+    const uint8_t *lo = rs_nib[c][0], *hi = rs_nib[c][1];
+    for(size_t i = 0; i < n; i++) dst[i] ^= lo[src[i] & 15] ^ hi[src[i] >> 4];
+}
+
+#ifdef RS_X86
+__attribute__((target("ssse3")))
+static void rs_mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n){
+    const __m128i lo = _mm_loadu_si128((const __m128i *)rs_nib[c][0]);
+    const __m128i hi = _mm_loadu_si128((const __m128i *)rs_nib[c][1]);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for(; i + 16 <= n; i += 16){
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(x, mask)),
+                                  _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(x, 4), mask)));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, p));
+    }
+    rs_mul_add_scalar(dst + i, src + i, c, n - i);
+}
+
+__attribute__((target("avx2")))
+static void rs_mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n){
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)rs_nib[c][0]));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)rs_nib[c][1]));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for(; i + 32 <= n; i += 32){
+        __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(x, mask)),
+                                     _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(x, 4), mask)));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, p));
+    }
+    rs_mul_add_scalar(dst + i, src + i, c, n - i);
+}
+#endif
+
+static rs_mul_fn rs_mul_add = rs_mul_add_scalar;
+static const char *rs_impl = "scalar";
+
+/* Build the field tables (polynomial 0x11d) and pick the multiply routine */
+static void rs_init(void){
+    unsigned x = 1;
+    for(int i = 0; i < 255; i++){
+        rs_exp[i] = rs_exp[i + 255] = x;
+        rs_log[x] = i;
+        x <<= 1;
+        if(x & 0x100) x ^= 0x11d;
+    }
+    for(int c = 0; c < 256; c++)
+        for(int v = 0; v < 16; v++){
+            rs_nib[c][0][v] = gf_mul(c, v);
+            rs_nib[c][1][v] = gf_mul(c, v << 4);
+        }
+#ifdef RS_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        rs_mul_add = rs_mul_add_avx2;
+        rs_impl = "avx2";
+    } else if(__builtin_cpu_supports("ssse3")) {
+        rs_mul_add = rs_mul_add_ssse3;
+        rs_impl = "ssse3";
+    }
+#endif
+}
+
+/* Set up a (k+m) code; 0 if it is out of range */
+static int rs_setup(struct rs_code *c, int k, int m){
+    if(k < 1 || m < 0 || k + m > RS_MAX) return 0;
+    c->k = k;
+    c->m = m;
+    memset(c->gen, 0, sizeof(c->gen));
+    for(int j = 0; j < k; j++) c->gen[j][j] = 1;
+    for(int i = 0; i < m; i++)
+        for(int j = 0; j < k; j++) c->gen[k + i][j] = gf_inv((k + i) ^ j);
+    return 1;
+}
+
+/* Fill the m parity blocks frags[k..k+m-1] from the k data blocks before
+ * them, all len bytes */
+static void rs_encode(const struct rs_code *c, uint8_t *const *frags, size_t len){
+    for(int i = c->k; i < c->k + c->m; i++){
+        memset(frags[i], 0, len);
+        for(int j = 0; j < c->k; j++) rs_mul_add(frags[i], frags[j], c->gen[i][j], len);
+    }
+}
+
+/* The matrix that turns the k fragments have[0..k-1] (by index) back into
+ * the data blocks: the inverse of their generator rows. 0 if an index
+ * repeats. */
+static int rs_decoder(const struct rs_code *c, const int *have, uint8_t dec[RS_MAX][RS_MAX]){
+    int k = c->k;
+    uint8_t a[RS_MAX][RS_MAX];
+    for(int r = 0; r < k; r++)
+        for(int j = 0; j < k; j++){
+            a[r][j] = c->gen[have[r]][j];
+            dec[r][j] = r == j;
+        }
+    // Gauss-Jordan; in GF(2^8) subtraction is xor
+    for(int col = 0; col < k; col++){
+        int p = col;
+        while(p < k && a[p][col] == 0) p++;
+        if(p == k) return 0;
+        for(int j = 0; j < k; j++){
+            uint8_t t = a[col][j]; a[col][j] = a[p][j]; a[p][j] = t;
+            t = dec[col][j]; dec[col][j] = dec[p][j]; dec[p][j] = t;
+        }
+        uint8_t inv = gf_inv(a[col][col]);
+        for(int j = 0; j < k; j++){
+            a[col][j] = gf_mul(a[col][j], inv);
+            dec[col][j] = gf_mul(dec[col][j], inv);
+        }
+        for(int r = 0; r < k; r++){
+            uint8_t f = a[r][col];
+            if(r == col || f == 0) continue;
+            for(int j = 0; j < k; j++){
+                a[r][j] ^= gf_mul(f, a[col][j]);
+                dec[r][j] ^= gf_mul(f, dec[col][j]);
+            }
+        }
+    }
+    return 1;
+}
+
+/* Rebuild the data blocks missing from have: src[l] holds the block of
+ * fragment have[l], data[j] receives data block j. Blocks that arrived
+ * as data fragments are expected to be in place already. */
+static void rs_recover(const struct rs_code *c, const int *have, const uint8_t dec[RS_MAX][RS_MAX],
+                       uint8_t *const *src, uint8_t *const *data, size_t len){
+    for(int j = 0; j < c->k; j++){
+        int present = 0;
+        for(int l = 0; l < c->k; l++) present |= have[l] == j;
+        if(present) continue;
+        memset(data[j], 0, len);
+        for(int l = 0; l < c->k; l++) rs_mul_add(data[j], src[l], dec[j][l], len);
+    }
+}
+
+/* Block size for an object of size bytes: RS_BLOCK, or for an object that
+ * fits in one stripe just enough to hold it */
+static uint32_t rs_block_for(uint64_t size, int k){
+    if(size >= (uint64_t)k * RS_BLOCK) return RS_BLOCK;
+    uint64_t b = (size + k - 1) / k;
+    b = (b + RS_ALIGN - 1) / RS_ALIGN * RS_ALIGN;
+    return b ? b : RS_ALIGN;
+}
+
+/* Bytes in each fragment of an object, header (and CRC if flags has
+ * RS_F_CRC) included */
+static uint64_t rs_frag_len(uint64_t size, int k, uint32_t block, uint32_t flags){
+    uint64_t stripe = (uint64_t)k * block;
+    return RS_HDR + (size + stripe - 1) / stripe * block + (flags & RS_F_CRC ? RS_CRC_LEN : 0);
+}
+
+static void rs_put32(uint8_t *p, uint32_t v){
+    for(int i = 0; i < 4; i++) p[i] = v >> (24 - 8 * i);
+}
+
+static uint32_t rs_get32(const uint8_t *p){
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void rs_pack_hdr(uint8_t *h, const struct rs_frag *f){
+    memset(h, 0, RS_HDR);
+    memcpy(h, RS_MAGIC, 8);
+    rs_put32(h + 8, f->size >> 32);
+    rs_put32(h + 12, (uint32_t)f->size);
+    rs_put32(h + 16, f->k);
+    rs_put32(h + 20, f->m);
+    rs_put32(h + 24, f->index);
+    rs_put32(h + 28, f->block);
+    rs_put32(h + 32, f->flags);
+}
+
+/* Read a fragment header; 0 if it is not one */
+static int rs_parse_hdr(const uint8_t *h, struct rs_frag *f){
+    if(memcmp(h, RS_MAGIC, 8) != 0) return 0;
+    f->size = (uint64_t)rs_get32(h + 8) << 32 | rs_get32(h + 12);
+    f->k = rs_get32(h + 16);
+    f->m = rs_get32(h + 20);
+    f->index = rs_get32(h + 24);
+    f->block = rs_get32(h + 28);
+    f->flags = rs_get32(h + 32);
+    return f->k >= 1 && f->k + f->m <= RS_MAX && f->index < f->k + f->m &&
+           f->block > 0 && f->block <= RS_BLOCK;
+}
+
+#endif
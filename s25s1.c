@@ -1,4 +1,5 @@
 //s1.c
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,27 +12,178 @@
 #include <limits.h>
 #include <libgen.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
 
 #define PORT 7348
 #define BUF 4096
 
+#include "s25engine.h"
+#include "s25proto.h"
+#include "s25tar.h"
+#include "s25send.h"
+#include "s25index.h"
+#include "s25route.h"
+#include "s25rs.h"
+#include "s25commit.h"
+#define POOL_MAX_IDLE 16    // idle connections kept per backend
+#define POOL_PING_IDLE 5    // seconds idle before a reused connection is pinged
+#define RELAY_BUF 65536     // buffer for the non-splice relay path
+#define RELAY_PIPE_SZ (1 << 20) // pipe capacity requested for splice relays
+#define LIST_FRAME 65536    // dispfnames output per v2 data frame
+#define READ_EWMA_SHIFT 3   // a new read latency sample weighs 1/8
+#define BACKEND_DOWN_SECS 5 // a node that failed a read is tried last this long
+#define REPLICA_LAG_MS 200  // wait for replicas beyond the write quorum
+#define REDIRECT_MIN (8 << 20)  // files from this size may go direct (-R)
+
+/* Idle connections to one backend */
+struct backend_pool {
+    int idle[POOL_MAX_IDLE];
+    time_t since[POOL_MAX_IDLE];    // when each one was returned
+    int nidle;
+    uint64_t rtt_us;        // EWMA of time to first byte of reads; 0 = none yet
+    int reading;            // reads in flight
+    time_t down_until;
+    pthread_mutex_t lock;
+};
+
+// One per routing table backend, same index
+static struct backend_pool pools[ROUTES_MAX];
+
+// Erasure code of each erasure-coded type, same index as route_types
+static struct rs_code rs_codes[ROUTES_MAX];
+
+/* One path of a downlf request and the byte range wanted from it */
+struct dl_item {
+    char *name;
+    uint64_t off, len;      // len 0 = to the end of the file
+};
+
+// Protocol version spoken to the backends (-1 selects v1 for old servers)
+static int backend_ver = 2;
+static uint32_t backend_reqid;
+
+// Smallest file a client willing to be redirected is sent to the storage
+// server for; 0 keeps every transfer on S1
+static uint64_t redirect_min = REDIRECT_MIN;
+
+// Ready-made downltar archive of the local .c files (none in fork mode,
+// where each child would only build it for a single request)
+static struct tar_cache c_archive = TAR_CACHE_INIT;
+static struct tar_cache *c_cache = &c_archive;
+
 // Function prototypes
 void prcclient(int client_sock);
-void send_to_backend(const char *src_path, const char *dest_dir, int port);
-void get_from_backend(int port, const char *path, int client);
-void remove_on_backend(int port, const char *path);
-void list_from_backend(int port, const char *dir, char *result);
+int serve_command(int client);
+size_t request_head(const char *p, size_t n);
+int serve_one(int client, int flags);
+int handle_command(struct s25_peer *cl, int op);
+struct dl_item *recv_items(struct s25_peer *cl, uint32_t count);
+void free_items(struct dl_item *items, uint32_t count);
+int send_to_backend(struct s25_peer *cl, const char *fname, uint64_t size, const char *dir,
+                    const struct route_type *t, const char *key, int *stored);
+long relay(int from, int to, long len, int *delivered);
+int get_from_backend(const struct route_type *t, const char *path, struct s25_peer *cl, uint64_t off, uint64_t len);
+int get_tar_shards(const struct route_type *t, struct s25_peer *cl);
+int send_erasure(struct s25_peer *cl, const char *fname, uint64_t size, const char *dir,
+                 const struct route_type *t, const char *key, int *stored);
+int get_erasure(const struct route_type *t, const char *path, struct s25_peer *cl, uint64_t off, uint64_t len);
+int remove_on_backend(const struct route_type *t, const char *path);
+int place_upload(struct s25_peer *cl, const char *fname, uint64_t size, const char *dir,
+                 const struct route_type *t, const char *key);
+int redirect_get(const struct route_type *t, const char *path, struct s25_peer *cl);
+int send_stats(struct s25_peer *cl);
+
+/* What a listing asks for */
+struct list_query {
+    const char *dir;
+    int page;               // 0 = dispfnames, 1 = a listf page
+    const char *prefix;
+    const char *cursor;
+    uint32_t limit;
+    uint32_t options;       // S25_LIST_*
+};
+int send_listing(struct s25_peer *cl, const struct list_query *q);
+int backend_connect(const struct route *rt);
+int backend_acquire(const struct route *rt, int *reused);
+void backend_release(const struct route *rt, int s, int reusable);
+int backend_alive(int s, time_t idle_since);
+void backend_path_for(const struct route *rt, const char *path, char *out, size_t outlen);
 void mkdir_p(const char *path);
 void normalize_s1_path(const char *in, char *out, size_t outlen);
+void route_key(const char *path, char *key, size_t keylen);
 void map_dir_for_backend(const char *s1_dir, const char *backend_base, char *out, size_t outlen);
-ssize_t recv_all(int sock, void *buf, size_t len);
+ssize_t recv_cmd(int sock, char *cmd, int flags);
 void remove_extension(char *filename);
 
-int main() {
+int main(int argc, char *argv[]) {
     int sockfd, newsock;
     struct sockaddr_in serv, cli;
     socklen_t clen;
     pid_t pid;
+    int fork_mode = 0;
+    int workers = 0;
+    const char *route_file = NULL;
+
+    // -f: legacy fork-per-client mode, -w N: worker threads for the epoll engine,
+    // -1: speak the v1 protocol to the backends, -r FILE: routing table,
+    // -c MODE: how uploads are made durable (none, sync, group),
+    // -k FILE: key of the redirect tokens, -R BYTES: smallest redirected file,
+    // -t BYTES: largest .c archive kept ready (s25tar.h)
+    char key_file[PATH_MAX];
+    snprintf(key_file, sizeof(key_file), "%s/.s25key", getenv("HOME"));
+    int opt_c;
+    while((opt_c = getopt(argc, argv, "fw:1r:c:k:R:t:")) != -1) {
+        switch(opt_c) {
+            case 'f': fork_mode = 1; c_cache = NULL; break;
+            case 'w': workers = atoi(optarg); break;
+            case '1': backend_ver = 1; break;
+            case 'r': route_file = optarg; break;
+            case 'k': snprintf(key_file, sizeof(key_file), "%s", optarg); break;
+            case 'R': redirect_min = strtoull(optarg, NULL, 0); break;
+            case 't': c_archive.max = strtoull(optarg, NULL, 0); break;
+            case 'c':
+                if((commit_mode = commit_parse_mode(optarg)) >= 0) break;
+                // fall through
+            default:
+                fprintf(stderr, "usage: %s [-f] [-w workers] [-1] [-r routes] [-c none|sync|group]\n"
+                                "          [-k keyfile] [-R redirect-bytes] [-t archive-bytes]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(workers <= 0) workers = default_workers();
+
+    // Extension -> backend routes; ~/.s25routes unless -r names a file
+    char default_routes[PATH_MAX];
+    snprintf(default_routes, sizeof(default_routes), "%s/.s25routes", getenv("HOME"));
+    if(!route_load(route_file ? route_file : default_routes, route_file != NULL)) {
+        return 1;
+    }
+    for(int i = 0; i < ROUTES_MAX; i++) pthread_mutex_init(&pools[i].lock, NULL);
+    rs_init();
+    crc_init();
+    metrics_init("S1");
+    // Tokens need a key shared with the backends, and v2 backends to take them
+    if(!token_load(key_file) || backend_ver == 1) redirect_min = 0;
+    if(token_ready && backend_ver == 1)
+        fprintf(stderr, "warning: v1 requests go unsigned; backends with a key refuse them\n");
+    if(redirect_min) printf("Files from %llu bytes go directly between clients and backends\n",
+                            (unsigned long long)redirect_min);
+    for(int i = 0; i < route_ntypes; i++){
+        const struct route_type *t = &route_types[i];
+        if(!t->data_frags) continue;
+        // Fragments are read by byte range, which v1 backends cannot do
+        if(backend_ver == 1 || !rs_setup(&rs_codes[i], t->data_frags, t->replicas - t->data_frags)) {
+            fprintf(stderr, "%s: erasure coding needs v2 backends\n", t->ext);
+            return 1;
+        }
+        printf("%s: erasure coded %d+%d (%s)\n", t->ext, t->data_frags,
+               t->replicas - t->data_frags, rs_impl);
+    }
+    char local_ext[ROUTE_EXT_MAX] = ".c";
+    for(int i = 0; i < route_n; i++)
+        if(routes[i].backend < 0) memcpy(local_ext, routes[i].ext, sizeof(local_ext));
 
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if(sockfd < 0){ 
@@ -52,14 +204,29 @@ int main() {
         return 1; 
     }
     
-    listen(sockfd, 10);
-    printf("S1 (Main server) running on port %d\n", PORT);
+    listen(sockfd, fork_mode ? 10 : SOMAXCONN);
+    printf("S1 (Main server) running on port %d (%s)\n", PORT,
+           fork_mode ? "fork mode" : "epoll mode");
 
     // Ensure base folder exists
     char home[PATH_MAX];
     snprintf(home, sizeof(home), "%s/S1", getenv("HOME"));
     mkdir_p(home);
 
+    // Sorted index of the local names, kept across restarts
+    char index_path[PATH_MAX];
+    snprintf(index_path, sizeof(index_path), "%s/.s25index", getenv("HOME"));
+    mkdir_p(index_path);
+    strncat(index_path, "/S1", sizeof(index_path) - strlen(index_path) - 1);
+    index_open(index_path, local_ext);
+
+    if(!fork_mode) {
+        // A dead client must not take the whole process down with it
+        signal(SIGPIPE, SIG_IGN);
+        printf("S1 epoll engine: %d worker threads\n", workers);
+        return run_engine(sockfd, workers, serve_command, request_head);
+    }
+
     while(1) {
         clen = sizeof(cli);
         newsock = accept(sockfd, (struct sockaddr*)&cli, &clen);
@@ -68,13 +235,18 @@ int main() {
             continue; 
         }
         
+        int one = 1;
+        setsockopt(newsock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
         // Fork a child process to handle the client
         pid = fork();
         if(pid == 0) {
             // Child process
             close(sockfd); // Close listening socket in child
+            metrics_conn(1);
             prcclient(newsock);
             close(newsock);
+            metrics_conn(-1);
             exit(0);
         } else if(pid > 0) {
             // Parent process
@@ -89,15 +261,17 @@ int main() {
     return 0;
 }
 
-/* Recv helper to ensure we read full len bytes */
-ssize_t recv_all(int sock, void *buf, size_t len){
-    size_t recvd = 0;
-    while(recvd < len){
-        ssize_t r = recv(sock, (char*)buf + recvd, len - recvd, 0);
-        if(r <= 0) return r;
-        recvd += r;
-    }
-    return recvd;
+/* Read a NUL-terminated command name without eating the bytes after it.
+ * By the time a worker runs a command, its arguments are already queued
+ * behind the name, so peek first and consume only up to the NUL. */
+ssize_t recv_cmd(int sock, char *cmd, int flags){
+    memset(cmd, 0, BUF);
+    ssize_t r = recv(sock, cmd, BUF-1, flags | MSG_PEEK);
+    if(r <= 0) return r;
+    char *nul = memchr(cmd, 0, r);
+    size_t want = nul ? (size_t)(nul - cmd) + 1 : (size_t)r;
+    memset(cmd, 0, BUF);
+    return recv_all(sock, cmd, want);
 }
 
 /* mkdir -p implementation */
@@ -133,6 +307,16 @@ void normalize_s1_path(const char *in, char *out, size_t outlen){
     }
 }
 
+/* The ring key of a path: where it lives under ~/S1, in canonical form */
+void route_key(const char *path, char *key, size_t keylen){
+    char norm[PATH_MAX], canon[PATH_MAX], prefix[PATH_MAX];
+    normalize_s1_path(path, norm, sizeof(norm));
+    index_key(norm, canon, sizeof(canon));
+    snprintf(prefix, sizeof(prefix), "%s/S1", getenv("HOME"));
+    size_t n = strlen(prefix);
+    snprintf(key, keylen, "%s", strncmp(canon, prefix, n) == 0 ? canon + n : canon);
+}
+
 /* Map ~/S1 path to ~/S2 or ~/S3 etc. */
 void map_dir_for_backend(const char *s1_dir, const char *backend_base, char *out, size_t outlen){
     const char *home_env = getenv("HOME");
@@ -156,373 +340,484 @@ void remove_extension(char *filename) {
     }
 }
 
-/* Client handler function as specified in requirements */
-void prcclient(int client) {
-    char cmd[BUF], fname[BUF], dir[BUF], filetype[BUF];
+/* Read the count paths of a v2 downlf request, with their ranges when the
+ * request is ranged. The list grows only as items actually arrive, so a
+ * bogus count costs nothing. Returns NULL if the client went away. */
+struct dl_item *recv_items(struct s25_peer *cl, uint32_t count){
+    struct dl_item *items = malloc(sizeof(*items));
+    char name[BUF];
+    for(uint32_t i = 0; items && i < count; i++){
+        struct dl_item *grown = realloc(items, (i + 1) * sizeof(*items));
+        if(!grown){
+            free_items(items, i);
+            return NULL;
+        }
+        items = grown;
+        items[i].off = items[i].len = 0;
+        if(!s25_recv_str(cl, name, BUF) ||
+           ((cl->flags & S25_F_RANGE) &&
+            (!s25_recv_u64(cl, &items[i].off) || !s25_recv_u64(cl, &items[i].len))) ||
+           !(items[i].name = strdup(name))){
+            free_items(items, i);
+            return NULL;
+        }
+    }
+    return items;
+}
 
+void free_items(struct dl_item *items, uint32_t count){
+    for(uint32_t i = 0; items && i < count; i++) free(items[i].name);
+    free(items);
+}
+
+/* Client handler function as specified in requirements (fork mode) */
+void prcclient(int client) {
     // Enter infinite loop waiting for client commands
-    while(1) {
-        memset(cmd, 0, BUF);
-        int r = recv(client, cmd, BUF, 0);
-        if(r <= 0) {
-            break;
-        }
+    while(serve_one(client, 0));
+}
 
-        // ======== uploadf ========
-        if(strncmp(cmd, "uploadf", 7) == 0) {
-            int count;
-            recv_all(client, &count, sizeof(int));
-            recv_all(client, dir, BUF);
+/* Run one command on a ready connection (epoll mode).
+ * Returns 1 to keep the connection, 0 to close it. */
+int serve_command(int client) {
+    return serve_one(client, MSG_DONTWAIT);
+}
 
-            char norm_dir[PATH_MAX];
-            normalize_s1_path(dir, norm_dir, sizeof(norm_dir));
-            mkdir_p(norm_dir);
+/* How much of a request the epoll engine waits for before running it:
+ * the whole of it, except that an upload is run once its first file's name
+ * and size are in. Its contents may be large, and with a redirect the
+ * client waits for S1's answer before sending them or the next file; a v1
+ * client likewise sends a command's later items only after its replies. */
+size_t request_head(const char *p, size_t n){
+    if((unsigned char)p[0] == S25_MAGIC_HI) {
+        struct s25_hdr h;
+        if(n < S25_HDR_LEN) return S25_HDR_LEN;
+        if(!s25_parse_hdr(p, &h)) return n;     // rejected as soon as it runs
+        if(h.opcode != OP_UPLOADF) return S25_HDR_LEN + h.len;
+        size_t end = s25_fields_end(p, n, 2, S25_HDR_LEN, "us");
+        if(end > n || s25_peek_u32(p, 2, S25_HDR_LEN) == 0) return end;
+        return s25_fields_end(p, n, 2, end, "sl");
+    }
 
-            for(int i=0;i<count;i++){
-                recv_all(client, fname, BUF);
+    // v1: the NUL-terminated command name, then its fields up to the first item
+    const char *nul = memchr(p, 0, n < BUF - 1 ? n : BUF - 1);
+    if(!nul) return n < BUF - 1 ? n + 1 : n;
+    size_t off = nul - p + 1, end;
+    switch(s25_v1_opcode(p)) {
+        case OP_UPLOADF:
+            end = s25_fields_end(p, n, 1, off, "us");
+            if(end > n || s25_peek_u32(p, 1, off) == 0) return end;
+            return s25_fields_end(p, n, 1, end, "sl");
+        case OP_DOWNLF:
+        case OP_REMOVEF:
+            end = s25_fields_end(p, n, 1, off, "u");
+            if(end > n || s25_peek_u32(p, 1, off) == 0) return end;
+            return s25_fields_end(p, n, 1, end, "s");
+        case OP_DOWNLTAR:
+        case OP_DISPFNAMES:
+            return s25_fields_end(p, n, 1, off, "s");
+    }
+    return off;
+}
 
-                char path[PATH_MAX];
-                snprintf(path, sizeof(path), "%s/%s", norm_dir, fname);
+/* Read one request, in whichever protocol version the client speaks, and
+ * run it. Returns 1 to keep the connection, 0 to close it. */
+int serve_one(int client, int flags) {
+    unsigned char first;
+    ssize_t r = recv(client, &first, 1, flags | MSG_PEEK);
+    if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 1;   // spurious wakeup, wait for the next event
+    }
+    if(r <= 0) {
+        return 0;
+    }
 
-                char *tmpdup = strdup(path);
-                mkdir_p(dirname(tmpdup));
-                free(tmpdup);
+    struct s25_peer peer = { .fd = client, .ver = 1 };
+    if(first == S25_MAGIC_HI) {
+        struct s25_hdr h;
+        if(!s25_recv_hdr(client, &h)) {
+            return 0;
+        }
+        peer.ver = 2;
+        peer.reqid = h.reqid;
+        peer.flags = h.flags;
+        if(h.opcode < OP_UPLOADF || h.opcode > OP_STATS) {
+            // Unknown request: skip its payload and say so
+            return s25_drain(client, h.len) && s25_reply_status(&peer, 0);
+        }
+        uint64_t start = metrics_now_us();
+        int keep = handle_command(&peer, h.opcode);
+        metrics_command(h.opcode, start);
+        return keep;
+    }
 
-                int size;
-                recv_all(client, &size, sizeof(int));
-                
-                if(size <= 0) {
-                    continue;
-                }
+    char cmd[BUF];
+    if(recv_cmd(client, cmd, 0) <= 0) {
+        return 0;
+    }
+    int op = s25_v1_opcode(cmd);
+    if(op < OP_UPLOADF || op > OP_DISPFNAMES) {
+        return 1;   // v1 silently ignores unknown commands
+    }
+    uint64_t start = metrics_now_us();
+    int keep = handle_command(&peer, op);
+    metrics_command(op, start);
+    return keep;
+}
 
-                int f = open(path, O_CREAT|O_WRONLY|O_TRUNC, 0666);
-                if(f < 0) {
-                    // Still need to receive the data to keep protocol in sync
-                    char tmp[BUF];
-                    int left = size;
-                    while(left > 0) {
-                        int chunk = recv(client, tmp, left>BUF?BUF:left, 0);
-                        if(chunk <= 0) break;
-                        left -= chunk;
-                    }
-                    continue;
-                }
+/* Dispatch a single client command. Returns 0 when the client's stream can
+ * no longer be trusted (it went away or sent less than it announced). */
+int handle_command(struct s25_peer *cl, int op) {
+    char fname[BUF], dir[BUF], filetype[BUF];
+    uint32_t count;
 
-                int left = size; 
-                char buf[BUF];
-                while(left > 0){
-                    int chunk = recv(client, buf, left>BUF?BUF:left, 0);
-                    if(chunk <= 0) break;
-                    write(f, buf, chunk);
-                    left -= chunk;
-                }
-                close(f);
+    // ======== uploadf ========
+    if(op == OP_UPLOADF) {
+        if(!s25_recv_u32(cl, &count) || !s25_recv_str(cl, dir, BUF)) {
+            return 0;
+        }
 
-                // Forward non-.c files to backend servers
-                char *dot = strrchr(fname, '.');
-                if(dot && strcmp(dot, ".c") != 0){
-                    char backend_base[PATH_MAX];
-                    int port = 0;
-                    if(strcmp(dot, ".pdf")==0){ 
-                        snprintf(backend_base, sizeof(backend_base), "%s/S2", getenv("HOME"));
-                        port = 2202;
-                    } 
-                    else if(strcmp(dot, ".txt")==0){ 
-                        snprintf(backend_base, sizeof(backend_base), "%s/S3", getenv("HOME"));
-                        port = 3303;
-                    }
-                    else if(strcmp(dot, ".zip")==0){ 
-                        snprintf(backend_base, sizeof(backend_base), "%s/S4", getenv("HOME"));
-                        port = 4404;
-                    }
-                    
-                    if(port){
-                        char backend_dir[PATH_MAX];
-                        map_dir_for_backend(norm_dir, backend_base, backend_dir, sizeof(backend_dir));
-                        send_to_backend(path, backend_dir, port);
-                        remove(path);
-                    }
-                }
+        char norm_dir[PATH_MAX];
+        normalize_s1_path(dir, norm_dir, sizeof(norm_dir));
+        mkdir_p(norm_dir);
+
+        for(uint32_t i=0;i<count;i++){
+            uint64_t size;
+            if(!s25_recv_str(cl, fname, BUF) || !s25_recv_u64(cl, &size)) {
+                return 0;
             }
-        }
-        // ======== downlf ========
-        else if(strncmp(cmd, "downlf", 6) == 0) {
-            int count;
-            recv_all(client, &count, sizeof(int));
             
-            for(int i=0;i<count;i++){
-                recv_all(client, fname, BUF);
-                
-                char *dot = strrchr(fname, '.');
-                if(dot && strcmp(dot, ".c")==0){
-                    char norm[PATH_MAX];
-                    normalize_s1_path(fname, norm, sizeof(norm));
-                    int f = open(norm, O_RDONLY);
-                    if(f<0){ 
-                        int z=0; send(client,&z,sizeof(int),0); 
-                        continue; 
-                    }
-                    int size = lseek(f,0,SEEK_END);
-                    lseek(f,0,SEEK_SET);
-                    send(client,&size,sizeof(int),0);
-                    char b[BUF]; int rd;
-                    while((rd=read(f,b,BUF))>0) send(client,b,rd,0);
-                    close(f);
-                } else if(dot && strcmp(dot, ".pdf")==0){
-                    get_from_backend(2202, fname, client);
-                } else if(dot && strcmp(dot, ".txt")==0){
-                    get_from_backend(3303, fname, client);
-                } else if(dot && strcmp(dot, ".zip")==0){
-                    get_from_backend(4404, fname, client);
-                } else {
-                    int z=0; send(client,&z,sizeof(int),0);
+            if(size == 0) {
+                s25_reply_status(cl, 0);    // nothing to store
+                continue;
+            }
+
+            // Files of a backend's type are relayed straight to the node(s)
+            // that own the path as they arrive; nothing is staged under ~/S1
+            const struct route_type *t = route_type_of(fname);
+            char path[PATH_MAX], key[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", norm_dir, fname);
+            route_key(path, key, sizeof(key));
+            if(cl->flags & S25_F_REDIRECT) {
+                // The client waits to hear where the contents go
+                int placed = place_upload(cl, fname, size, norm_dir, t, key);
+                if(placed < 0) {
+                    return 0;
+                }
+                if(placed) {
+                    continue;
                 }
             }
-        }
-        // ======== removef ========
-        else if(strncmp(cmd, "removef", 7)==0) {
-            int count;
-            recv_all(client, &count, sizeof(int));
-            for(int i=0;i<count;i++){
-                recv_all(client, fname, BUF);
-                char *dot = strrchr(fname, '.');
-                if(dot && strcmp(dot, ".c")==0){
-                    char norm[PATH_MAX];
-                    normalize_s1_path(fname, norm, sizeof(norm));
-                    remove(norm);
-                } else if(dot && strcmp(dot, ".pdf")==0){
-                    remove_on_backend(2202, fname);
-                } else if(dot && strcmp(dot, ".txt")==0){
-                    remove_on_backend(3303, fname);
-                } else if(dot && strcmp(dot, ".zip")==0){
-                    remove_on_backend(4404, fname);
+            if(t && !t->local){
+                int stored = 0;
+                if(!send_to_backend(cl, fname, size, norm_dir, t, key, &stored)) {
+                    return 0;   // client went away mid-file
                 }
+                s25_reply_status(cl, stored);
+                continue;
+            }
+
+            // Types without a route are received and dropped
+
+            char *tmpdup = strdup(path);
+            mkdir_p(dirname(tmpdup));
+            free(tmpdup);
+
+            // Written to a temporary file and published whole, tagged with
+            // the CRC of what arrived (checked against the client's if sent)
+            struct commit_file cf = { .fd = -1 };
+            struct s25_file file = { .fd = t ? commit_open(&cf, path) : -1 };
+            int st = s25_recv_file(cl, size, &file);
+            if(st == 1) crc_save(file.fd, file.crc, size);
+            int published = commit_close(&cf, st == 1);
+            if(published) {
+                if(c_cache) tar_cache_touch(c_cache);
+                index_update(path, 1);
             }
+            if(st < 0) {
+                return 0;
+            }
+            s25_reply_status(cl, published == 1);
         }
-        // ======== downltar ========
-        else if(strncmp(cmd, "downltar", 8)==0) {
-            recv_all(client, filetype, BUF);
-            
-            if(strcmp(filetype, ".c")==0){
-                char cmdline[PATH_MAX*2];
-                snprintf(cmdline, sizeof(cmdline), "find %s/S1 -type f -name \"*.c\" -print0 | tar -cf /tmp/c.tar --null -T -", getenv("HOME"));
-                system(cmdline);
-                int f = open("/tmp/c.tar",O_RDONLY);
-                if(f < 0) {
-                    int z=0; send(client,&z,sizeof(int),0);
+    }
+    // ======== downlf ========
+    else if(op == OP_DOWNLF) {
+        if(!s25_recv_u32(cl, &count)) {
+            return 0;
+        }
+
+        // A v2 request is taken in whole before answering, since in
+        // large-object mode the client's chunk acks share the stream with it.
+        // v1 clients send each path only after the previous reply.
+        struct dl_item *items = NULL;
+        if(cl->ver == 2 && !(items = recv_items(cl, count))) {
+            return 0;
+        }
+
+        int live = 1;
+        for(uint32_t i=0;live && i<count;i++){
+            struct dl_item one = { fname, 0, 0 };
+            if(!items && !s25_recv_str(cl, fname, BUF)) {
+                return 0;
+            }
+            struct dl_item *it = items ? &items[i] : &one;
+            const char *name = it->name;
+            const struct route_type *t = route_type_of(name);
+            if(t && t->local){
+                char norm[PATH_MAX];
+                normalize_s1_path(name, norm, sizeof(norm));
+                int f = open(norm, O_RDONLY);
+                if(f<0){ 
+                    s25_reply_data(cl, 0, S25_F_ERROR);
+                    continue; 
+                }
+                off_t size = lseek(f,0,SEEK_END);
+                if(size < 0 || !s25_can_carry(cl, size)){
+                    close(f);
+                    s25_reply_data(cl, 0, S25_F_ERROR);
                     continue;
                 }
-                int size=lseek(f,0,SEEK_END);
-                lseek(f,0,SEEK_SET);
-                send(client,&size,sizeof(int),0);
-                char b[BUF];int rd;
-                while((rd=read(f,b,BUF))>0) send(client,b,rd,0);
-                close(f); remove("/tmp/c.tar");
-            } else if(strcmp(filetype, ".pdf")==0){
-                get_from_backend(2202, "TAR", client);
-            } else if(strcmp(filetype, ".txt")==0){
-                get_from_backend(3303, "TAR", client);
+                live = send_object(cl, f, size, it->off, it->len);
+                close(f);
+            } else if(t) {
+                // Large files may be fetched from their node directly
+                int sent = (cl->flags & S25_F_REDIRECT) ? redirect_get(t, name, cl) : 0;
+                if(sent < 0) live = 0;
+                else if(!sent) live = get_from_backend(t, name, cl, it->off, it->len);
             } else {
-                int z=0; send(client,&z,sizeof(int),0);
+                s25_reply_data(cl, 0, S25_F_ERROR);
             }
         }
-        // ======== dispfnames ========
-        else if(strncmp(cmd, "dispfnames", 10)==0) {
-            recv_all(client, dir, BUF);
-            char norm_dir[PATH_MAX];
-            normalize_s1_path(dir, norm_dir, sizeof(norm_dir));
-
-            char result[16384] = "";
-
-            // Collect local .c files (names only, no extensions)
-            char *local_files[1024];
-            int count = 0;
-            DIR *d = opendir(norm_dir);
-            if(d){
-                struct dirent *de;
-                while((de=readdir(d))!=NULL){
-                    if(de->d_type == DT_REG && strstr(de->d_name,".c")){
-                        char *name_copy = strdup(de->d_name);
-                        remove_extension(name_copy);
-                        local_files[count++] = name_copy;
-                    }
-                }
-                closedir(d);
-                // Sort alphabetically
-                for(int i = 0; i < count-1; i++) {
-                    for(int j = i+1; j < count; j++) {
-                        if(strcmp(local_files[i], local_files[j]) > 0) {
-                            char *temp = local_files[i];
-                            local_files[i] = local_files[j];
-                            local_files[j] = temp;
-                        }
-                    }
-                }
-                for(int i=0;i<count;i++){ 
-                    strcat(result, local_files[i]); 
-                    strcat(result,"\n"); 
-                    free(local_files[i]); 
-                }
+        free_items(items, count);
+        if(!live) {
+            return 0;
+        }
+    }
+    // ======== removef ========
+    else if(op == OP_REMOVEF) {
+        if(!s25_recv_u32(cl, &count)) {
+            return 0;
+        }
+        for(uint32_t i=0;i<count;i++){
+            if(!s25_recv_str(cl, fname, BUF)) {
+                return 0;
             }
-            
-            // Get files from backend servers (they will also return names without extensions)
-            list_from_backend(2202, norm_dir, result);
-            list_from_backend(3303, norm_dir, result);
-            list_from_backend(4404, norm_dir, result);
-            
-            send(client, result, strlen(result), 0);
+            int ok = 0;
+            const struct route_type *t = route_type_of(fname);
+            if(t && t->local){
+                char norm[PATH_MAX];
+                normalize_s1_path(fname, norm, sizeof(norm));
+                ok = remove(norm) == 0;
+                if(ok && c_cache) tar_cache_touch(c_cache);
+                if(ok) index_update(norm, 0);
+            } else if(t) {
+                ok = remove_on_backend(t, fname);
+            }
+            s25_reply_status(cl, ok);
+        }
+    }
+    // ======== downltar ========
+    else if(op == OP_DOWNLTAR) {
+        if(!s25_recv_str(cl, filetype, BUF)) {
+            return 0;
+        }
+        
+        const struct route_type *t = route_find(filetype);
+        if(t && t->local){
+            return send_tar(cl, c_cache, routes[t->ring[0].node].root, t->ext);
+        } else if(t) {
+            return get_from_backend(t, "TAR", cl, 0, 0);
+        } else {
+            s25_reply_data(cl, 0, S25_F_ERROR);
         }
     }
+    // ======== dispfnames ========
+    else if(op == OP_DISPFNAMES) {
+        if(!s25_recv_str(cl, dir, BUF)) {
+            return 0;
+        }
+        char norm_dir[PATH_MAX];
+        normalize_s1_path(dir, norm_dir, sizeof(norm_dir));
+
+        struct list_query q = { norm_dir, 0, "", "", 0, 0 };
+        return send_listing(cl, &q);
+    }
+    // ======== listf ========
+    else if(op == OP_LISTF) {
+        char prefix[BUF], cursor[BUF];
+        uint32_t limit, options;
+        if(!s25_recv_str(cl, dir, BUF) || !s25_recv_str(cl, prefix, BUF) ||
+           !s25_recv_str(cl, cursor, BUF) || !s25_recv_u32(cl, &limit) ||
+           !s25_recv_u32(cl, &options)) {
+            return 0;
+        }
+        if(limit == 0 || limit > S25_PAGE_MAX) limit = S25_PAGE_MAX;
+        char norm_dir[PATH_MAX];
+        normalize_s1_path(dir, norm_dir, sizeof(norm_dir));
+        struct list_query q = { norm_dir, 1, prefix, cursor, limit, options };
+        return send_listing(cl, &q);
+    }
+    // ======== stats ========
+    else if(op == OP_STATS) {
+        return send_stats(cl);
+    }
+    return 1;
 }
 
-/* Send file to backend */
-void send_to_backend(const char *src_path, const char *dest_dir, int port){
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in a; 
-    a.sin_family = AF_INET;
-    a.sin_port = htons(port);
-    a.sin_addr.s_addr = inet_addr("127.0.0.1");
+/* ================= backend connection pool =================
+ * Connections to S2/S3/S4 are kept open and reused across requests: the
+ * backends loop over commands on a connection until it is closed. Idle
+ * sockets are checked before reuse and replaced if the backend went away.
+ */
 
-    if(connect(s, (struct sockaddr*)&a, sizeof(a)) < 0){
-        close(s);
-        return;
+/* Open a fresh connection to a route's backend */
+int backend_connect(const struct route *rt){
+    const struct route_backend *b = route_backend_of(rt);
+    if(!b) return -1;
+    int s = socket(b->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(s < 0) {
+        metrics_connect_failed();
+        return -1;
     }
 
-    // Send command with proper buffer size
-    char cmd[BUF];
-    memset(cmd, 0, BUF);
-    strcpy(cmd, "upload");
-    send(s, cmd, BUF, 0);
-    
-    // Send destination directory
-    char dest_buf[BUF];
-    memset(dest_buf, 0, BUF);
-    strncpy(dest_buf, dest_dir, BUF-1);
-    send(s, dest_buf, BUF, 0);
-
-    // Send filename
-    char *filename = strrchr(src_path, '/');
-    filename = (filename) ? filename + 1 : (char*)src_path;
-    
-    char fname_buf[BUF];
-    memset(fname_buf, 0, BUF);
-    strncpy(fname_buf, filename, BUF-1);
-    send(s, fname_buf, BUF, 0);
-
-    // Send file content
-    int f = open(src_path, O_RDONLY);
-    if(f < 0){
+    if(connect(s, (const struct sockaddr*)&b->addr, b->addrlen) < 0){
+        metrics_connect_failed();
         close(s);
-        return;
+        return -1;
     }
-    
-    int filesize = lseek(f, 0, SEEK_END);
-    lseek(f, 0, SEEK_SET);
-    send(s, &filesize, sizeof(filesize), 0);
+    // Command frames are small and latency bound
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return s;
+}
 
-    char buf[BUF];
-    int rd;
-    while((rd = read(f, buf, BUF)) > 0){
-        send(s, buf, rd, 0);
-    }
+/* Request ids for backend requests; replies echo them back */
+static uint32_t next_reqid(void){
+    return __atomic_add_fetch(&backend_reqid, 1, __ATOMIC_RELAXED);
+}
 
-    close(f);
-    close(s);
+static struct backend_pool *pool_for(const struct route *rt){
+    return rt->backend < 0 ? NULL : &pools[rt->backend];
 }
 
-void get_from_backend(int port, const char *path, int client){
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in a; 
-    a.sin_family = AF_INET; 
-    a.sin_port = htons(port);
-    a.sin_addr.s_addr = inet_addr("127.0.0.1");
-    
-    if(connect(s, (struct sockaddr*)&a, sizeof(a)) < 0){ 
-        int z = 0; 
-        send(client, &z, sizeof(int), 0); 
-        close(s); 
-        return; 
+static uint64_t now_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Note the outcome of a read request to a node: the time it took to be
+ * answered, or (us 0) that the node could not be reached */
+static void backend_note(const struct route *rt, uint64_t us){
+    struct backend_pool *p = pool_for(rt);
+    if(!p) return;
+    pthread_mutex_lock(&p->lock);
+    if(us == 0) {
+        p->down_until = time(NULL) + BACKEND_DOWN_SECS;
+    } else {
+        p->down_until = 0;
+        if(p->rtt_us == 0) p->rtt_us = us;
+        else p->rtt_us += ((int64_t)us - (int64_t)p->rtt_us) / (1 << READ_EWMA_SHIFT);
     }
+    pthread_mutex_unlock(&p->lock);
+}
 
-    // Send command
-    char cmd[BUF];
-    memset(cmd, 0, BUF);
-    strcpy(cmd, "get");
-    send(s, cmd, BUF, 0);
-    
-    // Convert S1 path to backend path
-    char backend_path[BUF];
-    memset(backend_path, 0, BUF);
-    
-    if(strcmp(path, "TAR") == 0) {
-        strcpy(backend_path, "TAR");
+/* Count a read in flight on a node (delta 1) or finished (-1) */
+static void backend_busy(const struct route *rt, int delta){
+    struct backend_pool *p = pool_for(rt);
+    if(!p) return;
+    pthread_mutex_lock(&p->lock);
+    p->reading += delta;
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* What a read from a node is expected to cost: its latency, scaled by the
+ * reads already under way there so a hot file spreads over its replicas.
+ * A node that just failed costs the most. */
+static uint64_t backend_cost(const struct route *rt){
+    struct backend_pool *p = pool_for(rt);
+    if(!p) return 0;
+    pthread_mutex_lock(&p->lock);
+    uint64_t cost = p->down_until > time(NULL) ? UINT64_MAX :
+                    (p->rtt_us + 1) * (uint64_t)(p->reading + 1);
+    pthread_mutex_unlock(&p->lock);
+    return cost;
+}
+
+/* Health check for an idle pooled connection. A socket that has been quiet
+ * for a while gets a ping round trip; otherwise a non-blocking peek is enough
+ * to notice a backend that closed or reset it. */
+int backend_alive(int s, time_t idle_since){
+    char c;
+    ssize_t r = recv(s, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if(r == 0) return 0;                    // orderly shutdown by backend
+    if(r > 0) return 0;                     // unsolicited bytes: out of sync
+    if(errno != EAGAIN && errno != EWOULDBLOCK) return 0;
+    if(time(NULL) - idle_since < POOL_PING_IDLE) return 1;
+
+    struct s25_peer be = { .fd = s, .ver = backend_ver };
+    struct s25_buf b;
+    uint64_t start = metrics_now_us();
+    s25_start(&b, be.ver, OP_PING, next_reqid());
+    s25_sign(&b);
+    s25_finish(&b, 0);
+    if(!s25_send_buf(s, &b)) return 0;
+    int ok;
+    if(be.ver == 1){
+        int pong = 0;
+        ok = recv_all(s, &pong, sizeof(int)) == sizeof(int) && pong == 1;
     } else {
-        // Convert ~/S1/... to ~/S2/... (or S3/S4)
-        char norm_path[PATH_MAX];
-        normalize_s1_path(path, norm_path, sizeof(norm_path));
-        
-        const char *home = getenv("HOME");
-        char s1_prefix[PATH_MAX];
-        snprintf(s1_prefix, sizeof(s1_prefix), "%s/S1", home);
-        
-        if(strncmp(norm_path, s1_prefix, strlen(s1_prefix)) == 0) {
-            char backend_base[10];
-            if(port == 2202) strcpy(backend_base, "S2");
-            else if(port == 3303) strcpy(backend_base, "S3");
-            else if(port == 4404) strcpy(backend_base, "S4");
-            else strcpy(backend_base, "S2");
-            
-            snprintf(backend_path, sizeof(backend_path), "%s/%s%s", 
-                     home, backend_base, norm_path + strlen(s1_prefix));
-        } else {
-            strncpy(backend_path, norm_path, sizeof(backend_path)-1);
-        }
+        ok = s25_recv_status(&be) == 1;
     }
-    
-    send(s, backend_path, BUF, 0);
-    
-    int sz;
-    if(recv_all(s, &sz, sizeof(int)) <= 0){ 
-        int z = 0; 
-        send(client, &z, sizeof(int), 0); 
-        close(s); 
-        return; 
+    if(ok) metrics_call(OP_PING, start);
+    return ok;
+}
+
+/* Take a healthy connection to a route's backend from the pool, or open a
+ * new one */
+int backend_acquire(const struct route *rt, int *reused){
+    struct backend_pool *p = pool_for(rt);
+    while(p) {
+        pthread_mutex_lock(&p->lock);
+        if(p->nidle == 0){
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        p->nidle--;
+        int s = p->idle[p->nidle];
+        time_t since = p->since[p->nidle];
+        pthread_mutex_unlock(&p->lock);
+
+        if(backend_alive(s, since)){
+            if(reused) *reused = 1;
+            return s;
+        }
+        close(s);   // dead: drop it and try the next one
     }
-    
-    send(client, &sz, sizeof(int), 0);
-    
-    char b[BUF]; 
-    int rd, total = 0;
-    while(total < sz){
-        rd = recv(s, b, BUF, 0);
-        if(rd <= 0) break;
-        send(client, b, rd, 0);
-        total += rd;
+    if(reused) *reused = 0;
+    return backend_connect(rt);
+}
+
+/* Hand a connection back. Only connections whose last request completed
+ * cleanly are pooled; anything else may be mid-frame and is closed. */
+void backend_release(const struct route *rt, int s, int reusable){
+    struct backend_pool *p = pool_for(rt);
+    if(s < 0) return;
+    if(p && reusable){
+        pthread_mutex_lock(&p->lock);
+        if(p->nidle < POOL_MAX_IDLE){
+            p->idle[p->nidle] = s;
+            p->since[p->nidle] = time(NULL);
+            p->nidle++;
+            pthread_mutex_unlock(&p->lock);
+            return;
+        }
+        pthread_mutex_unlock(&p->lock);
     }
     close(s);
 }
 
-void remove_on_backend(int port, const char *path){
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in a; 
-    a.sin_family = AF_INET; 
-    a.sin_port = htons(port);
-    a.sin_addr.s_addr = inet_addr("127.0.0.1");
-    
-    if(connect(s, (struct sockaddr*)&a, sizeof(a)) < 0){ 
-        close(s); 
-        return; 
-    }
-    
-    // Send command
-    char cmd[BUF];
-    memset(cmd, 0, BUF);
-    strcpy(cmd, "remove");
-    send(s, cmd, BUF, 0);
-    
-    // Convert S1 path to backend path
-    char backend_path[BUF];
-    memset(backend_path, 0, BUF);
+/* Convert a path under ~/S1 to the same path under the route's root */
+void backend_path_for(const struct route *rt, const char *path, char *out, size_t outlen){
     char norm_path[PATH_MAX];
     normalize_s1_path(path, norm_path, sizeof(norm_path));
     
@@ -531,49 +826,1343 @@ void remove_on_backend(int port, const char *path){
     snprintf(s1_prefix, sizeof(s1_prefix), "%s/S1", home);
     
     if(strncmp(norm_path, s1_prefix, strlen(s1_prefix)) == 0) {
-        char backend_base[10];
-        if(port == 2202) strcpy(backend_base, "S2");
-        else if(port == 3303) strcpy(backend_base, "S3");
-        else if(port == 4404) strcpy(backend_base, "S4");
-        else strcpy(backend_base, "S2");
-        
-        snprintf(backend_path, sizeof(backend_path), "%s/%s%s", 
-                 home, backend_base, norm_path + strlen(s1_prefix));
+        snprintf(out, outlen, "%s%s", rt->root, norm_path + strlen(s1_prefix));
     } else {
-        strncpy(backend_path, norm_path, sizeof(backend_path)-1);
+        snprintf(out, outlen, "%s", norm_path);
     }
-    
-    send(s, backend_path, BUF, 0);
-    close(s);
 }
 
-void list_from_backend(int port, const char *dir, char *result){
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in a; 
-    a.sin_family = AF_INET; 
-    a.sin_port = htons(port);
-    a.sin_addr.s_addr = inet_addr("127.0.0.1");
-    
-    if(connect(s, (struct sockaddr*)&a, sizeof(a)) < 0){ 
-        close(s); 
-        return; 
+/* Per-thread pipe that serves as the in-kernel buffer for splice() relays */
+static __thread int relay_pipe[2] = { -1, -1 };
+
+static int relay_pipe_get(void){
+    if(relay_pipe[0] >= 0) return 1;
+    if(pipe2(relay_pipe, O_CLOEXEC) < 0) return 0;
+    // Best effort: the kernel caps this at /proc/sys/fs/pipe-max-size
+    fcntl(relay_pipe[1], F_SETPIPE_SZ, RELAY_PIPE_SZ);
+    return 1;
+}
+
+/* Throw the pipe away, along with any bytes stuck in it */
+static void relay_pipe_drop(void){
+    close(relay_pipe[0]);
+    close(relay_pipe[1]);
+    relay_pipe[0] = relay_pipe[1] = -1;
+}
+
+/* Relay exactly len bytes from one socket to another. The bytes move
+ * socket -> pipe -> socket with splice(), so they are never copied into user
+ * space; partial writes out of the pipe are resumed until it is empty. If
+ * splice is unavailable a bounded buffer is used instead. If the destination
+ * fails (or is -1) the rest is still drained from the source to keep that
+ * stream in sync. Returns the bytes consumed from the source; *delivered
+ * tells whether all of them reached the destination. */
+long relay(int from, int to, long len, int *delivered){
+    long done = 0;
+    int ok = to >= 0;
+
+    while(ok && done < len && relay_pipe_get()){
+        long want = len - done;
+        ssize_t in = splice(from, NULL, relay_pipe[1], NULL,
+                            want > RELAY_PIPE_SZ ? RELAY_PIPE_SZ : want,
+                            SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(in < 0 && errno == EINTR) continue;
+        if(in < 0 && errno == EINVAL && done == 0) break;   // use the buffer
+        if(in <= 0) {
+            if(delivered) *delivered = 0;
+            return done;
+        }
+        metrics_io(in, 0);
+        done += in;
+
+        // Empty the pipe into the destination, resuming short writes
+        while(in > 0){
+            ssize_t out = splice(relay_pipe[0], NULL, to, NULL, in,
+                                 SPLICE_F_MOVE | (done < len ? SPLICE_F_MORE : 0));
+            if(out < 0 && errno == EINTR) continue;
+            if(out <= 0) {
+                relay_pipe_drop();
+                ok = 0;
+                break;
+            }
+            metrics_io(0, out);
+            in -= out;
+        }
+    }
+
+    // Buffered path: no splice support, or draining after the destination failed
+    char buf[RELAY_BUF];
+    while(done < len){
+        long want = len - done;
+        ssize_t r = recv(from, buf, want > RELAY_BUF ? RELAY_BUF : want, 0);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) break;
+        metrics_io(r, 0);
+        if(ok && !send_all(to, buf, r)) ok = 0;
+        done += r;
+    }
+    if(delivered) *delivered = ok && done == len;
+    return done;
+}
+
+/* A chunked object passing through S1: chunks are forwarded one at a time
+ * and each is acknowledged upstream only after the next hop acknowledged
+ * it, so an ack always means the bytes reached their final destination. */
+struct chunk_relay {
+    struct s25_peer *to;    // next hop
+    uint64_t size;          // whole object
+    uint64_t sent;          // bytes the next hop has accepted
+    int ok;                 // next hop still in sync
+};
+
+/* Chunk sink: forward a chunk to the next hop and wait for its ack. A v1
+ * backend has no chunk framing and just receives the raw bytes. */
+static int relay_chunk(void *ctx, int sock, uint64_t off, uint64_t len){
+    struct chunk_relay *r = ctx;
+    if(r->ok && r->to->ver == 2) {
+        r->ok = s25_send_hdr(r->to->fd, OP_DATA, off + len < r->size ? S25_F_MORE : 0,
+                             r->to->reqid, len);
+    }
+    int delivered = 0;
+    long got = relay(sock, r->ok ? r->to->fd : -1, len, &delivered);
+    if(got != (long)len || !delivered) {
+        r->ok = 0;      // the next hop is left mid-chunk
+        return got == (long)len ? 0 : -1;
+    }
+    int st = r->to->ver == 2 ? s25_recv_ack(r->to) : 1;
+    if(st < 0) r->ok = 0;
+    if(st == 1) r->sent += len;
+    return st == 1;
+}
+
+/* Announce an upload of size bytes to dest_dir/fname on a backend. With
+ * crc a v2 backend is told the contents are followed by their CRC32C. */
+static int backend_upload(struct s25_peer *be, const char *dest_dir, const char *fname,
+                          uint64_t size, int chunked, int crc){
+    if(be->fd < 0 || !s25_can_carry(be, size)) return 0;
+    // Command, destination directory and filename, then size and content
+    struct s25_buf b;
+    s25_start(&b, be->ver, OP_UPLOAD, be->reqid);
+    s25_put_str(&b, dest_dir);
+    s25_put_str(&b, fname);
+    s25_put_u64(&b, size);
+    s25_set_flags(&b, (chunked ? S25_F_CHUNKED : 0) | (crc ? S25_F_CRC : 0));
+    s25_sign(&b);
+    s25_finish(&b, (chunked ? s25_chunked_len(size) : size) + (crc && be->ver == 2 ? S25_CRC_LEN : 0));
+    return s25_send_buf(be->fd, &b);
+}
+
+/* Read the CRC that follows an upload if the client sent one, and pass it
+ * on to be if that backend is still in sync (*synced) and takes CRCs.
+ * Returns 0 if the client went away, which also leaves be out of sync. */
+static int pass_crc(struct s25_peer *cl, struct s25_peer *be, int *synced){
+    uint32_t crc;
+    if(!(cl->flags & S25_F_CRC)) return 1;
+    if(!s25_recv_crc(cl->fd, &crc)) {
+        *synced = 0;
+        return 0;
+    }
+    if(*synced && be->ver == 2 && !s25_send_crc(be->fd, crc)) *synced = 0;
+    return 1;
+}
+
+/* Stream one upload from the client straight to a single node. *stored is
+ * set when the backend acknowledged the file. Returns 1 while the client's
+ * stream is still in sync, 0 if the client went away. */
+static int send_to_node(struct s25_peer *cl, const char *fname, uint64_t size, const char *dest_dir, const struct route *rt, int *stored){
+    uint64_t start = metrics_now_us();
+    struct s25_peer be = { .fd = backend_acquire(rt, NULL), .ver = backend_ver, .reqid = next_reqid() };
+    int chunked = cl->flags & S25_F_CHUNKED;
+    // The client's CRC goes along, for the backend to check
+    int ok = backend_upload(&be, dest_dir, fname, size, chunked, cl->flags & S25_F_CRC);
+
+    if(chunked){
+        struct chunk_relay r = { &be, size, 0, ok };
+        int got = s25_recv_chunked(cl, size, relay_chunk, &r);
+        int synced = r.ok && r.sent == size;
+        if(got >= 0 && !pass_crc(cl, &be, &synced)) got = -1;
+        // A backend left mid-object (client aborted, or a chunk was refused)
+        // cannot be resynchronised: it is closed rather than pooled
+        int st = synced ? s25_recv_status(&be) : -1;
+        *stored = got == 1 && st == 1;
+        if(st >= 0) metrics_call(OP_UPLOAD, start);
+        backend_release(rt, be.fd, st >= 0);
+        return got >= 0;
+    }
+
+    int delivered = 0;
+    long got = relay(cl->fd, ok ? be.fd : -1, size, &delivered);
+    int synced = ok && delivered;
+    if(got == (long)size && !pass_crc(cl, &be, &synced)) got = -1;
+    int st = synced ? s25_recv_status(&be) : -1;
+    *stored = st == 1;
+    if(st >= 0) metrics_call(OP_UPLOAD, start);
+    backend_release(rt, be.fd, st >= 0);
+    return got == (long)size;
+}
+
+/* One node an upload is replicated to */
+struct replica {
+    const struct route *rt;
+    struct s25_peer be;
+    int ok;                 // in sync and has taken everything so far
+    uint64_t start;         // when the upload to it began (metrics_now_us)
+};
+
+/* An upload written to several nodes at once */
+struct replica_set {
+    struct replica *r;
+    int n, quorum;
+    uint64_t size;
+    uint64_t sent;          // bytes passed to the replicas still ok
+    uint32_t crc;           // CRC32C of those bytes
+};
+
+static int replicas_ok(const struct replica_set *rs){
+    int n = 0;
+    for(int i = 0; i < rs->n; i++) n += rs->r[i].ok;
+    return n;
+}
+
+/* Copy len bytes from the client to every replica still ok. The bytes go
+ * through one buffer (splice cannot fan out); a replica that fails is
+ * dropped and the client's stream is still read to the end. Returns 0 if
+ * the client went away. */
+static int replicas_copy(struct replica_set *rs, int from, uint64_t len){
+    char buf[RELAY_BUF];
+    while(len > 0){
+        ssize_t n = recv(from, buf, len > RELAY_BUF ? RELAY_BUF : len, 0);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return 0;
+        metrics_io(n, 0);
+        for(int i = 0; i < rs->n; i++)
+            if(rs->r[i].ok && !send_all(rs->r[i].be.fd, buf, n)) rs->r[i].ok = 0;
+        rs->crc = crc32c(rs->crc, buf, n);
+        len -= n;
+        rs->sent += n;
+    }
+    return 1;
+}
+
+/* Chunk sink of a replicated upload: the chunk goes to every replica, and
+ * the client gets its ack once they all answered, as long as a quorum of
+ * them still has the whole file so far */
+static int replicate_chunk(void *ctx, int sock, uint64_t off, uint64_t len){
+    struct replica_set *rs = ctx;
+    uint32_t more = off + len < rs->size ? S25_F_MORE : 0;
+    for(int i = 0; i < rs->n; i++){
+        struct replica *r = &rs->r[i];
+        if(r->ok && r->be.ver == 2) r->ok = s25_send_hdr(r->be.fd, OP_DATA, more, r->be.reqid, len);
+    }
+    if(!replicas_copy(rs, sock, len)) return -1;
+    for(int i = 0; i < rs->n; i++){
+        struct replica *r = &rs->r[i];
+        if(r->ok && r->be.ver == 2 && s25_recv_ack(&r->be) != 1) r->ok = 0;
+    }
+    return replicas_ok(rs) >= rs->quorum;
+}
+
+/* Read the replicas' upload statuses as they come in and hand their
+ * connections back. Once a quorum has stored the file the others get
+ * REPLICA_LAG_MS more, then are left (and closed by the caller) so one
+ * slow node does not hold up the client. Returns how many stored it. */
+static int replicas_collect(struct replica_set *rs){
+    int stored = 0;
+    uint64_t deadline = 0;
+    for(;;){
+        struct pollfd pfd[ROUTES_MAX];
+        int who[ROUTES_MAX], k = 0;
+        for(int i = 0; i < rs->n; i++){
+            if(!rs->r[i].ok) continue;
+            pfd[k] = (struct pollfd){ rs->r[i].be.fd, POLLIN, 0 };
+            who[k++] = i;
+        }
+        if(k == 0) break;
+        int wait = -1;
+        if(deadline){
+            uint64_t now = now_us();
+            if(now >= deadline) break;
+            wait = (deadline - now + 999) / 1000;
+        }
+        // v1 backends send no status
+        int ready = backend_ver == 1 ? k : poll(pfd, k, wait);
+        if(ready < 0 && errno == EINTR) continue;
+        if(ready <= 0) break;
+        for(int j = 0; j < k; j++){
+            if(backend_ver != 1 && !pfd[j].revents) continue;
+            struct replica *r = &rs->r[who[j]];
+            int st = s25_recv_status(&r->be);
+            if(st >= 0) metrics_call(OP_UPLOAD, r->start);
+            backend_release(r->rt, r->be.fd, st >= 0);
+            r->be.fd = -1;
+            r->ok = 0;
+            stored += st == 1;
+        }
+        if(stored >= rs->quorum && !deadline) deadline = now_us() + REPLICA_LAG_MS * 1000;
+    }
+    return stored;
+}
+
+/* Connect to the nodes of a replica set and announce an upload of size
+ * bytes, followed by its CRC, to each. Short of a quorum of reachable
+ * nodes, nothing is sent. */
+static void replicas_open(struct replica_set *rs, const struct route **nodes, const char *dir,
+                          const char *fname, uint64_t size, int chunked){
+    int up = 0;
+    for(int i = 0; i < rs->n; i++){
+        struct replica *r = &rs->r[i];
+        r->rt = nodes[i];
+        r->start = metrics_now_us();
+        r->be = (struct s25_peer){ .fd = backend_acquire(nodes[i], NULL), .ver = backend_ver, .reqid = next_reqid() };
+        r->ok = 0;
+        up += r->be.fd >= 0;
+    }
+    for(int i = 0; i < rs->n; i++){
+        struct replica *r = &rs->r[i];
+        if(up < rs->quorum) {
+            backend_release(r->rt, r->be.fd, 1);
+            r->be.fd = -1;
+            continue;
+        }
+        char dest_dir[PATH_MAX];
+        map_dir_for_backend(dir, nodes[i]->root, dest_dir, sizeof(dest_dir));
+        r->ok = backend_upload(&r->be, dest_dir, fname, size, chunked, 1);
+    }
+}
+
+/* Stream one upload from the client to n nodes in parallel. *stored is set
+ * once quorum of them acknowledged the file. Returns 1 while the client's
+ * stream is still in sync, 0 if the client went away. */
+static int send_to_replicas(struct s25_peer *cl, const char *fname, uint64_t size, const char *dir,
+                            const struct route **nodes, int n, int quorum, int *stored){
+    struct replica r[ROUTES_MAX];
+    struct replica_set rs = { r, n, quorum, size, 0, 0 };
+    replicas_open(&rs, nodes, dir, fname, size, cl->flags & S25_F_CHUNKED);
+
+    int got;
+    if(cl->flags & S25_F_CHUNKED) {
+        got = s25_recv_chunked(cl, size, replicate_chunk, &rs);
+    } else {
+        got = replicas_copy(&rs, cl->fd, size) ? 1 : -1;
+    }
+    // The replicas check the file against the client's CRC, or S1's own
+    // for a client that sends none
+    uint32_t crc = rs.crc;
+    if(got >= 0 && (cl->flags & S25_F_CRC) && !s25_recv_crc(cl->fd, &crc)) got = -1;
+    // Replicas left mid-object are closed rather than pooled
+    if(rs.sent < size || got < 0)
+        for(int i = 0; i < n; i++) r[i].ok = 0;
+    for(int i = 0; i < n; i++)
+        if(r[i].ok && r[i].be.ver == 2 && !s25_send_crc(r[i].be.fd, crc)) r[i].ok = 0;
+    *stored = replicas_collect(&rs) >= quorum && got == 1;
+    for(int i = 0; i < n; i++)
+        if(r[i].be.fd >= 0) close(r[i].be.fd);
+    return got >= 0;
+}
+
+/* Stream one upload from the client to the nodes that keep its path (key):
+ * the owner, or the type's first replicas nodes in ring order. *stored is
+ * set when the file was stored. Returns 1 while the client's stream is
+ * still in sync, 0 if the client went away. */
+int send_to_backend(struct s25_peer *cl, const char *fname, uint64_t size, const char *dir,
+                    const struct route_type *t, const char *key, int *stored){
+    if(t->data_frags) {
+        return send_erasure(cl, fname, size, dir, t, key, stored);
+    }
+    const struct route *nodes[ROUTES_MAX];
+    int n = route_walk(t, key, nodes, t->replicas);
+    if(n > 1) {
+        return send_to_replicas(cl, fname, size, dir, nodes, n, t->quorum, stored);
+    }
+    char dest_dir[PATH_MAX];
+    map_dir_for_backend(dir, nodes[0]->root, dest_dir, sizeof(dest_dir));
+    return send_to_node(cl, fname, size, dest_dir, nodes[0], stored);
+}
+
+/* Send a GET (or TAR) to a backend and read its data announcement. A pooled
+ * connection may have been dropped by the backend since the health check;
+ * nothing has reached the client yet, so retry once on a fresh one. */
+static int backend_get(const struct route *rt, const char *backend_path, uint32_t req_flags,
+                       uint64_t off, uint64_t len, struct s25_peer *be,
+                       uint64_t *sz, uint32_t *flags, uint64_t *size){
+    int reused = 0;
+    uint64_t start = metrics_now_us();
+    for(int attempt = 0; attempt < 2; attempt++){
+        be->fd = backend_acquire(rt, &reused);
+        if(be->fd < 0) return 0;
+        struct s25_buf b;
+        int tar = strcmp(backend_path, "TAR") == 0;
+        be->reqid = next_reqid();
+        s25_start(&b, be->ver, tar ? OP_TAR : OP_GET, be->reqid);
+        if(!tar) s25_put_str(&b, backend_path);
+        if(req_flags & S25_F_RANGE) {
+            s25_put_u64(&b, off);
+            s25_put_u64(&b, len);
+        }
+        s25_set_flags(&b, req_flags);
+        s25_sign(&b);
+        s25_finish(&b, 0);
+        if(s25_send_buf(be->fd, &b) && s25_recv_object(be, sz, flags, size)) {
+            metrics_call(tar ? OP_TAR : OP_GET, start);
+            return 1;
+        }
+        close(be->fd);
+        be->fd = -1;
+        if(!reused) return 0;
+    }
+    return 0;
+}
+
+/* Pass on to the client the object a node (rt) announced on be: len bytes
+ * from off for a ranged request, else all of it. Returns 0 if the client
+ * went away. */
+static int pass_object(struct s25_peer *cl, const struct route *rt, struct s25_peer *be,
+                       uint64_t sz, uint32_t flags, uint64_t size, uint64_t off, uint64_t len){
+    if((flags & S25_F_ERROR) || !s25_can_carry(cl, sz)){
+        // Not found, or too large for a v1 client: keep the backend in sync
+        backend_release(rt, be->fd, s25_drain(be->fd, sz));
+        return s25_reply_data(cl, 0, S25_F_ERROR);
     }
     
-    char cmd[BUF];
-    memset(cmd, 0, BUF);
-    strcpy(cmd, "list");
-    send(s, cmd, BUF, 0);
-    
-    char dir_buf[BUF];
-    memset(dir_buf, 0, BUF);
-    strncpy(dir_buf, dir, BUF-1);
-    send(s, dir_buf, BUF, 0);
+    if(flags & S25_F_CHUNKED){
+        // Large object: pass chunks through one at a time; the backend only
+        // sees an ack once the client has acknowledged the chunk
+        uint32_t crc = flags & S25_F_CRC;
+        struct chunk_relay r = { cl, sz, 0, s25_reply_object(cl, size, sz, S25_F_CHUNKED | crc) };
+        int st = s25_recv_chunked(be, sz, relay_chunk, &r);
+        if(r.ok && r.sent < sz){
+            // Cut short: the client still expects a final chunk
+            r.ok = s25_send_hdr(cl->fd, OP_DATA, S25_F_ERROR, cl->reqid, 0) &&
+                   s25_recv_ack(cl) >= 0;
+        }
+        if(crc) {
+            // and the CRC it was promised, whatever became of the data
+            uint32_t c = 0;
+            if(st >= 0 && !s25_recv_crc(be->fd, &c)) st = -1;
+            if(r.ok) r.ok = s25_send_crc(cl->fd, c);
+        }
+        backend_release(rt, be->fd, st >= 0);
+        return r.ok;
+    }
+
+    uint64_t skip = 0, n = sz;
+    if((cl->flags & S25_F_RANGE) && !(flags & S25_F_RANGE)) {
+        skip = off;
+        n = len;
+        s25_clamp_range(sz, &skip, &n);
+    }
+    // A CRC only comes from v2 backends, which cut ranges themselves, so
+    // it always follows the whole of what is relayed
+    uint32_t crc = flags & S25_F_CRC;
+    long len_out = n + (crc ? S25_CRC_LEN : 0);
+    int ok = s25_reply_object(cl, size, n, crc);
     
-    char b[BUF]; 
-    int r = recv(s, b, BUF-1, 0);
-    if(r > 0){ 
-        b[r] = 0; 
-        strcat(result, b); 
+    // Kernel-side relay; the backend stream is drained even if the client
+    // stops reading, so the pooled connection stays usable
+    int delivered = 0;
+    int synced = s25_drain(be->fd, skip) &&
+                 relay(be->fd, ok ? cl->fd : -1, len_out, &delivered) == len_out &&
+                 s25_drain(be->fd, sz - skip - n);
+    backend_release(rt, be->fd, synced);
+    return ok && delivered;
+}
+
+/* Put the first n nodes of order cheapest first for a read (a stable
+ * insertion sort; n is the replica count, so small) */
+static void order_replicas(const struct route **order, int n){
+    uint64_t cost[ROUTES_MAX];
+    for(int i = 0; i < n; i++){
+        const struct route *rt = order[i];
+        uint64_t c = backend_cost(rt);
+        int j = i;
+        for(; j > 0 && cost[j - 1] > c; j--){
+            cost[j] = cost[j - 1];
+            order[j] = order[j - 1];
+        }
+        cost[j] = c;
+        order[j] = rt;
     }
-    close(s);
+}
+
+/* Proxy a backend file (or its TAR archive) to the client: len bytes from
+ * off for a ranged request, else all of it. The file is asked of its
+ * replicas first, the one expected to answer soonest leading, then of the
+ * type's other nodes in ring order, so files placed before a node was
+ * added are still found. Returns 0 if the client went away. */
+int get_from_backend(const struct route_type *t, const char *path, struct s25_peer *cl, uint64_t off, uint64_t len){
+    int tar = strcmp(path, "TAR") == 0;
+    if(t->data_frags) {
+        // No archives of fragments
+        if(tar) {
+            return s25_reply_data(cl, 0, S25_F_ERROR);
+        }
+        // A file with no fragments anywhere may have been stored whole,
+        // before the type was erasure coded: it is read as such
+        int sent = get_erasure(t, path, cl, off, len);
+        if(sent >= 0) {
+            return sent;
+        }
+    }
+    if(tar && t->nodes > 1) {
+        return get_tar_shards(t, cl);
+    }
+    const struct route *order[ROUTES_MAX];
+    int tries = 1;
+    if(tar) {
+        order[0] = &routes[t->ring[0].node];
+    } else {
+        char key[PATH_MAX];
+        route_key(path, key, sizeof(key));
+        tries = route_walk(t, key, order, ROUTES_MAX);
+        order_replicas(order, t->replicas < tries ? t->replicas : tries);
+    }
+
+    // v1 backends cannot serve ranges; they are cut out of the whole file here
+    const struct route *rt = NULL;
+    struct s25_peer be = { .fd = -1, .ver = backend_ver };
+    uint32_t req_flags = cl->flags & (S25_F_CHUNKED | S25_F_CRC);
+    if(be.ver == 2) req_flags |= cl->flags & S25_F_RANGE;
+    uint64_t sz = 0, size = 0;
+    uint32_t flags = S25_F_ERROR;
+    for(int i = 0; i < tries && (flags & S25_F_ERROR); i++){
+        // Convert ~/S1/... to the same path under the node's root
+        char backend_path[BUF];
+        if(tar) strcpy(backend_path, "TAR");
+        else backend_path_for(order[i], path, backend_path, sizeof(backend_path));
+        if(rt) {
+            backend_release(rt, be.fd, s25_drain(be.fd, sz));
+            backend_busy(rt, -1);
+        }
+        rt = NULL;
+        sz = 0;
+        flags = S25_F_ERROR;
+        backend_busy(order[i], 1);
+        uint64_t start = now_us();
+        if(backend_get(order[i], backend_path, req_flags, off, len, &be, &sz, &flags, &size)) {
+            rt = order[i];
+            backend_note(rt, now_us() - start + 1);
+        } else {
+            backend_note(order[i], 0);
+            backend_busy(order[i], -1);
+            flags = S25_F_ERROR;    // unreachable: try the next node
+        }
+    }
+    if(!rt){ 
+        return s25_reply_data(cl, 0, S25_F_ERROR);
+    }
+    int ok = pass_object(cl, rt, &be, sz, flags, size, off, len);
+    backend_busy(rt, -1);
+    return ok;
+}
+
+/* ================= direct transfers =================
+ * A client that flags S25_F_REDIRECT can move the bytes of a large file to
+ * or from a storage server itself: S1 only picks the node and signs a token
+ * for the one file (s25token.h), and its own bandwidth goes to placing
+ * files rather than carrying them. Files under redirect_min stay on S1, as
+ * do local and erasure-coded files and uploads of replicated types, which
+ * S1 has to spread over several nodes.
+ */
+
+/* A placement of path on node rt, with a token for op; 0 if rt is local */
+static int redirect_to(struct s25_redirect *r, const struct route *rt, const char *path,
+                       uint64_t size, int op){
+    const struct route_backend *b = route_backend_of(rt);
+    if(!b) return 0;
+    snprintf(r->host, sizeof(r->host), "%s", b->host);
+    r->port = b->port;
+    snprintf(r->path, sizeof(r->path), "%s", path);
+    r->size = size;
+    token_issue(&r->token, op, path, op == OP_TPUT ? size : 0);
+    return 1;
+}
+
+/* Tell a client that flagged S25_F_REDIRECT where an upload of size bytes
+ * to dir/fname goes. Returns 1 when that answers the item (the client was
+ * sent to the node, or the type has no route), 0 when the client was asked
+ * to send the contents here, -1 if the client went away. */
+int place_upload(struct s25_peer *cl, const char *fname, uint64_t size, const char *dir,
+                 const struct route_type *t, const char *key){
+    if(!t) {
+        s25_reply_status(cl, 0);
+        return 1;
+    }
+    if(redirect_min && size >= redirect_min && !t->local && !t->data_frags && t->replicas == 1) {
+        const struct route *node;
+        char dest[PATH_MAX];
+        route_walk(t, key, &node, 1);
+        map_dir_for_backend(dir, node->root, dest, sizeof(dest));
+        size_t n = strlen(dest);
+        snprintf(dest + n, sizeof(dest) - n, "/%s", fname);
+        struct s25_redirect r;
+        if(redirect_to(&r, node, dest, size, OP_TPUT)) {
+            // The client sends the next file only once this one is stored
+            // there, which must not count against its pace here
+            engine_credit(size);
+            return s25_reply_redirect(cl, &r) ? 1 : -1;
+        }
+    }
+    // The contents come through here
+    return s25_send_hdr(cl->fd, OP_STATUS, S25_F_MORE, cl->reqid, 0) ? 0 : -1;
+}
+
+/* Answer a download of path with a placement on the replica expected to
+ * answer soonest, if the file is large enough. Each replica is asked for
+ * an empty range past the end, which tells the size without any data.
+ * Returns 1 when the item was answered, 0 when it is to be proxied as
+ * usual (small, not found, or not a file a client can fetch itself), -1
+ * if the client went away. */
+int redirect_get(const struct route_type *t, const char *path, struct s25_peer *cl){
+    if(!redirect_min || t->data_frags || (cl->flags & S25_F_RANGE) || strcmp(path, "TAR") == 0) {
+        return 0;
+    }
+    const struct route *order[ROUTES_MAX];
+    char key[PATH_MAX];
+    route_key(path, key, sizeof(key));
+    int n = route_walk(t, key, order, t->replicas);
+    order_replicas(order, n);
+    for(int i = 0; i < n; i++){
+        char backend_path[BUF];
+        backend_path_for(order[i], path, backend_path, sizeof(backend_path));
+        struct s25_peer be = { .fd = -1, .ver = backend_ver };
+        uint64_t sz, size;
+        uint32_t flags;
+        if(!backend_get(order[i], backend_path, S25_F_RANGE, UINT64_MAX, 0, &be, &sz, &flags, &size)) {
+            continue;
+        }
+        backend_release(order[i], be.fd, s25_drain(be.fd, sz));
+        if(flags & S25_F_ERROR) {
+            continue;
+        }
+        if(size < redirect_min) {
+            return 0;
+        }
+        struct s25_redirect r;
+        if(!redirect_to(&r, order[i], backend_path, size, OP_TGET)) {
+            return 0;
+        }
+        return s25_reply_redirect(cl, &r) ? 1 : -1;
+    }
+    return 0;
+}
+
+/* Remove a file on one node; returns 1 if the backend removed it */
+static int remove_on_node(const struct route *rt, const char *path){
+    // Convert S1 path to backend path
+    char backend_path[BUF];
+    backend_path_for(rt, path, backend_path, sizeof(backend_path));
+
+    struct s25_peer be = { .fd = backend_acquire(rt, NULL), .ver = backend_ver };
+    if(be.fd < 0){ 
+        return 0; 
+    }
+    struct s25_buf b;
+    uint64_t start = metrics_now_us();
+    s25_start(&b, be.ver, OP_REMOVE, next_reqid());
+    s25_put_str(&b, backend_path);
+    s25_sign(&b);
+    s25_finish(&b, 0);
+    int st = s25_send_buf(be.fd, &b) ? s25_recv_status(&be) : -1;
+    if(st >= 0) metrics_call(OP_REMOVE, start);
+    backend_release(rt, be.fd, st >= 0);
+    return st == 1;
+}
+
+/* Remove a file of a backend type: on every node that should keep a copy
+ * (its owner and the other replicas), else on the first other node that
+ * has it. Returns 1 if a backend removed it. */
+int remove_on_backend(const struct route_type *t, const char *path){
+    char key[PATH_MAX];
+    route_key(path, key, sizeof(key));
+    const struct route *order[ROUTES_MAX];
+    int n = route_walk(t, key, order, ROUTES_MAX);
+    int removed = 0;
+    for(int i = 0; i < n && (i < t->replicas || !removed); i++)
+        removed |= remove_on_node(order[i], path);
+    return removed;
+}
+
+/* One node's archive within a sharded downltar */
+struct tar_shard {
+    const struct route *rt;
+    struct s25_peer be;
+    uint64_t left;          // archive bytes still to pass on
+    uint64_t trailer;       // end-of-archive bytes to drop after them
+};
+
+struct tar_shards {
+    struct tar_shard *sh;
+    int n, cur;
+};
+
+/* Payload of a sharded archive: the shards' streams in turn, relayed as
+ * they are requested */
+static int shards_payload(void *ctx, int sock, uint64_t off, uint64_t len){
+    struct tar_shards *a = ctx;
+    (void)off;
+    while(len > 0 && a->cur < a->n){
+        struct tar_shard *s = &a->sh[a->cur];
+        uint64_t k = len < s->left ? len : s->left;
+        int delivered = 0;
+        if(k > 0 && (relay(s->be.fd, sock, k, &delivered) != (long)k || !delivered)) return 0;
+        s->left -= k;
+        len -= k;
+        if(s->left == 0){
+            backend_release(s->rt, s->be.fd, s25_drain(s->be.fd, s->trailer));
+            s->be.fd = -1;
+            a->cur++;
+        }
+    }
+    return len == 0;
+}
+
+/* downltar of a type sharded over several nodes: every node's archive,
+ * back to back as one, each but the last without its end-of-archive
+ * blocks. Returns 0 if the client went away. */
+int get_tar_shards(const struct route_type *t, struct s25_peer *cl){
+    struct tar_shards a = { calloc(t->nodes, sizeof(struct tar_shard)), 0, 0 };
+    if(!a.sh) {
+        return s25_reply_data(cl, 0, S25_F_ERROR);
+    }
+    uint64_t total = 0;
+    for(int i = 0; i < route_n; i++){
+        if(strcmp(routes[i].ext, t->ext) != 0) continue;
+        struct tar_shard *s = &a.sh[a.n];
+        s->rt = &routes[i];
+        s->be = (struct s25_peer){ .fd = -1, .ver = backend_ver };
+        uint64_t sz = 0, size = 0;
+        uint32_t flags = 0;
+        if(!backend_get(s->rt, "TAR", 0, 0, 0, &s->be, &sz, &flags, &size)) continue;
+        if((flags & S25_F_ERROR) || sz < 2 * TAR_BLOCK){
+            // no files of the type on this node
+            backend_release(s->rt, s->be.fd, s25_drain(s->be.fd, sz));
+            continue;
+        }
+        s->left = sz - 2 * TAR_BLOCK;
+        s->trailer = 2 * TAR_BLOCK;
+        total += s->left;
+        a.n++;
+    }
+
+    int ok;
+    if(a.n == 0 || !s25_can_carry(cl, total + 2 * TAR_BLOCK)) {
+        ok = s25_reply_data(cl, 0, S25_F_ERROR);
+    } else {
+        // the last shard keeps its end-of-archive blocks
+        a.sh[a.n - 1].left += 2 * TAR_BLOCK;
+        a.sh[a.n - 1].trailer = 0;
+        total += 2 * TAR_BLOCK;
+        if((cl->flags & S25_F_CHUNKED) && total > S25_CHUNK) {
+            ok = s25_reply_data(cl, total, S25_F_CHUNKED) &&
+                 s25_send_chunked(cl, total, shards_payload, &a) >= 0;
+        } else {
+            ok = s25_reply_data(cl, total, 0) && shards_payload(&a, cl->fd, 0, total);
+        }
+    }
+    // whatever was not passed on is cut off mid-stream
+    for(int i = a.cur; i < a.n; i++)
+        if(a.sh[i].be.fd >= 0) close(a.sh[i].be.fd);
+    free(a.sh);
+    return ok;
+}
+
+/* ================= erasure-coded types =================
+ * A file of such a type is kept as k data and m parity fragments, fragment
+ * i on the i-th node from its key. S1 encodes an upload as it streams
+ * through, one stripe (k blocks) at a time, and decodes downloads the same
+ * way. A download reads the first k fragments it can reach in ring order,
+ * so while every data fragment's node is up nothing has to be rebuilt.
+ */
+
+static const struct rs_code *rs_code_of(const struct route_type *t){
+    return &rs_codes[t - route_types];
+}
+
+/* An upload being erasure coded */
+struct ec_upload {
+    struct replica_set rs;      // one entry per fragment, by index
+    const struct rs_code *code;
+    uint32_t block;
+    uint8_t *frag[RS_MAX];      // this stripe's k data then m parity blocks
+    uint64_t fill;              // data bytes gathered for the stripe
+    uint32_t crc[RS_MAX];       // CRC32C of what each fragment was sent
+};
+
+/* Pass len bytes on to fragment i */
+static void ec_send(struct ec_upload *u, int i, const void *buf, size_t len){
+    struct replica *r = &u->rs.r[i];
+    u->crc[i] = crc32c(u->crc[i], buf, len);
+    if(r->ok && !send_all(r->be.fd, buf, len)) r->ok = 0;
+}
+
+/* Encode the stripe gathered so far, zero-padded, and pass block i on to
+ * fragment i */
+static void ec_flush(struct ec_upload *u){
+    uint64_t stripe = (uint64_t)u->code->k * u->block;
+    memset(u->frag[0] + u->fill, 0, stripe - u->fill);
+    rs_encode(u->code, u->frag, u->block);
+    for(int i = 0; i < u->rs.n; i++) ec_send(u, i, u->frag[i], u->block);
+    u->fill = 0;
+}
+
+/* End every fragment with the object's CRC, then send the fragment's own
+ * for its node to check */
+static void ec_finish(struct ec_upload *u, uint32_t crc){
+    uint8_t tail[RS_CRC_LEN];
+    rs_put32(tail, crc);
+    for(int i = 0; i < u->rs.n; i++){
+        struct replica *r = &u->rs.r[i];
+        ec_send(u, i, tail, RS_CRC_LEN);
+        if(r->ok && !s25_send_crc(r->be.fd, u->crc[i])) r->ok = 0;
+    }
+}
+
+/* Take len bytes of the object from the client, sending every stripe off
+ * as it fills up. Returns 0 if the client went away. */
+static int ec_feed(struct ec_upload *u, int from, uint64_t len){
+    uint64_t stripe = (uint64_t)u->code->k * u->block;
+    while(len > 0){
+        uint64_t want = stripe - u->fill < len ? stripe - u->fill : len;
+        ssize_t n = recv(from, u->frag[0] + u->fill, want, 0);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return 0;
+        metrics_io(n, 0);
+        u->rs.crc = crc32c(u->rs.crc, u->frag[0] + u->fill, n);
+        u->fill += n;
+        u->rs.sent += n;
+        len -= n;
+        if(u->fill == stripe) ec_flush(u);
+    }
+    return 1;
+}
+
+/* Chunk sink of an erasure-coded upload; a chunk is acknowledged while
+ * enough fragments are still being written */
+static int ec_chunk(void *ctx, int sock, uint64_t off, uint64_t len){
+    struct ec_upload *u = ctx;
+    (void)off;
+    if(!ec_feed(u, sock, len)) return -1;
+    return replicas_ok(&u->rs) >= u->rs.quorum;
+}
+
+/* Stream one upload into k + m fragments on the nodes that keep its path
+ * (key). *stored is set once k + 1 fragments were stored, so the file
+ * survives the loss of one more node. Returns 1 while the client's stream
+ * is still in sync, 0 if the client went away. */
+int send_erasure(struct s25_peer *cl, const char *fname, uint64_t size, const char *dir,
+                 const struct route_type *t, const char *key, int *stored){
+    const struct rs_code *code = rs_code_of(t);
+    const struct route *nodes[ROUTES_MAX];
+    int n = route_walk(t, key, nodes, t->replicas);
+    struct replica r[RS_MAX];
+    struct ec_upload u = { { r, n, t->quorum, size, 0, 0 }, code, rs_block_for(size, code->k), { 0 }, 0, { 0 } };
+    uint8_t *buf = malloc((size_t)n * u.block);
+    if(!buf) {
+        u.rs.n = 0;     // nothing to store it with: just drain the upload
+    }
+    for(int i = 0; i < u.rs.n; i++) u.frag[i] = buf + (size_t)i * u.block;
+
+    // Every fragment starts with a header describing the whole object
+    replicas_open(&u.rs, nodes, dir, fname, rs_frag_len(size, code->k, u.block, RS_F_CRC), 0);
+    for(int i = 0; i < u.rs.n; i++){
+        struct rs_frag f = { size, code->k, code->m, i, u.block, RS_F_CRC };
+        uint8_t h[RS_HDR];
+        rs_pack_hdr(h, &f);
+        ec_send(&u, i, h, RS_HDR);
+    }
+
+    int got;
+    if(cl->flags & S25_F_CHUNKED) {
+        got = buf ? s25_recv_chunked(cl, size, ec_chunk, &u) :
+                    s25_recv_chunked(cl, size, s25_file_sink, &(struct s25_file){ .fd = -1 });
+    } else {
+        got = buf ? (ec_feed(&u, cl->fd, size) ? 1 : -1) : (s25_drain(cl->fd, size) ? 0 : -1);
+    }
+    if(u.rs.sent == size && u.fill > 0) ec_flush(&u);
+    // The object must be the one the client checksummed: the fragments are
+    // not all written by then, so S1 checks it itself
+    uint32_t crc = u.rs.crc;
+    if(got >= 0 && (cl->flags & S25_F_CRC) && !s25_recv_crc(cl->fd, &crc)) got = -1;
+    if(got == 1 && crc != u.rs.crc) got = 0;
+    // Fragments left mid-object are closed rather than pooled
+    if(u.rs.sent < size || got != 1)
+        for(int i = 0; i < u.rs.n; i++) r[i].ok = 0;
+    ec_finish(&u, crc);
+    *stored = replicas_collect(&u.rs) >= u.rs.quorum && got == 1;
+    for(int i = 0; i < u.rs.n; i++)
+        if(r[i].be.fd >= 0) close(r[i].be.fd);
+    free(buf);
+    return got >= 0;
+}
+
+/* One fragment an erasure-coded download is read from */
+struct ec_source {
+    const struct route *rt;
+    struct s25_peer be;
+};
+
+/* An erasure-coded download: k sources and the stripe being passed on */
+struct ec_download {
+    const struct rs_code *code;
+    struct ec_source src[RS_MAX];
+    int have[RS_MAX];           // fragment index of each source
+    uint8_t dec[RS_MAX][RS_MAX];
+    uint32_t block;
+    uint8_t *data[RS_MAX];      // the stripe's k data blocks, back to back
+    uint8_t *in[RS_MAX];        // where each source's block goes
+    uint64_t stripes;           // still to read from the sources
+    uint64_t pos, end;          // what of the stripe is left to send
+    uint64_t skip;              // bytes before the range in the first stripe
+};
+
+/* Read the next stripe from the sources and rebuild its data */
+static int ec_stripe(struct ec_download *d){
+    int k = d->code->k;
+    for(int l = 0; l < k; l++)
+        if(recv_all(d->src[l].be.fd, d->in[l], d->block) != (ssize_t)d->block) return 0;
+    rs_recover(d->code, d->have, d->dec, d->in, d->data, d->block);
+    d->stripes--;
+    d->pos = d->skip;
+    d->skip = 0;
+    d->end = (uint64_t)k * d->block;
+    return 1;
+}
+
+/* Payload of an erasure-coded download: the object decoded stripe by
+ * stripe as the stream reaches it */
+static int ec_payload(void *ctx, int sock, uint64_t off, uint64_t len){
+    struct ec_download *d = ctx;
+    (void)off;
+    while(len > 0){
+        if(d->pos == d->end && !ec_stripe(d)) return 0;
+        uint64_t n = d->end - d->pos < len ? d->end - d->pos : len;
+        if(!send_all(sock, d->data[0] + d->pos, n)) return 0;
+        d->pos += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/* Read one fragment's header from a node; 1 if it holds a fragment */
+static int ec_probe(const struct route *rt, const char *backend_path, struct rs_frag *f){
+    struct s25_peer be = { .fd = -1, .ver = backend_ver };
+    uint64_t sz = 0, size = 0;
+    uint32_t flags = 0;
+    uint64_t start = now_us();
+    if(!backend_get(rt, backend_path, S25_F_RANGE, 0, RS_HDR, &be, &sz, &flags, &size)) {
+        backend_note(rt, 0);
+        return 0;
+    }
+    backend_note(rt, now_us() - start + 1);
+    uint8_t h[RS_HDR];
+    int got = !(flags & S25_F_ERROR) && sz == RS_HDR;
+    int synced = got ? recv_all(be.fd, h, RS_HDR) == RS_HDR : s25_drain(be.fd, sz);
+    backend_release(rt, be.fd, synced);
+    return got && synced && rs_parse_hdr(h, f);
+}
+
+/* Download len bytes from off (all of it unless ranged) of an erasure-coded
+ * file: the fragments' headers are read first, then the blocks of the
+ * stripes the range covers. Returns 0 if the client went away, -1 (with
+ * nothing sent) if no node has a fragment of the file. */
+int get_erasure(const struct route_type *t, const char *path, struct s25_peer *cl, uint64_t off, uint64_t len){
+    struct ec_download d;
+    memset(&d, 0, sizeof(d));
+    d.code = rs_code_of(t);
+    int k = d.code->k, found = 0, fragments = 0;
+    if(!(cl->flags & S25_F_RANGE)) off = len = 0;
+
+    char key[PATH_MAX];
+    route_key(path, key, sizeof(key));
+    const struct route *order[ROUTES_MAX];
+    int tries = route_walk(t, key, order, ROUTES_MAX);
+    struct rs_frag first = { 0 };
+    for(int i = 0; i < tries && found < k; i++){
+        char backend_path[BUF];
+        backend_path_for(order[i], path, backend_path, sizeof(backend_path));
+        struct rs_frag f;
+        if(!ec_probe(order[i], backend_path, &f)) continue;
+        fragments++;
+        if((int)f.k != k || (int)f.m != d.code->m) continue;
+        if(found && (f.size != first.size || f.block != first.block)) continue;
+        int dup = 0;
+        for(int l = 0; l < found; l++) dup |= d.have[l] == (int)f.index;
+        if(dup) continue;
+        if(!found) first = f;
+        d.src[found] = (struct ec_source){ .rt = order[i], .be = { .fd = -1, .ver = backend_ver } };
+        d.have[found++] = f.index;
+    }
+    if(fragments == 0) {
+        return -1;
+    }
+    uint64_t n = len;
+    s25_clamp_range(first.size, &off, &n);
+    if(found < k || !s25_can_carry(cl, n) || !rs_decoder(d.code, d.have, d.dec)) {
+        return s25_reply_data(cl, 0, S25_F_ERROR);
+    }
+
+    d.block = first.block;
+    // A read of the whole object also takes the CRC stored after the stripes
+    int crc = (cl->flags & S25_F_CRC) && (first.flags & RS_F_CRC) && n > 0 && n == first.size;
+    uint64_t stripe = (uint64_t)k * d.block;
+    uint64_t s0 = off / stripe;
+    d.stripes = n ? (off + n + stripe - 1) / stripe - s0 : 0;
+    d.skip = off - s0 * stripe;
+    uint8_t *buf = malloc((size_t)(k + d.code->m) * d.block);
+    int ok = buf != NULL;
+    for(int j = 0; ok && j < k; j++) d.data[j] = buf + (size_t)j * d.block;
+    for(int l = 0, p = k; ok && l < k; l++)
+        d.in[l] = d.have[l] < k ? d.data[d.have[l]] : buf + (size_t)p++ * d.block;
+
+    // The blocks of those stripes from every source
+    uint64_t want = d.stripes * d.block + (crc ? RS_CRC_LEN : 0);
+    for(int l = 0; ok && l < k && d.stripes > 0; l++){
+        struct ec_source *s = &d.src[l];
+        char backend_path[BUF];
+        backend_path_for(s->rt, path, backend_path, sizeof(backend_path));
+        uint64_t sz = 0, size = 0;
+        uint32_t flags = 0;
+        ok = backend_get(s->rt, backend_path, S25_F_RANGE, RS_HDR + s0 * d.block,
+                         want, &s->be, &sz, &flags, &size) &&
+             !(flags & S25_F_ERROR) && sz == want;
+    }
+    int synced = ok;
+    if(!ok) {
+        ok = s25_reply_data(cl, 0, S25_F_ERROR);
+    } else {
+        uint32_t flags = crc ? S25_F_CRC : 0;
+        if((cl->flags & S25_F_CHUNKED) && n > S25_CHUNK) {
+            ok = s25_reply_object(cl, first.size, n, flags | S25_F_CHUNKED) &&
+                 s25_send_chunked(cl, n, ec_payload, &d) >= 0;
+        } else {
+            ok = s25_reply_object(cl, first.size, n, flags) && ec_payload(&d, cl->fd, 0, n);
+        }
+        synced = d.stripes == 0;
+        // The CRC every fragment ends with: the first source's is passed on
+        uint32_t stored = 0, c = 0;
+        for(int l = 0; crc && synced && l < k; l++){
+            synced = s25_recv_crc(d.src[l].be.fd, &c);
+            if(l == 0) stored = c;
+        }
+        if(crc) ok = ok && s25_send_crc(cl->fd, stored);
+    }
+    for(int l = 0; l < k; l++) backend_release(d.src[l].rt, d.src[l].be.fd, synced);
+    free(buf);
+    return ok;
+}
+
+/* ================= dispfnames and listf =================
+ * A listing is a k-way merge of sorted sources, one per route: S1's own
+ * files and the replies of the backends. The backend requests all go out
+ * before anything is read, so the backends scan their trees while S1 scans
+ * its own, and the merged names are streamed out as they are produced.
+ *
+ * dispfnames lists a whole directory, names without their extensions.
+ * listf asks for one page: entries (relative paths with extensions) that
+ * start with a prefix and follow a cursor, at most a limit of them, each
+ * source answering with the same page semantics.
+ */
+
+/* One sorted listing taking part in the merge */
+struct list_src {
+    const struct route *rt;
+    const char *ext;        // dispfnames: the type the source's names drop
+    struct s25_peer be;
+    int reused;
+    uint64_t start;         // when the request went out (metrics_now_us)
+    int partial;            // the source's page has more after it
+    uint64_t left;          // reply bytes not read yet
+    char buf[BUF];
+    size_t pos, end;
+    char **names;           // the local listing
+    size_t n, i;
+    char cur[BUF];          // current name, valid while live
+    char key[BUF + 16];     // what it sorts by: the name with its extension
+    int live;
+};
+
+/* Send the listing request to a backend on a pooled connection */
+static int list_request(struct list_src *s, const struct list_query *q){
+    if(q->page && s->be.ver == 1) return 0;     // v1 servers have no pages
+    s->start = metrics_now_us();
+    for(int attempt = 0; attempt < 2; attempt++){
+        s->be.fd = backend_acquire(s->rt, &s->reused);
+        if(s->be.fd < 0) return 0;
+        char backend_dir[PATH_MAX];
+        map_dir_for_backend(q->dir, s->rt->root, backend_dir, sizeof(backend_dir));
+        struct s25_buf b;
+        s25_start(&b, s->be.ver, q->page ? OP_PAGE : OP_LIST, next_reqid());
+        s25_put_str(&b, backend_dir);
+        if(q->page){
+            s25_put_str(&b, q->prefix);
+            s25_put_str(&b, q->cursor);
+            s25_put_u32(&b, q->limit);
+            s25_put_u32(&b, q->options);
+        }
+        s25_sign(&b);
+        s25_finish(&b, 0);
+        if(s25_send_buf(s->be.fd, &b)) return 1;
+        close(s->be.fd);
+        s->be.fd = -1;
+        if(!s->reused) return 0;
+    }
+    return 0;
+}
+
+/* Read the backend's data announcement; a stale pooled connection is
+ * replaced once */
+static int list_reply(struct list_src *s, const struct list_query *q){
+    uint32_t flags;
+    for(int attempt = 0; attempt < 2 && s->be.fd >= 0; attempt++){
+        if(s25_recv_data(&s->be, &s->left, &flags)){
+            s->partial = (flags & S25_F_PARTIAL) != 0;
+            metrics_call(q->page ? OP_PAGE : OP_LIST, s->start);
+            return 1;
+        }
+        close(s->be.fd);
+        s->be.fd = -1;
+        if(!s->reused || !list_request(s, q)) return 0;
+    }
+    return 0;
+}
+
+/* Advance a source to its next name */
+static void list_next(struct list_src *s){
+    size_t len = 0;
+    if(s->rt->backend < 0){
+        if(s->i < s->n) len = snprintf(s->cur, sizeof(s->cur), "%s", s->names[s->i++]);
+        // the local names keep their extension; dispfnames drops it
+        if(s->ext && len >= strlen(s->ext)) s->cur[len - strlen(s->ext)] = '\0';
+    } else {
+        while(1) {
+            if(s->pos == s->end){
+                if(s->left == 0) break;
+                ssize_t r = recv(s->be.fd, s->buf, s->left > BUF ? BUF : s->left, 0);
+                if(r <= 0){
+                    // backend went away mid-listing: the connection is unusable
+                    close(s->be.fd);
+                    s->be.fd = -1;
+                    s->left = 0;
+                    break;
+                }
+                metrics_io(r, 0);
+                s->left -= r;
+                s->pos = 0;
+                s->end = r;
+            }
+            char ch = s->buf[s->pos++];
+            if(ch != '\n'){
+                if(len < sizeof(s->cur) - 1) s->cur[len++] = ch;
+            } else if(len > 0) {
+                break;          // blank lines are skipped
+            }
+        }
+        s->cur[len] = '\0';
+    }
+    s->live = len > 0;
+    snprintf(s->key, sizeof(s->key), "%s%s", s->cur, s->ext ? s->ext : "");
+}
+
+/* Merged output: dispfnames goes out in frames as it fills (v1: one bare
+ * block), a page in a single frame */
+struct list_out {
+    struct s25_peer *cl;
+    int page;
+    char *buf;
+    size_t len, cap;
+    int ok;
+};
+
+static void list_flush(struct list_out *o, uint32_t flags){
+    if(o->ok && o->cl->ver == 2)
+        o->ok = s25_reply_data(o->cl, o->len, flags) && send_all(o->cl->fd, o->buf, o->len);
+    o->len = 0;
+}
+
+static void list_emit(struct list_out *o, const char *name){
+    size_t k = strlen(name) + 1;
+    if(o->len + k > o->cap){
+        size_t cap = o->cap ? o->cap * 2 : LIST_FRAME;
+        while(cap < o->len + k) cap *= 2;
+        char *grown = realloc(o->buf, cap);
+        if(!grown){
+            o->ok = 0;
+            return;
+        }
+        o->buf = grown;
+        o->cap = cap;
+    }
+    memcpy(o->buf + o->len, name, k - 1);
+    o->buf[o->len + k - 1] = '\n';
+    o->len += k;
+    if(!o->page && o->cl->ver == 2 && o->len >= LIST_FRAME) list_flush(o, S25_F_MORE);
+}
+
+/* Reply to dispfnames or listf for q->dir, a directory under ~/S1: S1's
+ * files merged with the backend copies of that directory. Returns 0 if
+ * the client connection can no longer be used. */
+int send_listing(struct s25_peer *cl, const struct list_query *q){
+    struct list_src *src = calloc(route_n, sizeof(*src));
+    if(!src){
+        if(cl->ver == 2) return s25_reply_data(cl, 0, S25_F_ERROR);
+        return 1;
+    }
+    int nsrc = 0;
+    for(int r = 0; r < route_n; r++){
+        // routes to the same backend and root are one listing
+        int dup = 0;
+        for(int k = 0; k < nsrc; k++)
+            dup |= src[k].rt->backend == routes[r].backend && strcmp(src[k].rt->root, routes[r].root) == 0;
+        if(dup) continue;
+        src[nsrc].rt = &routes[r];
+        src[nsrc].ext = q->page ? NULL : routes[r].ext;
+        src[nsrc].be.fd = -1;
+        src[nsrc].be.ver = backend_ver;
+        nsrc++;
+    }
+
+    // Fan out first; the backends work while S1 lists its own directory
+    for(int k = 0; k < nsrc; k++)
+        if(src[k].rt->backend >= 0) list_request(&src[k], q);
+    for(int k = 0; k < nsrc; k++){
+        if(src[k].rt->backend >= 0) continue;
+        if(q->page){
+            src[k].names = index_page(q->dir, q->prefix, q->cursor, q->limit,
+                                      q->options & S25_LIST_RECURSIVE, &src[k].n, &src[k].partial);
+        } else {
+            src[k].names = index_list(q->dir, &src[k].n);
+        }
+    }
+    for(int k = 0; k < nsrc; k++){
+        if(src[k].rt->backend >= 0 && !list_reply(&src[k], q)) continue;
+        list_next(&src[k]);
+    }
+
+    // Merge; a name several sources have (a subdirectory) is listed once
+    struct list_out out = { cl, q->page, NULL, 0, 0, 1 };
+    uint32_t emitted = 0;
+    int more = 0;
+    while(out.ok){
+        struct list_src *min = NULL;
+        for(int k = 0; k < nsrc; k++)
+            if(src[k].live && (!min || strcmp(src[k].key, min->key) < 0)) min = &src[k];
+        if(!min) break;
+        if(q->page && emitted == q->limit){
+            more = 1;
+            break;
+        }
+        list_emit(&out, min->cur);
+        emitted++;
+        for(int k = 0; k < nsrc; k++)
+            if(&src[k] != min && src[k].live && strcmp(src[k].key, min->key) == 0) list_next(&src[k]);
+        list_next(min);
+    }
+    for(int k = 0; k < nsrc; k++) more |= src[k].partial;
+
+    for(int k = 0; k < nsrc; k++){
+        if(src[k].rt->backend < 0){
+            for(size_t i = 0; i < src[k].n; i++) free(src[k].names[i]);
+            free(src[k].names);
+        } else if(src[k].be.fd >= 0) {
+            // the rest of a page is small; a whole listing cut short by a
+            // failed client is not worth draining
+            int done = src[k].left == 0 ||
+                       (q->page && s25_drain(src[k].be.fd, src[k].left));
+            if(done) backend_release(src[k].rt, src[k].be.fd, 1);
+            else close(src[k].be.fd);
+        }
+    }
+    free(src);
+
+    int ok = out.ok;
+    if(cl->ver == 2){
+        list_flush(&out, more ? S25_F_PARTIAL : 0);
+        ok = out.ok;
+    } else if(ok) {
+        ok = send_all(cl->fd, out.buf, out.len);
+    }
+    free(out.buf);
+    return ok;
+}
+
+/* ================= stats =================
+ * S1's own figures followed by every storage server's, fetched with OP_STATS
+ * on a pooled connection. A server that cannot be reached is reported as
+ * such (null in JSON) rather than failing the request.
+ */
+
+/* Append a backend's stats reply in the given format to f; 0 if it could
+ * not be had */
+static int backend_stats(const struct route *rt, uint32_t format, FILE *f){
+    if(backend_ver == 1) return 0;
+    struct s25_peer be = { .fd = backend_acquire(rt, NULL), .ver = backend_ver, .reqid = next_reqid() };
+    if(be.fd < 0) return 0;
+    struct s25_buf b;
+    s25_start(&b, be.ver, OP_STATS, be.reqid);
+    s25_put_u32(&b, format);
+    s25_sign(&b);
+    s25_finish(&b, 0);
+    uint64_t len = 0;
+    uint32_t flags = 0;
+    if(!s25_send_buf(be.fd, &b) || !s25_recv_data(&be, &len, &flags)) {
+        close(be.fd);
+        return 0;
+    }
+    char buf[BUF];
+    uint64_t left = len;
+    while(left > 0){
+        ssize_t n = recv_all(be.fd, buf, left > BUF ? BUF : left);
+        if(n <= 0) break;
+        if(!(flags & S25_F_ERROR)) fwrite(buf, 1, n, f);
+        left -= n;
+    }
+    backend_release(rt, be.fd, left == 0);
+    return left == 0 && !(flags & S25_F_ERROR);
+}
+
+/* Reply to a stats request: a u32 format, S25_STATS_TEXT or S25_STATS_JSON */
+int send_stats(struct s25_peer *cl){
+    uint32_t format;
+    if(!s25_recv_u32(cl, &format)) {
+        return 0;
+    }
+    int json = format == S25_STATS_JSON;
+    char *text = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&text, &len);
+    if(!f) {
+        return s25_reply_data(cl, 0, S25_F_ERROR);
+    }
+    if(json) fputs("{\"s1\":", f);
+    metrics_report(f, json);
+    if(json) fputs(",\"backends\":[", f);
+    for(int i = 0; i < route_nbackends; i++){
+        // Any route to the backend will do for its connection pool
+        const struct route *rt = NULL;
+        for(int j = 0; j < route_n && !rt; j++)
+            if(routes[j].backend == i) rt = &routes[j];
+        const struct route_backend *b = &route_backends[i];
+        if(json) {
+            fprintf(f, "%s{\"node\":\"%s:%d\",\"stats\":", i ? "," : "", b->host, b->port);
+            long mark = ftell(f);
+            if(!rt || !backend_stats(rt, format, f)) {
+                // drop whatever a failed reply left behind
+                fseek(f, mark, SEEK_SET);
+                fprintf(f, "null");
+            }
+            fprintf(f, "}");
+        } else {
+            fprintf(f, "\n--- %s:%d ---\n", b->host, b->port);
+            long mark = ftell(f);
+            if(!rt || !backend_stats(rt, format, f)) {
+                fseek(f, mark, SEEK_SET);
+                fprintf(f, "unreachable\n");
+            }
+        }
+    }
+    if(json) fputs("]}\n", f);
+    fclose(f);
+    int ok = s25_reply_data(cl, len, 0) && send_all(cl->fd, text, len);
+    free(text);
+    return ok;
 }
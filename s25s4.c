@@ -1,4 +1,5 @@
 //s4.c
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,235 +9,483 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <limits.h>
+#include <libgen.h>
 #include <errno.h>
+#include <signal.h>
 
 #define PORT 4404
 #define BUF 4096
 
+#include "s25engine.h"
+#include "s25proto.h"
+#include "s25tar.h"
+#include "s25send.h"
+#include "s25index.h"
+#include "s25commit.h"
+
+// Ready-made TAR reply of the ZIP files, kept current across uploads and removes
+static struct tar_cache archive = TAR_CACHE_INIT;
+
+// Where this server listens and what it stores (-p, -d, -e)
+static int store_port = PORT;
+static char store_root[PATH_MAX];
+static const char *store_ext = ".zip";
+
 void mkdir_p(const char *path);
-ssize_t recv_all(int sock, void *buf, size_t len);
 void remove_extension(char *filename);
+void backend_dir_for(const char *dir, char *out, size_t size);
+int in_store(const char *path);
+int from_s1(struct s25_peer *p, int op, const struct s25_buf *f);
+int reply_names(struct s25_peer *p, char **names, size_t count, int strip, uint32_t flags);
+int serve_request(int c);
+size_t request_head(const char *p, size_t n);
+int handle_request(struct s25_peer *p, int op);
+int store_upload(struct s25_peer *p, const char *dest, uint64_t sz);
+int send_stats(struct s25_peer *p);
+
+int main(int argc, char *argv[]){
+    int workers = 0;
+
+    // -w N: size of the worker pool serving requests, -p PORT: port to
+    // listen on, -d DIR: storage root, -e EXT: the file type stored,
+    // -c MODE: how uploads are made durable (none, sync, group),
+    // -k FILE: key of S1's tokens and signatures (s25token.h),
+    // -t BYTES: largest downltar archive kept ready (s25tar.h)
+    snprintf(store_root, sizeof(store_root), "%s/S4", getenv("HOME"));
+    char key_file[PATH_MAX];
+    snprintf(key_file, sizeof(key_file), "%s/.s25key", getenv("HOME"));
+    int opt_c;
+    while((opt_c = getopt(argc, argv, "w:p:d:e:c:k:t:")) != -1) {
+        switch(opt_c) {
+            case 'w': workers = atoi(optarg); break;
+            case 'p': store_port = atoi(optarg); break;
+            case 'd': snprintf(store_root, sizeof(store_root), "%s", optarg); break;
+            case 'e': store_ext = optarg; break;
+            case 'k': snprintf(key_file, sizeof(key_file), "%s", optarg); break;
+            case 't': archive.max = strtoull(optarg, NULL, 0); break;
+            case 'c':
+                if((commit_mode = commit_parse_mode(optarg)) >= 0) break;
+                // fall through
+            default:
+                fprintf(stderr, "usage: %s [-w workers] [-p port] [-d root] [-e ext] [-c none|sync|group]\n"
+                                "          [-k keyfile] [-t archive-bytes]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(workers <= 0) workers = default_workers();
+    // in_store() matches paths against the root with no trailing slash
+    for(size_t n = strlen(store_root); n > 1 && store_root[n-1] == '/'; n--) store_root[n-1] = 0;
+    crc_init();
+    token_load(key_file);
+    metrics_init("S4");
 
-int main(){
-    int s = socket(AF_INET, SOCK_STREAM, 0), c;
-    struct sockaddr_in a, b;
-    socklen_t blen;
+    // Dual-stack, so S1's routing table may name this server by an IPv4
+    // or an IPv6 address
+    int s = socket(AF_INET6, SOCK_STREAM, 0);
+    struct sockaddr_in6 a = { 0 };
     
     // Allow socket reuse
-    int opt = 1;
+    int opt = 1, v6only = 0;
     setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
     
-    a.sin_family = AF_INET;
-    a.sin_port = htons(PORT);
-    a.sin_addr.s_addr = INADDR_ANY;
+    a.sin6_family = AF_INET6;
+    a.sin6_port = htons(store_port);
+    a.sin6_addr = in6addr_any;
     
     if(bind(s, (struct sockaddr*)&a, sizeof(a)) < 0){ 
         perror("S4 bind failed"); 
         return 1; 
     }
     
-    listen(s, 5);
-    printf("S4 (ZIP server) running on port %d\n", PORT);
+    listen(s, SOMAXCONN);
+    printf("S4 (%s server) running on port %d with %d workers, storing in %s\n",
+           store_ext, store_port, workers, store_root);
 
     // ensure base dir exists
-    char base[PATH_MAX]; 
-    snprintf(base, sizeof(base), "%s/S4", getenv("HOME"));
-    mkdir_p(base);
-
-    while(1){
-        blen = sizeof(b);
-        c = accept(s, (struct sockaddr*)&b, &blen);
-        if(c < 0){ 
-            perror("S4 accept failed"); 
-            continue; 
+    mkdir_p(store_root);
+
+    // Sorted index of the stored names, kept across restarts; one per port
+    // so servers sharing a $HOME keep apart
+    char index_path[PATH_MAX];
+    snprintf(index_path, sizeof(index_path), "%s/.s25index", getenv("HOME"));
+    mkdir_p(index_path);
+    snprintf(index_path + strlen(index_path), sizeof(index_path) - strlen(index_path),
+             "/%d", store_port);
+    index_open(index_path, store_ext);
+
+    // A client that disconnects mid-transfer must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    return run_engine(s, workers, serve_request, request_head);
+}
+
+/* How much of a request the epoll engine waits for before running it: an
+ * upload's fields up to its contents, all of anything else */
+size_t request_head(const char *p, size_t n){
+    if((unsigned char)p[0] == S25_MAGIC_HI) {
+        struct s25_hdr h;
+        if(n < S25_HDR_LEN) return S25_HDR_LEN;
+        if(!s25_parse_hdr(p, &h)) return n;     // rejected as soon as it runs
+        if(h.opcode == OP_UPLOAD)
+            return s25_fields_end(p, n, 2, S25_HDR_LEN, h.flags & S25_F_SIGNED ? "ssllll" : "ssl");
+        if(h.opcode == OP_TPUT) return s25_fields_end(p, n, 2, S25_HDR_LEN, "slll");
+        return S25_HDR_LEN + h.len;
+    }
+
+    // v1: a BUF-byte command frame, then the command's fields
+    if(n < BUF) return BUF;
+    char cmd[BUF];
+    memcpy(cmd, p, BUF);
+    cmd[BUF-1] = 0;
+    switch(s25_v1_opcode(cmd)) {
+        case OP_UPLOAD: return s25_fields_end(p, n, 1, BUF, "ssl");
+        case OP_GET:
+        case OP_REMOVE:
+        case OP_LIST: return s25_fields_end(p, n, 1, BUF, "s");
+    }
+    return BUF;
+}
+
+/* Handle one request on connection c (runs on a worker thread), in either
+ * protocol version. Returns 1 when the connection is still in sync for
+ * another command. */
+int serve_request(int c){
+    unsigned char first;
+    ssize_t r = recv(c, &first, 1, MSG_PEEK | MSG_DONTWAIT);
+    if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 1;
+    }
+    if(r <= 0) {
+        return 0;
+    }
+
+    struct s25_peer p = { .fd = c, .ver = 1 };
+    if(first == S25_MAGIC_HI) {
+        struct s25_hdr h;
+        if(!s25_recv_hdr(c, &h)) {
+            return 0;
+        }
+        p.ver = 2;
+        p.reqid = h.reqid;
+        p.flags = h.flags;
+        if(h.opcode != OP_STATS && (h.opcode < OP_UPLOAD || h.opcode > OP_TGET)) {
+            return s25_drain(c, h.len) && s25_reply_status(&p, 0);
         }
+        uint64_t start = metrics_now_us();
+        int keep = handle_request(&p, h.opcode);
+        metrics_command(h.opcode, start);
+        return keep;
+    }
 
-        char cmd[BUF], path[BUF], dir[BUF], buf[BUF];
-        memset(cmd, 0, BUF);
-        memset(path, 0, BUF);
-        memset(dir, 0, BUF);
-        
-        if(recv_all(c, cmd, BUF) <= 0) {
-            close(c);
-            continue;
+    char cmd[BUF];
+    if(recv_all(c, cmd, BUF) <= 0) {
+        return 0;
+    }
+    cmd[BUF-1] = 0;
+    int op = s25_v1_opcode(cmd);
+    if(op < OP_UPLOAD || op > OP_PAGE) {
+        return 1;
+    }
+    uint64_t start = metrics_now_us();
+    int keep = handle_request(&p, op);
+    metrics_command(op, start);
+    return keep;
+}
+
+/* Run one backend command */
+int handle_request(struct s25_peer *p, int op){
+    char path[BUF], dir[BUF];
+    int c = p->fd;
+
+    // ========= upload =========
+    if(op == OP_UPLOAD) {
+        // receive destination directory
+        if(!s25_recv_str(p, dir, BUF)) {
+            return 0;
         }
 
-        // ========= upload =========
-        if(strncmp(cmd, "upload", 6) == 0) {
-            // receive destination directory
-            if(recv_all(c, dir, BUF) <= 0) {
-                close(c);
-                continue;
-            }
-            mkdir_p(dir);
+        // receive filename
+        if(!s25_recv_str(p, path, BUF)) {
+            return 0;
+        }
 
-            // receive filename
-            if(recv_all(c, path, BUF) <= 0) {
-                close(c);
-                continue;
-            }
+        // receive file size
+        uint64_t sz;
+        if(!s25_recv_u64(p, &sz)) { 
+            return 0; 
+        }
 
-            // receive file size
-            int sz;
-            if(recv_all(c, &sz, sizeof(int)) <= 0) { 
-                close(c); 
-                continue; 
-            }
+        struct s25_buf fields;
+        s25_fields(&fields, p->ver);
+        s25_put_str(&fields, dir);
+        s25_put_str(&fields, path);
+        s25_put_u64(&fields, sz);
+        if(!from_s1(p, op, &fields)) {
+            return 0;
+        }
 
-            if(sz <= 0) {
-                close(c);
-                continue;
-            }
+        if(sz == 0) {
+            return s25_reply_status(p, 0);
+        }
 
-            // build destination full path
-            char dest[PATH_MAX]; 
-            snprintf(dest, sizeof(dest), "%s/%s", dir, path);
-
-            int f = open(dest, O_CREAT | O_WRONLY | O_TRUNC, 0666);
-            if(f < 0) {
-                // Still need to receive the data to keep protocol in sync
-                char tmp[BUF];
-                int left = sz;
-                while(left > 0) {
-                    int n = recv(c, tmp, left > BUF ? BUF : left, 0);
-                    if(n <= 0) break;
-                    left -= n;
-                }
-                close(c);
-                continue;
+        // build destination full path; the contents are not wanted
+        // anywhere else, so refuse and drop the connection
+        char dest[PATH_MAX]; 
+        snprintf(dest, sizeof(dest), "%s/%s", dir, path);
+        if(!in_store(dest)) {
+            s25_reply_status(p, 0);
+            return 0;
+        }
+        mkdir_p(dir);
+        return store_upload(p, dest, sz);
+    }
+    // ========= upload sent here by S1 =========
+    else if(op == OP_TPUT) {
+        uint64_t sz;
+        struct s25_token tk;
+        if(!s25_recv_str(p, path, BUF) || !s25_recv_u64(p, &sz) || !s25_recv_token(p, &tk)) {
+            return 0;
+        }
+        // The token names the full path and size; without a valid one the
+        // contents are not wanted, so refuse and drop the connection
+        if(sz == 0 || !token_check(&tk, OP_TPUT, path, sz) || !in_store(path)) {
+            s25_reply_status(p, 0);
+            return 0;
+        }
+        snprintf(dir, sizeof(dir), "%s", path);
+        mkdir_p(dirname(dir));
+        return store_upload(p, path, sz);
+    }
+    // ========= get =========
+    else if(op == OP_GET || op == OP_TAR || op == OP_TGET) {
+        if(op != OP_TAR && !s25_recv_str(p, path, BUF)) {
+            return 0;
+        }
+        struct s25_token tk;
+        if(op == OP_TGET && !s25_recv_token(p, &tk)) {
+            return 0;
+        }
+        // ranged get: the path is followed by an offset and a length
+        uint64_t off = 0, want = 0;
+        if(op != OP_TAR && (p->flags & S25_F_RANGE) &&
+           (!s25_recv_u64(p, &off) || !s25_recv_u64(p, &want))) {
+            return 0;
+        }
+        if(op == OP_TGET && !token_check(&tk, OP_TGET, path, 0)) {
+            return s25_reply_data(p, 0, S25_F_ERROR);
+        }
+        if(op != OP_TGET) {
+            struct s25_buf fields;
+            s25_fields(&fields, p->ver);
+            if(op != OP_TAR) s25_put_str(&fields, path);
+            if(op != OP_TAR && (p->flags & S25_F_RANGE)) {
+                s25_put_u64(&fields, off);
+                s25_put_u64(&fields, want);
             }
-
-            int left = sz;
-            while(left > 0){
-                int n = recv(c, buf, left > BUF ? BUF : left, 0);
-                if(n <= 0) break;
-                write(f, buf, n);
-                left -= n;
+            if(!from_s1(p, op, &fields)) {
+                return 0;
             }
-            close(f);
         }
-        // ========= get =========
-        else if(strncmp(cmd, "get", 3) == 0) {
-            if(recv_all(c, path, BUF) <= 0) {
-                close(c);
-                continue;
+        
+        if(op == OP_TAR || (op == OP_GET && strcmp(path, "TAR") == 0)) {
+            return send_tar(p, &archive, store_root, store_ext);
+        } else if(!in_store(path)) {
+            return s25_reply_data(p, 0, S25_F_ERROR);
+        } else {
+            int f = open(path, O_RDONLY);
+            if(f < 0){ 
+                return s25_reply_data(p, 0, S25_F_ERROR);
             }
-            
-            if(strcmp(path, "TAR") == 0) {
-                char cmdline[PATH_MAX*2];
-                snprintf(cmdline, sizeof(cmdline),
-                         "find %s/S4 -type f -name \"*.zip\" -print0 2>/dev/null | tar -cf /tmp/zip.tar --null -T - 2>/dev/null",
-                         getenv("HOME"));
-                system(cmdline);
-                
-                int f = open("/tmp/zip.tar", O_RDONLY);
-                if(f < 0){ 
-                    int z=0; 
-                    send(c, &z, sizeof(int), 0); 
-                    close(c); 
-                    continue; 
-                }
-                int sz = lseek(f, 0, SEEK_END); 
-                lseek(f, 0, SEEK_SET);
-                send(c, &sz, sizeof(int), 0);
-                
-                int rd;
-                while((rd = read(f, buf, BUF)) > 0) {
-                    send(c, buf, rd, 0);
-                }
-                close(f); 
-                remove("/tmp/zip.tar");
-            } else {
-                int f = open(path, O_RDONLY);
-                if(f < 0){ 
-                    int z=0; 
-                    send(c, &z, sizeof(int), 0); 
-                    close(c); 
-                    continue; 
-                }
-                int sz = lseek(f, 0, SEEK_END); 
-                lseek(f, 0, SEEK_SET);
-                send(c, &sz, sizeof(int), 0);
-                
-                int rd;
-                while((rd = read(f, buf, BUF)) > 0) {
-                    send(c, buf, rd, 0);
-                }
+            off_t sz = lseek(f, 0, SEEK_END); 
+            if(sz < 0 || !s25_can_carry(p, sz)){
                 close(f);
-            }
-        }
-        // ========= remove =========
-        else if(strncmp(cmd, "remove", 6) == 0) {
-            if(recv_all(c, path, BUF) <= 0) {
-                close(c);
-                continue;
+                return s25_reply_data(p, 0, S25_F_ERROR);
             }
             
-            remove(path);
+            // a failed send leaves the peer waiting for bytes: drop the connection
+            int sent = send_object(p, f, sz, off, want);
+            close(f);
+            return sent;
         }
-        // ========= list =========
-        else if(strncmp(cmd, "list", 4) == 0) {
-            if(recv_all(c, dir, BUF) <= 0) {
-                close(c);
-                continue;
-            }
-            
-            const char *home = getenv("HOME");
-            char s1_prefix[PATH_MAX];
-            snprintf(s1_prefix, sizeof(s1_prefix), "%s/S1", home);
-
-            char backend_dir[PATH_MAX];
-            if(strncmp(dir, s1_prefix, strlen(s1_prefix)) == 0) {
-                snprintf(backend_dir, sizeof(backend_dir), "%s/S4%s",
-                         home, dir + strlen(s1_prefix));
-            } else {
-                snprintf(backend_dir, sizeof(backend_dir), "%s/S4", home);
-            }
+    }
 
-            // Collect .zip files (names only, no extensions)
-            DIR *d = opendir(backend_dir);
-            char *files[1024];
-            int count = 0;
-            char tmp[BUF] = "";
-            
-            if(d) {
-                struct dirent *de;
-                while((de = readdir(d)) != NULL) {
-                    if(de->d_type == DT_REG && strstr(de->d_name, ".zip")) {
-                        char *name_copy = strdup(de->d_name);
-                        remove_extension(name_copy);
-                        files[count++] = name_copy;
-                        if(count >= 1024) break; // prevent overflow
-                    }
-                }
-                closedir(d);
-                
-                // sort alphabetically
-                for(int i = 0; i < count-1; i++) {
-                    for(int j = i+1; j < count; j++) {
-                        if(strcmp(files[i], files[j]) > 0) {
-                            char *temp = files[i];
-                            files[i] = files[j];
-                            files[j] = temp;
-                        }
-                    }
-                }
-                      
-                for(int i=0; i<count; i++){
-                    strcat(tmp, files[i]);
-                    strcat(tmp, "\n");
-                    free(files[i]);
-                }
-            }
-            
-            send(c, tmp, strlen(tmp), 0);
+    // ========= remove =========
+    else if(op == OP_REMOVE) {
+        if(!s25_recv_str(p, path, BUF)) {
+            return 0;
+        }
+        struct s25_buf fields;
+        s25_fields(&fields, p->ver);
+        s25_put_str(&fields, path);
+        if(!from_s1(p, op, &fields)) {
+            return 0;
         }
         
-        close(c);
+        int ok = in_store(path) && remove(path) == 0;
+        if(ok) tar_cache_touch(&archive);
+        if(ok) index_update(path, 0);
+        return s25_reply_status(p, ok);
     }
+    // ========= list =========
+    else if(op == OP_LIST) {
+        if(!s25_recv_str(p, dir, BUF)) {
+            return 0;
+        }
+        struct s25_buf fields;
+        s25_fields(&fields, p->ver);
+        s25_put_str(&fields, dir);
+        if(!from_s1(p, op, &fields)) {
+            return 0;
+        }
+        
+        char backend_dir[PATH_MAX];
+        backend_dir_for(dir, backend_dir, sizeof(backend_dir));
+
+        // Names come from the index, already sorted for S1's merge
+        size_t count = 0;
+        char **files = index_list(backend_dir, &count);
+        return reply_names(p, files, count, 1, 0);
+    }
+    // ========= page =========
+    else if(op == OP_PAGE) {
+        char prefix[BUF], cursor[BUF];
+        uint32_t limit, options;
+        if(!s25_recv_str(p, dir, BUF) || !s25_recv_str(p, prefix, BUF) ||
+           !s25_recv_str(p, cursor, BUF) || !s25_recv_u32(p, &limit) ||
+           !s25_recv_u32(p, &options)) {
+            return 0;
+        }
+        struct s25_buf fields;
+        s25_fields(&fields, p->ver);
+        s25_put_str(&fields, dir);
+        s25_put_str(&fields, prefix);
+        s25_put_str(&fields, cursor);
+        s25_put_u32(&fields, limit);
+        s25_put_u32(&fields, options);
+        if(!from_s1(p, op, &fields)) {
+            return 0;
+        }
+        if(limit == 0 || limit > S25_PAGE_MAX) limit = S25_PAGE_MAX;
+
+        char backend_dir[PATH_MAX];
+        backend_dir_for(dir, backend_dir, sizeof(backend_dir));
+
+        size_t count = 0;
+        int more = 0;
+        char **names = index_page(backend_dir, prefix, cursor, limit,
+                                  options & S25_LIST_RECURSIVE, &count, &more);
+        return reply_names(p, names, count, 0, more ? S25_F_PARTIAL : 0);
+    }
+    // ========= ping =========
+    else if(op == OP_PING) {
+        // health check from S1's connection pool
+        struct s25_buf fields;
+        s25_fields(&fields, p->ver);
+        if(!from_s1(p, op, &fields)) {
+            return 0;
+        }
+        if(p->ver == 1) {
+            int pong = 1;
+            return send_all(c, &pong, sizeof(int));
+        }
+        return s25_reply_status(p, 1);
+    }
+
+    // ========= stats =========
+    else if(op == OP_STATS) {
+        return send_stats(p);
+    }
+    
+    // keep the connection open for the next command
+    return 1;
+}
+
+/* Receive the sz bytes of an upload into dest and acknowledge them. They
+ * are written to a temporary file and published whole, tagged with the CRC
+ * of what arrived (checked against the sender's if it sent one). Returns 0
+ * if the connection can no longer be used. */
+int store_upload(struct s25_peer *p, const char *dest, uint64_t sz){
+    struct commit_file cf;
+    struct s25_file file = { .fd = commit_open(&cf, dest) };
+    int st = s25_recv_file(p, sz, &file);
+    if(st == 1) crc_save(file.fd, file.crc, sz);
+    int published = commit_close(&cf, st == 1);
+    if(published) {
+        tar_cache_touch(&archive);
+        index_update(dest, 1);
+    }
+    return st >= 0 && s25_reply_status(p, published == 1);
+}
+
+/* The directory to list for dir: S1 sends paths already mapped under the
+ * storage root; older ones send their ~/S1 path, which is mapped here.
+ * Anything else, or anything climbing out with "..", lists the root itself. */
+void backend_dir_for(const char *dir, char *out, size_t size) {
+    const char *home = getenv("HOME");
+    char s1_prefix[PATH_MAX];
+    snprintf(s1_prefix, sizeof(s1_prefix), "%s/S1", home);
+    size_t n = strlen(store_root);
+
+    if(strncmp(dir, store_root, n) == 0 && (dir[n] == '/' || dir[n] == '\0')) {
+        snprintf(out, size, "%s", dir);
+    } else if(strncmp(dir, s1_prefix, strlen(s1_prefix)) == 0) {
+        snprintf(out, size, "%s%s", store_root, dir + strlen(s1_prefix));
+    } else {
+        snprintf(out, size, "%s", store_root);
+    }
+    if(strcmp(out, store_root) != 0 && !in_store(out)) {
+        snprintf(out, size, "%s", store_root);
+    }
+}
+
+/* Is path a file under the storage root? S1 names every file it stores
+ * by a path already mapped there; anything else, or any ".." that could
+ * climb out of it, is refused. */
+int in_store(const char *path){
+    size_t n = strlen(store_root);
+    if(strncmp(path, store_root, n) != 0 || path[n] != '/') return 0;
+    for(const char *s = path + n; s; s = strchr(s + 1, '/')) {
+        if(strncmp(s, "/..", 3) == 0 && (s[3] == '/' || s[3] == '\0')) return 0;
+    }
+    return 1;
+}
+
+/* Check the signature that ends the fields of a request from S1, f being
+ * those fields as S1 encoded them (s25proto.h). With a key only signed
+ * requests run; without one any does, as there is nothing to check them
+ * against. Returns 0, having refused the request, when the connection
+ * must be dropped. */
+int from_s1(struct s25_peer *p, int op, const struct s25_buf *f){
+    int sig = s25_recv_sig(p, op, f);
+    if(sig < 0) return 0;
+    if(sig || !token_ready) return 1;
+    s25_reply_status(p, 0);
     return 0;
 }
 
+/* Reply with a list of names, one per line, optionally without their
+ * extensions. Frees the names. */
+int reply_names(struct s25_peer *p, char **names, size_t count, int strip, uint32_t flags) {
+    size_t len = 0;
+    for(size_t i = 0; i < count; i++) len += strlen(names[i]) + 1;
+    char *out = malloc(len + 1);
+    size_t used = 0;
+    for(size_t i = 0; i < count; i++){
+        if(strip) remove_extension(names[i]);
+        if(out) used += sprintf(out + used, "%s\n", names[i]);
+        free(names[i]);
+    }
+    free(names);
+
+    // length-prefixed so the connection can carry further commands
+    if(!out) {
+        return s25_reply_data(p, 0, flags);
+    }
+    int sent = s25_reply_data(p, used, flags) && send_all(p->fd, out, used);
+    free(out);
+    return sent;
+}
+
 /* Remove file extension from filename */
 void remove_extension(char *filename) {
     char *dot = strrchr(filename, '.');
@@ -245,15 +494,27 @@ void remove_extension(char *filename) {
     }
 }
 
-/* Reliable recv for fixed-size data */
-ssize_t recv_all(int sock, void *buf, size_t len){
-    size_t recvd = 0;
-    while(recvd < len){
-        ssize_t r = recv(sock, (char*)buf + recvd, len - recvd, 0);
-        if(r <= 0) return r;
-        recvd += r;
+/* Reply to a stats request with this server's figures, as text or JSON */
+int send_stats(struct s25_peer *p){
+    uint32_t format;
+    if(!s25_recv_u32(p, &format)) {
+        return 0;
+    }
+    struct s25_buf fields;
+    s25_fields(&fields, p->ver);
+    s25_put_u32(&fields, format);
+    if(!from_s1(p, OP_STATS, &fields)) {
+        return 0;
     }
-    return recvd;
+    char *text = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&text, &len);
+    int ok = f && metrics_report(f, format == S25_STATS_JSON);
+    if(f) fclose(f);
+    ok = ok ? s25_reply_data(p, len, 0) && send_all(p->fd, text, len)
+            : s25_reply_data(p, 0, S25_F_ERROR);
+    free(text);
+    return ok;
 }
 
 /* mkdir -p equivalent */
@@ -0,0 +1,117 @@
+//s25send.h
+/* ================= object replies =================
+ * Sending stored files and type archives to a peer, shared by S1 (for its
+ * local files) and the storage servers: the reply header, then the bytes
+ * straight from the page cache with sendfile(), in large-object mode and
+ * with the stored CRC when the request asks for them.
+ */
+#ifndef S25SEND_H
+#define S25SEND_H
+
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/sendfile.h>
+#include "s25proto.h"
+#include "s25tar.h"
+
+#define SENDFILE_MAX (1 << 30)  // bytes per sendfile() call
+
+/* Copy len bytes of fd starting at off to a socket with sendfile(), so the
+ * data never passes through user space. Short transfers are resumed from
+ * where they stopped; filesystems without sendfile support fall back to a
+ * pread/send loop. Returns 1 when all len bytes were sent. */
+static int send_file(int sock, int fd, off_t off, off_t len){
+    off_t end = off + len;
+    while(off < end){
+        size_t want = (end - off) > SENDFILE_MAX ? SENDFILE_MAX : (size_t)(end - off);
+        ssize_t w = sendfile(sock, fd, &off, want);
+        if(w > 0) {
+            metrics_io(0, w);
+            continue;
+        }
+        if(w == 0) return 0;                // file shrank underneath us
+        if(errno == EINTR) continue;
+        if(errno != EINVAL && errno != ENOSYS) return 0;
+
+        // No sendfile for this fd: copy the rest through a buffer
+        char buf[BUF];
+        while(off < end){
+            size_t n = (end - off) > BUF ? BUF : (size_t)(end - off);
+            ssize_t rd = pread(fd, buf, n, off);
+            if(rd < 0 && errno == EINTR) continue;
+            if(rd <= 0 || !send_all(sock, buf, rd)) return 0;
+            off += rd;
+        }
+    }
+    return 1;
+}
+
+static int file_payload(void *ctx, int sock, uint64_t off, uint64_t len){
+    struct s25_file *file = ctx;
+    return send_file(sock, file->fd, file->base + off, len);
+}
+
+/* Reply to a download item or get with len bytes of f (a file of size
+ * bytes) starting at off; len 0 means "to the end". Objects larger than one
+ * chunk go out in large-object mode when the request asked for it; a whole
+ * file goes with the CRC it was stored with if the request wants checksums.
+ * Returns 0 if the connection can no longer be used. */
+static int send_object(struct s25_peer *p, int f, uint64_t size, uint64_t off, uint64_t len){
+    s25_clamp_range(size, &off, &len);
+    uint32_t crc = 0, flags = 0;
+    if((p->flags & S25_F_CRC) && len > 0 && len == size && crc_load(f, size, &crc)) flags = S25_F_CRC;
+    int ok;
+    if((p->flags & S25_F_CHUNKED) && len > S25_CHUNK) {
+        struct s25_file file = { .fd = f, .base = off };
+        ok = s25_reply_object(p, size, len, flags | S25_F_CHUNKED) &&
+             s25_send_chunked(p, len, file_payload, &file) >= 0;
+    } else {
+        ok = s25_reply_object(p, size, len, flags) && send_file(p->fd, f, off, len);
+    }
+    return ok && (!flags || s25_send_crc(p->fd, crc));
+}
+
+/* Reply with a tar archive of the files under root whose names end in
+ * suffix, from the cached archive when there is one. Otherwise the archive
+ * is generated while it is sent, so the first bytes go out as soon as the
+ * tree has been walked. Returns 0 if the connection can no longer be used. */
+static int send_tar(struct s25_peer *p, struct tar_cache *cache, const char *root, const char *suffix){
+    struct tar_cached a;
+    uint64_t total;
+    long members = cache ? tar_cache_get(cache, root, suffix, &a.fd, &total) : -1;
+    if(members >= 0) {
+        if(members == 0 || !s25_can_carry(p, total)) {
+            close(a.fd);
+            return s25_reply_data(p, 0, S25_F_ERROR);
+        }
+        a.members = total - 2 * TAR_BLOCK;
+        int ok;
+        if((p->flags & S25_F_CHUNKED) && total > S25_CHUNK) {
+            ok = s25_reply_data(p, total, S25_F_CHUNKED) &&
+                 s25_send_chunked(p, total, tar_cached_payload, &a) >= 0;
+        } else {
+            ok = s25_reply_data(p, total, 0) && tar_cached_payload(&a, p->fd, 0, total);
+        }
+        close(a.fd);
+        return ok;
+    }
+
+    struct tar_stream ts;
+    if(!tar_open(&ts, root, suffix) || ts.n == 0 || !s25_can_carry(p, ts.total)) {
+        tar_close(&ts);
+        return s25_reply_data(p, 0, S25_F_ERROR);
+    }
+    int ok;
+    if((p->flags & S25_F_CHUNKED) && ts.total > S25_CHUNK) {
+        ok = s25_reply_data(p, ts.total, S25_F_CHUNKED) &&
+             s25_send_chunked(p, ts.total, tar_payload, &ts) >= 0;
+    } else {
+        ok = s25_reply_data(p, ts.total, 0) && tar_send(&ts, p->fd, ts.total);
+    }
+    tar_close(&ts);
+    return ok;
+}
+
+#endif
@@ -0,0 +1,591 @@
+//s25tar.h
+/* ================= streaming tar writer =================
+ * Builds a tar archive of every regular file under a directory whose name
+ * ends in a given suffix, and streams it straight to a socket: no shell,
+ * no temporary archive. The tree is walked once up front for names and
+ * sizes only, so the exact archive length is known before the first byte
+ * goes out; file contents are then sent with sendfile() as the stream
+ * reaches them.
+ *
+ * Members are named like tar names them for the same absolute paths (the
+ * leading '/' dropped). Names too long for a ustar header use a GNU
+ * ././@LongLink record, sizes of 8 GiB and more the GNU base-256 encoding.
+ */
+#ifndef S25TAR_H
+#define S25TAR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include "s25metrics.h"
+
+#define TAR_BLOCK 512
+#define TAR_HDR_MAX (2 * TAR_BLOCK + PATH_MAX + TAR_BLOCK)  // longlink + header
+
+/* One file going into the archive */
+struct tar_entry {
+    char *path;
+    uint64_t size;
+    time_t mtime;
+    long mtime_ns;          // tells rewrites within one second apart
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    uint64_t hdr_len;       // header blocks in front of the contents
+    uint64_t at;            // where the member starts in a cached archive
+};
+
+/* An archive being streamed: the member list and a cursor into it */
+struct tar_stream {
+    struct tar_entry *ents;
+    size_t n, cap;
+    uint64_t total;         // archive length, trailer included
+    size_t cur;             // member the cursor is in (n = the trailer)
+    uint64_t pos;           // offset inside that member
+    int fd;                 // contents of the current member, once reached
+    char hdr[TAR_HDR_MAX];  // header blocks of the current member
+};
+
+static uint64_t tar_round(uint64_t n){
+    return (n + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+}
+
+/* Member name: the path without its leading '/' */
+static const char *tar_name(const struct tar_entry *e){
+    const char *p = e->path;
+    while(*p == '/') p++;
+    return p;
+}
+
+/* Where a ustar header splits a long name into prefix and name, or -1 if
+ * it does not fit and needs a LongLink record */
+static int tar_split(const char *name){
+    size_t len = strlen(name);
+    if(len <= 100) return 0;
+    for(const char *s = name + len - 101; s < name + len; s++){
+        if(*s == '/' && s - name <= 155 && s > name) return (int)(s - name);
+    }
+    return -1;
+}
+
+static uint64_t tar_hdr_len(const char *name){
+    if(tar_split(name) >= 0) return TAR_BLOCK;
+    return 2 * TAR_BLOCK + tar_round(strlen(name) + 1);
+}
+
+/* Append a member to the list; the list takes over e->path */
+static int tar_push(struct tar_stream *ts, const struct tar_entry *e){
+    if(ts->n == ts->cap){
+        size_t cap = ts->cap ? ts->cap * 2 : 64;
+        struct tar_entry *ents = realloc(ts->ents, cap * sizeof(*ents));
+        if(!ents) return 0;
+        ts->ents = ents;
+        ts->cap = cap;
+    }
+    ts->ents[ts->n++] = *e;
+    ts->total += e->hdr_len + tar_round(e->size);
+    return 1;
+}
+
+static int tar_add(struct tar_stream *ts, const char *path, const struct stat *st){
+    struct tar_entry e;
+    if(!(e.path = strdup(path))) return 0;
+    e.size = st->st_size;
+    e.mtime = st->st_mtim.tv_sec;
+    e.mtime_ns = st->st_mtim.tv_nsec;
+    e.mode = st->st_mode & 07777;
+    e.uid = st->st_uid;
+    e.gid = st->st_gid;
+    e.hdr_len = tar_hdr_len(tar_name(&e));
+    e.at = 0;
+    if(!tar_push(ts, &e)){
+        free(e.path);
+        return 0;
+    }
+    return 1;
+}
+
+/* Collect the regular files under dir whose names end in suffix, without
+ * following symlinks (like find -type f). Returns 0 if out of memory. */
+static int tar_walk(struct tar_stream *ts, const char *dir, const char *suffix){
+    DIR *d = opendir(dir);
+    if(!d) return 1;    // unreadable directories are skipped, as find does
+    size_t slen = strlen(suffix);
+    struct dirent *de;
+    int ok = 1;
+    while(ok && (de = readdir(d)) != NULL){
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        char path[PATH_MAX];
+        if(snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >= (int)sizeof(path)) continue;
+
+        struct stat st;
+        if(de->d_type != DT_DIR && de->d_type != DT_REG && de->d_type != DT_UNKNOWN) continue;
+        if(lstat(path, &st) < 0) continue;
+        if(S_ISDIR(st.st_mode)){
+            ok = tar_walk(ts, path, suffix);
+        } else if(S_ISREG(st.st_mode)){
+            size_t nlen = strlen(de->d_name);
+            if(nlen >= slen && strcmp(de->d_name + nlen - slen, suffix) == 0)
+                ok = tar_add(ts, path, &st);
+        }
+    }
+    closedir(d);
+    return ok;
+}
+
+/* An empty archive: no members, just the end-of-archive marker */
+static void tar_stream_init(struct tar_stream *ts){
+    memset(ts, 0, sizeof(*ts));
+    ts->fd = -1;
+    ts->total = 2 * TAR_BLOCK;
+}
+
+/* Prepare an archive of the files under root ending in suffix. Returns 0
+ * if out of memory; ts->n is the number of members found. */
+static int tar_open(struct tar_stream *ts, const char *root, const char *suffix){
+    tar_stream_init(ts);
+    return tar_walk(ts, root, suffix);
+}
+
+static void tar_close(struct tar_stream *ts){
+    if(ts->fd >= 0) close(ts->fd);
+    for(size_t i = 0; i < ts->n; i++) free(ts->ents[i].path);
+    free(ts->ents);
+    ts->ents = NULL;
+    ts->n = ts->cap = 0;
+    ts->fd = -1;
+}
+
+/* Octal numeric field, or GNU base-256 when the value does not fit */
+static void tar_num(char *field, size_t width, uint64_t v){
+    if(v < (1ULL << (3 * (width - 1)))){
+        field[width - 1] = '\0';
+        for(size_t i = width - 1; i > 0; i--, v >>= 3) field[i - 1] = (char)('0' + (v & 7));
+        return;
+    }
+    memset(field, 0, width);
+    field[0] = (char)0x80;
+    for(size_t i = width - 1; i > 0 && v; i--, v >>= 8) field[i] = (char)(v & 0xff);
+}
+
+static void tar_block(char *b, const char *name, size_t namelen, const char *prefix,
+                      size_t prefixlen, uint64_t size, const struct tar_entry *e, char type){
+    memset(b, 0, TAR_BLOCK);
+    memcpy(b, name, namelen);
+    tar_num(b + 100, 8, e->mode);
+    tar_num(b + 108, 8, e->uid);
+    tar_num(b + 116, 8, e->gid);
+    tar_num(b + 124, 12, size);
+    tar_num(b + 136, 12, e->mtime < 0 ? 0 : (uint64_t)e->mtime);
+    b[156] = type;
+    memcpy(b + 257, "ustar", 6);
+    memcpy(b + 263, "00", 2);
+    memcpy(b + 345, prefix, prefixlen);
+
+    // checksum is computed with its own field taken as spaces
+    memset(b + 148, ' ', 8);
+    unsigned sum = 0;
+    for(int i = 0; i < TAR_BLOCK; i++) sum += (unsigned char)b[i];
+    snprintf(b + 148, 8, "%06o", sum);
+}
+
+/* Render the header blocks of member e into hdr (e->hdr_len bytes) */
+static void tar_header(char *hdr, const struct tar_entry *e){
+    const char *name = tar_name(e);
+    size_t len = strlen(name);
+    int split = tar_split(name);
+    char *b = hdr;
+    if(split < 0){
+        // GNU long name: a pseudo-member whose contents are the real name
+        tar_block(b, "././@LongLink", 13, "", 0, len + 1, e, 'L');
+        memset(b + TAR_BLOCK, 0, tar_round(len + 1));
+        memcpy(b + TAR_BLOCK, name, len);
+        b += TAR_BLOCK + tar_round(len + 1);
+        tar_block(b, name, 100, "", 0, e->size, e, '0');
+    } else if(split == 0){
+        tar_block(b, name, len, "", 0, e->size, e, '0');
+    } else {
+        tar_block(b, name + split + 1, len - split - 1, name, split, e->size, e, '0');
+    }
+}
+
+/* Write n zero bytes to a socket or file */
+static int tar_zeros(int sock, uint64_t n){
+    static const char zero[TAR_BLOCK * 8];
+    while(n > 0){
+        size_t k = n > sizeof(zero) ? sizeof(zero) : n;
+        ssize_t w = write(sock, zero, k);
+        if(w < 0 && errno == EINTR) continue;
+        if(w <= 0) return 0;
+        n -= w;
+    }
+    return 1;
+}
+
+static int tar_bytes(int sock, const char *p, uint64_t n){
+    while(n > 0){
+        ssize_t w = write(sock, p, n);
+        if(w < 0 && errno == EINTR) continue;
+        if(w <= 0) return 0;
+        p += w;
+        n -= w;
+    }
+    return 1;
+}
+
+/* Send len bytes of member contents from offset off. A file that shrank
+ * or vanished since the walk is padded with zeros so the archive keeps the
+ * length that was announced. */
+static int tar_contents(int sock, int fd, uint64_t off, uint64_t len){
+    off_t o = off;
+    while(len > 0 && fd >= 0){
+        ssize_t w = sendfile(sock, fd, &o, len > (1 << 30) ? (1 << 30) : len);
+        if(w < 0 && errno == EINTR) continue;
+        if(w < 0 && (errno == EINVAL || errno == ENOSYS)){
+            char buf[BUFSIZ];
+            ssize_t rd = pread(fd, buf, len > sizeof(buf) ? sizeof(buf) : len, o);
+            if(rd < 0 && errno == EINTR) continue;
+            if(rd <= 0) break;
+            if(!tar_bytes(sock, buf, rd)) return 0;
+            w = rd;
+            o += rd;
+        } else if(w <= 0) {
+            if(w < 0 && errno != EIO && errno != EBADF) return 0;
+            break;
+        }
+        len -= w;
+    }
+    return tar_zeros(sock, len);
+}
+
+/* Stream the next len bytes of the archive to sock. Returns 0 if the
+ * socket failed. */
+static int tar_send(struct tar_stream *ts, int sock, uint64_t len){
+    while(len > 0){
+        if(ts->cur == ts->n){
+            // trailer: two zero blocks
+            uint64_t k = len;
+            if(!tar_zeros(sock, k)) return 0;
+            metrics_io(0, k);
+            ts->pos += k;
+            return 1;
+        }
+        struct tar_entry *e = &ts->ents[ts->cur];
+        uint64_t body = tar_round(e->size), k;
+        int ok;
+        if(ts->pos < e->hdr_len){
+            if(ts->pos == 0) tar_header(ts->hdr, e);
+            k = e->hdr_len - ts->pos < len ? e->hdr_len - ts->pos : len;
+            ok = tar_bytes(sock, ts->hdr + ts->pos, k);
+        } else if(ts->pos < e->hdr_len + e->size){
+            uint64_t off = ts->pos - e->hdr_len;
+            if(off == 0) ts->fd = open(e->path, O_RDONLY | O_CLOEXEC);
+            k = e->size - off < len ? e->size - off : len;
+            ok = tar_contents(sock, ts->fd, off, k);
+        } else {
+            k = e->hdr_len + body - ts->pos < len ? e->hdr_len + body - ts->pos : len;
+            ok = tar_zeros(sock, k);
+        }
+        if(!ok) return 0;
+        metrics_io(0, k);
+        ts->pos += k;
+        len -= k;
+        if(ts->pos == e->hdr_len + body){
+            if(ts->fd >= 0) close(ts->fd);
+            ts->fd = -1;
+            ts->cur++;
+            ts->pos = 0;
+        }
+    }
+    return 1;
+}
+
+/* Chunk payload adapter for large-object mode: chunks are asked for in
+ * order, so the cursor is always at off already */
+static int tar_payload(void *ctx, int sock, uint64_t off, uint64_t len){
+    (void)off;
+    return tar_send(ctx, sock, len);
+}
+
+/* ================= cached archives =================
+ * A server keeps one ready-made archive per file type in an unnamed file
+ * under the type's own root, so repeated downltar requests are a single
+ * sendfile(). The file holds the members only; the two trailer blocks are
+ * sent from memory. An archive larger than the cache's max (TAR_CACHE_MAX
+ * unless the server was told otherwise) is not kept at all: its requests
+ * stream one each, as without a cache.
+ *
+ * The archive is checked against the tree when the server's own upload or
+ * remove bumped the generation, or when the last check is TAR_CACHE_AGE
+ * seconds old. Members are compared by path, size, mtime and owner. New
+ * files are appended in place; otherwise a new file is assembled, with
+ * unchanged members copied over by copy_file_range() and only changed ones
+ * read from the tree.
+ *
+ * That work is done by a thread of its own, outside the lock, and the new
+ * archive replaces the old under the lock once it is whole. Requests never
+ * wait for it: while the archive is out of date they stream theirs as if
+ * there were no cache, so the first byte goes out just as soon. An archive
+ * that is merely due for its periodic check is still served meanwhile.
+ * Readers hold their own descriptor and never read past the member length
+ * they were given, so neither kind of update disturbs a download in
+ * progress.
+ */
+#define TAR_CACHE_AGE 30
+#define TAR_CACHE_MAX (1ULL << 30)      // largest archive kept by default
+
+struct tar_cache {
+    pthread_mutex_t lock;
+    struct tar_stream ts;   // members in archive order; ts.total = archive size
+    int fd;                 // the member bytes, -1 while there is no archive
+    unsigned gen;           // bumped by every upload and remove
+    unsigned seen;          // generation the archive was last checked at
+    time_t checked;
+    int building;           // a thread is making the next archive
+    uint64_t max;           // largest archive kept
+};
+
+#define TAR_CACHE_INIT { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1, .max = TAR_CACHE_MAX }
+
+/* What a thread building the next archive needs */
+struct tar_build {
+    struct tar_cache *c;
+    unsigned gen;           // generation it is checked at
+    char root[PATH_MAX];
+    char suffix[64];
+};
+
+/* Note a change under the cached tree (upload, remove) */
+static void tar_cache_touch(struct tar_cache *c){
+    __atomic_add_fetch(&c->gen, 1, __ATOMIC_RELEASE);
+}
+
+static int tar_same(const struct tar_entry *a, const struct tar_entry *b){
+    return a->size == b->size && a->mtime == b->mtime && a->mtime_ns == b->mtime_ns &&
+           a->mode == b->mode && a->uid == b->uid && a->gid == b->gid;
+}
+
+static int tar_cmp_path(const void *a, const void *b){
+    return strcmp((*(struct tar_entry *const *)a)->path, (*(struct tar_entry *const *)b)->path);
+}
+
+/* An unnamed file under dir, on the same disk as the files it archives */
+static int tar_cache_file(const char *dir){
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if(fd >= 0) return fd;
+    char path[PATH_MAX];
+    if(snprintf(path, sizeof(path), "%s/.s25tar.XXXXXX", dir) >= (int)sizeof(path)) return -1;
+    fd = mkostemp(path, O_CLOEXEC);
+    if(fd >= 0) unlink(path);
+    return fd;
+}
+
+/* Write member e at the current end of fd, a cache file whose members end
+ * at ts->total - trailer, and add it to the list */
+static int tar_cache_put(struct tar_stream *ts, int fd, struct tar_entry *e){
+    e->at = ts->total - 2 * TAR_BLOCK;
+    tar_header(ts->hdr, e);
+    int src = open(e->path, O_RDONLY | O_CLOEXEC);
+    int ok = tar_bytes(fd, ts->hdr, e->hdr_len) &&
+             tar_contents(fd, src, 0, e->size) &&
+             tar_zeros(fd, tar_round(e->size) - e->size);
+    if(src >= 0) close(src);
+    if(!ok || !tar_push(ts, e)) return 0;
+    e->path = NULL;         // owned by ts now
+    return 1;
+}
+
+/* Add a copy of member e of another list, starting at offset at */
+static int tar_cache_keep(struct tar_stream *ts, const struct tar_entry *e, uint64_t at){
+    struct tar_entry copy = *e;
+    copy.at = at;
+    if(!(copy.path = strdup(e->path))) return 0;
+    if(tar_push(ts, &copy)) return 1;
+    free(copy.path);
+    return 0;
+}
+
+/* Copy len bytes at off of one cache file to the end of another */
+static int tar_cache_copy(int to, int from, uint64_t off, uint64_t len){
+    loff_t o = off;
+    while(len > 0){
+        ssize_t w = copy_file_range(from, &o, to, NULL, len, 0);
+        if(w < 0 && errno == EINTR) continue;
+        if(w < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)){
+            char buf[BUFSIZ];
+            ssize_t rd = pread(from, buf, len > sizeof(buf) ? sizeof(buf) : len, o);
+            if(rd <= 0 || !tar_bytes(to, buf, rd)) return 0;
+            w = rd;
+            o += rd;
+        } else if(w <= 0) {
+            return 0;
+        }
+        len -= w;
+    }
+    return 1;
+}
+
+/* Make the archive that brings c's in line with the tree: its members in
+ * next and their bytes in the descriptor returned, or -1 when no archive
+ * is to be kept (too large, or out of memory or disk). Runs without the
+ * lock, as the only thread that changes c's archive until it is done;
+ * the current one stays as it is for the readers. */
+static int tar_cache_build(struct tar_cache *c, const char *root, const char *suffix,
+                           struct tar_stream *next){
+    struct tar_stream w;
+    tar_stream_init(next);
+    if(!tar_open(&w, root, suffix) || w.total > c->max){
+        tar_close(&w);
+        return -1;
+    }
+
+    // Match the tree against the archive by path
+    size_t n = c->fd >= 0 ? c->ts.n : 0, kept = 0;
+    struct tar_entry **idx = malloc((n + 1) * sizeof(*idx));
+    char *keep = calloc(n + 1, 1);
+    char *fresh = calloc(w.n + 1, 1);
+    int ok = idx && keep && fresh;
+    if(ok){
+        for(size_t i = 0; i < n; i++) idx[i] = &c->ts.ents[i];
+        qsort(idx, n, sizeof(*idx), tar_cmp_path);
+        for(size_t j = 0; j < w.n; j++){
+            struct tar_entry *key = &w.ents[j];
+            struct tar_entry **hit = bsearch(&key, idx, n, sizeof(*idx), tar_cmp_path);
+            if(hit && tar_same(*hit, key)){
+                keep[*hit - c->ts.ents] = 1;
+                kept++;
+            } else {
+                fresh[j] = 1;
+            }
+        }
+    }
+
+    int fd = -1;
+    if(ok && n > 0 && kept == n){
+        // Nothing removed or changed: append the new files in place, past
+        // the end every reader of the current archive stops at
+        fd = fcntl(c->fd, F_DUPFD_CLOEXEC, 0);
+        ok = fd >= 0 && lseek(fd, c->ts.total - 2 * TAR_BLOCK, SEEK_SET) >= 0;
+        for(size_t i = 0; ok && i < n; i++) ok = tar_cache_keep(next, &c->ts.ents[i], c->ts.ents[i].at);
+    } else if(ok){
+        // Assemble a new archive from the members that are still current
+        fd = tar_cache_file(root);
+        ok = fd >= 0;
+        for(size_t i = 0; ok && i < n; i++){
+            if(!keep[i]) continue;
+            const struct tar_entry *e = &c->ts.ents[i];
+            uint64_t len = e->hdr_len + tar_round(e->size);
+            ok = tar_cache_copy(fd, c->fd, e->at, len) &&
+                 tar_cache_keep(next, e, next->total - 2 * TAR_BLOCK);
+        }
+    }
+    for(size_t j = 0; ok && j < w.n; j++)
+        if(fresh[j]) ok = tar_cache_put(next, fd, &w.ents[j]);
+
+    free(idx);
+    free(keep);
+    free(fresh);
+    tar_close(&w);
+    if(!ok){
+        if(fd >= 0) close(fd);
+        tar_close(next);
+        return -1;
+    }
+    return fd;
+}
+
+/* Thread body: build the next archive and put it in place */
+static void *tar_cache_builder(void *arg){
+    struct tar_build *b = arg;
+    struct tar_cache *c = b->c;
+    struct tar_stream next;
+    int fd = tar_cache_build(c, b->root, b->suffix, &next);
+
+    pthread_mutex_lock(&c->lock);
+    if(c->fd >= 0) close(c->fd);
+    tar_close(&c->ts);
+    c->ts = next;
+    c->fd = fd;
+    c->seen = b->gen;
+    c->checked = time(NULL);
+    c->building = 0;
+    pthread_mutex_unlock(&c->lock);
+    free(b);
+    return NULL;
+}
+
+/* Start a thread on the next archive, unless one is at it; under the lock */
+static void tar_cache_rebuild(struct tar_cache *c, unsigned gen, const char *root, const char *suffix){
+    if(c->building) return;
+    struct tar_build *b = malloc(sizeof(*b));
+    if(!b) return;
+    b->c = c;
+    b->gen = gen;
+    snprintf(b->root, sizeof(b->root), "%s", root);
+    snprintf(b->suffix, sizeof(b->suffix), "%s", suffix);
+    pthread_t t;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if(pthread_create(&t, &attr, tar_cache_builder, b) == 0) {
+        c->building = 1;
+    } else {
+        free(b);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/* Get the current archive of root's files ending in suffix: a descriptor
+ * of its own for the member bytes and the archive size, trailer included.
+ * Returns the number of members, or -1 if there is no archive up to date
+ * (the caller then streams one instead); a new one is then on its way. */
+static long tar_cache_get(struct tar_cache *c, const char *root, const char *suffix,
+                          int *fd, uint64_t *size){
+    pthread_mutex_lock(&c->lock);
+    unsigned gen = __atomic_load_n(&c->gen, __ATOMIC_ACQUIRE);
+    time_t now = time(NULL);
+    int current = c->fd >= 0 && gen == c->seen;
+    // An archive found too large (or not made) is not tried again until
+    // the tree changes or is due for its check
+    if(c->max > 0 && (gen != c->seen || now - c->checked >= TAR_CACHE_AGE)){
+        tar_cache_rebuild(c, gen, root, suffix);
+    }
+    long n = -1;
+    if(current && (*fd = fcntl(c->fd, F_DUPFD_CLOEXEC, 0)) >= 0){
+        *size = c->ts.total;
+        n = (long)c->ts.n;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return n;
+}
+
+/* A cached archive being sent: member bytes from fd, then the trailer */
+struct tar_cached {
+    int fd;
+    uint64_t members;
+};
+
+/* Send len bytes of a cached archive from offset off; also serves as the
+ * chunk payload in large-object mode */
+static int tar_cached_payload(void *ctx, int sock, uint64_t off, uint64_t len){
+    struct tar_cached *a = ctx;
+    uint64_t k = off < a->members ? a->members - off : 0;
+    if(k > len) k = len;
+    if(k > 0 && !tar_contents(sock, a->fd, off, k)) return 0;
+    if(!tar_zeros(sock, len - k)) return 0;
+    metrics_io(0, len);
+    return 1;
+}
+
+#endif
@@ -0,0 +1,191 @@
+//s25token.h
+/* ================= redirect tokens =================
+ * S1 may send a client straight to the storage server that holds (or is
+ * to hold) a large file, so the file's bytes do not pass through S1 at
+ * all. The client shows that server a token S1 gave it: an expiry time
+ * and a MAC, SipHash-2-4 under a key S1 and the storage servers share, of
+ * the operation, the path on that server, the size (for uploads) and the
+ * expiry. The server recomputes the MAC, so a client can only read or
+ * write the one file S1 named, and only until the token expires,
+ * TOKEN_TTL seconds after it was issued.
+ *
+ * The key is the first TOKEN_KEY_LEN bytes of ~/.s25key, or of the file
+ * named with -k, e.g. made with
+ *
+ *     head -c 16 /dev/urandom > ~/.s25key && chmod 600 ~/.s25key
+ *
+ * and copied to every storage server. The same key signs S1's own requests
+ * to the storage servers (s25proto.h), so a server with a key takes
+ * requests from nobody else, and each of them only once. Without a key S1
+ * keeps every transfer on itself and storage servers refuse tokens. Expiry
+ * is checked against each machine's own clock, so the clocks must agree to
+ * well within the TTL.
+ */
+#ifndef S25TOKEN_H
+#define S25TOKEN_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define TOKEN_KEY_LEN 16
+#define TOKEN_TTL 30            // seconds a token stays valid
+#define TOKEN_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+/* What a client shows a storage server */
+struct s25_token {
+    uint64_t expiry;            // unix time
+    uint64_t mac;
+};
+
+static uint8_t token_key[TOKEN_KEY_LEN];
+static int token_ready;         // a key was loaded
+
+static inline uint64_t token_le64(const uint8_t *p){
+    uint64_t v = 0;
+    for(int i = 7; i >= 0; i--) v = v << 8 | p[i];
+    return v;
+}
+
+static inline void token_sipround(uint64_t *v){
+    v[0] += v[1]; v[1] = TOKEN_ROTL(v[1], 13); v[1] ^= v[0]; v[0] = TOKEN_ROTL(v[0], 32);
+    v[2] += v[3]; v[3] = TOKEN_ROTL(v[3], 16); v[3] ^= v[2];
+    v[0] += v[3]; v[3] = TOKEN_ROTL(v[3], 21); v[3] ^= v[0];
+    v[2] += v[1]; v[1] = TOKEN_ROTL(v[1], 17); v[1] ^= v[2]; v[2] = TOKEN_ROTL(v[2], 32);
+}
+
+/* SipHash-2-4 of len bytes at m under a 16-byte key */
+static inline uint64_t siphash24(const uint8_t *key, const void *m, size_t len){
+    const uint8_t *p = m;
+    uint64_t k0 = token_le64(key), k1 = token_le64(key + 8);
+    uint64_t v[4] = { k0 ^ 0x736f6d6570736575ULL, k1 ^ 0x646f72616e646f6dULL,
+                      k0 ^ 0x6c7967656e657261ULL, k1 ^ 0x7465646279746573ULL };
+    uint64_t last = (uint64_t)len << 56;
+    for(; len >= 8; p += 8, len -= 8){
+        uint64_t w = token_le64(p);
+        v[3] ^= w;
+        token_sipround(v);
+        token_sipround(v);
+        v[0] ^= w;
+    }
+    for(size_t i = 0; i < len; i++) last |= (uint64_t)p[i] << (8 * i);
+    v[3] ^= last;
+    token_sipround(v);
+    token_sipround(v);
+    v[0] ^= last;
+    v[2] ^= 0xff;
+    for(int i = 0; i < 4; i++) token_sipround(v);
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+/* Read the shared key from file. Returns 0 (and leaves tokens off) if
+ * there is none; a key others can read is refused. */
+static inline int token_load(const char *file){
+    struct stat st;
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return 0;
+    int ok = fstat(fd, &st) == 0;
+    if(ok && (st.st_mode & 077)) {
+        fprintf(stderr, "%s: ignored, the key must not be readable by others\n", file);
+        ok = 0;
+    }
+    if(ok && read(fd, token_key, TOKEN_KEY_LEN) != TOKEN_KEY_LEN) {
+        fprintf(stderr, "%s: a key is %d bytes\n", file, TOKEN_KEY_LEN);
+        ok = 0;
+    }
+    close(fd);
+    return token_ready = ok;
+}
+
+/* The MAC of a token for op on path (size bytes for uploads) */
+static inline uint64_t token_mac(int op, const char *path, uint64_t size, uint64_t expiry){
+    uint8_t m[17 + PATH_MAX];
+    size_t n = strnlen(path, PATH_MAX);
+    m[0] = (uint8_t)op;
+    for(int i = 0; i < 8; i++){
+        m[1 + i] = size >> (56 - 8 * i);
+        m[9 + i] = expiry >> (56 - 8 * i);
+    }
+    memcpy(m + 17, path, n);
+    return siphash24(token_key, m, 17 + n);
+}
+
+/* Are two MACs the same? Takes as long whatever bits differ, so a forger
+ * cannot find the MAC a byte at a time */
+static inline int token_equal(uint64_t a, uint64_t b){
+    uint64_t d = a ^ b;
+    return ((d | (0 - d)) >> 63) == 0;
+}
+
+/* MACs of the signed requests accepted and not yet expired (s25proto.h),
+ * so that none runs twice: open addressing on the MAC itself, rebuilt
+ * without the expired ones whenever it is half full */
+struct token_seen {
+    uint64_t mac;
+    uint64_t expiry;            // 0: a free slot
+};
+
+static struct token_seen *seen_slots;
+static size_t seen_cap, seen_used;
+static pthread_mutex_t seen_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Add mac to a table; 0 if it is there already */
+static inline int token_seen_add(struct token_seen *tab, size_t cap, uint64_t mac, uint64_t expiry){
+    for(size_t i = mac & (cap - 1); ; i = (i + 1) & (cap - 1)) {
+        if(tab[i].expiry == 0) {
+            tab[i].mac = mac;
+            tab[i].expiry = expiry;
+            return 1;
+        }
+        if(tab[i].mac == mac) return 0;
+    }
+}
+
+/* Is this the first time the signature with mac, good until expiry, is
+ * shown? Records it; refuses it when there is no memory to. */
+static inline int token_first_use(uint64_t mac, uint64_t expiry){
+    pthread_mutex_lock(&seen_lock);
+    if(2 * (seen_used + 1) > seen_cap) {
+        uint64_t now = (uint64_t)time(NULL);
+        size_t live = 0, cap = 1024;
+        for(size_t i = 0; i < seen_cap; i++) live += seen_slots[i].expiry >= now;
+        while(cap < 4 * (live + 1)) cap *= 2;
+        struct token_seen *tab = calloc(cap, sizeof(*tab));
+        if(!tab) {
+            pthread_mutex_unlock(&seen_lock);
+            return 0;
+        }
+        for(size_t i = 0; i < seen_cap; i++) {
+            if(seen_slots[i].expiry >= now) token_seen_add(tab, cap, seen_slots[i].mac, seen_slots[i].expiry);
+        }
+        free(seen_slots);
+        seen_slots = tab;
+        seen_cap = cap;
+        seen_used = live;
+    }
+    int first = token_seen_add(seen_slots, seen_cap, mac, expiry);
+    seen_used += first;
+    pthread_mutex_unlock(&seen_lock);
+    return first;
+}
+
+/* Issue a token for op on path */
+static inline void token_issue(struct s25_token *t, int op, const char *path, uint64_t size){
+    t->expiry = (uint64_t)time(NULL) + TOKEN_TTL;
+    t->mac = token_mac(op, path, size, t->expiry);
+}
+
+/* Is t a live token for op on path? */
+static inline int token_check(const struct s25_token *t, int op, const char *path, uint64_t size){
+    return token_ready && t->expiry >= (uint64_t)time(NULL) &&
+           token_equal(token_mac(op, path, size, t->expiry), t->mac);
+}
+
+#endif